@@ -0,0 +1,267 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include "PlutoSDR_DSP.hpp"
+
+// Sample converters between the iio_buffer layout and the SoapySDR stream formats.
+//
+// The iio_buffer holds interleaved I/Q per enabled channel:
+// - standard firmware: int16_t, RX 12 bit LSB aligned (fullscale 2048), TX MSB aligned (fullscale 32768)
+// - Tezuka CS8 transport: int8_t I/Q packed in the 16 bit voltage0 word
+//
+// Each converter is fully specialized over (raw type, stream format, channel count),
+// so the inner loops have no branches and fixed strides the compiler can vectorize.
+// The right one is selected once per stream and called through a function pointer.
+// RX converters optionally apply per channel DC/IQ correction in the same pass.
+
+typedef void (*pluto_rx_convert_fn)(const void *src, void * const *buffs, const size_t offset, const size_t items, const pluto_iq_coeffs *coeffs);
+typedef void (*pluto_tx_convert_fn)(const void * const *buffs, void *dst, const size_t items);
+
+struct pluto_fmt_cf32 {
+	typedef float value_type;
+	static const size_t values = 2;
+
+	static inline void put(float *d, const int16_t i, const int16_t q) { d[0] = float(i) / 2048.0f; d[1] = float(q) / 2048.0f; }
+	static inline void put(float *d, const int8_t i, const int8_t q) { d[0] = float(i) / 128.0f; d[1] = float(q) / 128.0f; }
+
+	static inline int16_t clip16(const float v) { return int16_t(std::min(std::max(v, -32768.0f), 32767.0f)); }
+	static inline int8_t clip8(const float v) { return int8_t(std::min(std::max(v, -128.0f), 127.0f)); }
+
+	static inline void get(const float *s, int16_t &i, int16_t &q) { i = clip16(s[0] * 32768.0f); q = clip16(s[1] * 32768.0f); }
+	static inline void get(const float *s, int8_t &i, int8_t &q) { i = clip8(s[0] * 128.0f); q = clip8(s[1] * 128.0f); }
+};
+
+struct pluto_fmt_cs16 {
+	typedef int16_t value_type;
+	static const size_t values = 2;
+
+	static inline void put(int16_t *d, const int16_t i, const int16_t q) { d[0] = i; d[1] = q; }
+	static inline void put(int16_t *d, const int8_t i, const int8_t q) { d[0] = int16_t(i * 256); d[1] = int16_t(q * 256); }
+
+	static inline void get(const int16_t *s, int16_t &i, int16_t &q) { i = s[0]; q = s[1]; }
+	static inline void get(const int16_t *s, int8_t &i, int8_t &q) { i = int8_t(s[0] >> 8); q = int8_t(s[1] >> 8); }
+};
+
+struct pluto_fmt_cs8 {
+	typedef int8_t value_type;
+	static const size_t values = 2;
+
+	static inline void put(int8_t *d, const int16_t i, const int16_t q) { d[0] = int8_t(i >> 4); d[1] = int8_t(q >> 4); }
+	static inline void put(int8_t *d, const int8_t i, const int8_t q) { d[0] = i; d[1] = q; }
+
+	static inline void get(const int8_t *s, int16_t &i, int16_t &q) { i = int16_t(s[0] * 256); q = int16_t(s[1] * 256); }
+	static inline void get(const int8_t *s, int8_t &i, int8_t &q) { i = s[0]; q = s[1]; }
+};
+
+// 24 bit (iiqIQQ): byte0 = i[7:0]; byte1 = {q[3:0], i[11:8]}; byte2 = q[11:4]
+struct pluto_fmt_cs12 {
+	typedef uint8_t value_type;
+	static const size_t values = 3;
+
+	static inline void put(uint8_t *d, const int16_t i, const int16_t q)
+	{
+		d[0] = uint8_t(i);
+		d[1] = uint8_t((q << 4) | ((i >> 8) & 0x0f));
+		d[2] = uint8_t(q >> 4);
+	}
+	static inline void put(uint8_t *d, const int8_t i, const int8_t q) { put(d, int16_t(i * 16), int16_t(q * 16)); }
+
+	static inline int16_t unpack_i(const uint8_t *s) { return int16_t(uint16_t((s[0] << 4) | (s[1] << 12))) >> 4; }
+	static inline int16_t unpack_q(const uint8_t *s) { return int16_t(uint16_t((s[1] & 0xf0) | (s[2] << 8))) >> 4; }
+
+	static inline void get(const uint8_t *s, int16_t &i, int16_t &q) { i = int16_t(unpack_i(s) * 16); q = int16_t(unpack_q(s) * 16); }
+	static inline void get(const uint8_t *s, int8_t &i, int8_t &q) { i = int8_t(unpack_i(s) >> 4); q = int8_t(unpack_q(s) >> 4); }
+};
+
+// fullscale of the raw samples, used when storing corrected samples as float
+template <typename Raw> struct pluto_raw_scale;
+template <> struct pluto_raw_scale<int16_t> { static constexpr float value = 1.0f / 2048.0f; };
+template <> struct pluto_raw_scale<int8_t> { static constexpr float value = 1.0f / 128.0f; };
+
+template <typename Raw>
+inline Raw pluto_round_raw(const float v)
+{
+	const float r = v + (v < 0.0f ? -0.5f : 0.5f);
+	return Raw(std::min(std::max(r, -32768.0f), 32767.0f));
+}
+
+template <>
+inline int8_t pluto_round_raw<int8_t>(const float v)
+{
+	const float r = v + (v < 0.0f ? -0.5f : 0.5f);
+	return int8_t(std::min(std::max(r, -128.0f), 127.0f));
+}
+
+// corrected samples are requantized to the raw type, except for CF32 which keeps the fraction
+template <typename Raw, typename Fmt>
+struct pluto_corrected_store {
+	static inline void put(typename Fmt::value_type *d, const float i, const float q) { Fmt::put(d, pluto_round_raw<Raw>(i), pluto_round_raw<Raw>(q)); }
+};
+
+template <typename Raw>
+struct pluto_corrected_store<Raw, pluto_fmt_cf32> {
+	static inline void put(float *d, const float i, const float q) { d[0] = i * pluto_raw_scale<Raw>::value; d[1] = q * pluto_raw_scale<Raw>::value; }
+};
+
+template <typename Raw, typename Fmt, size_t Channels>
+void pluto_rx_convert_corrected(const void *src, void * const *buffs, const size_t offset, const size_t items, const pluto_iq_coeffs *coeffs)
+{
+	const Raw *in = (const Raw *)src;
+
+	for (size_t c = 0; c < Channels; c++) {
+		typename Fmt::value_type *out = (typename Fmt::value_type *)buffs[c] + offset * Fmt::values;
+		const Raw *chan_in = in + 2 * c;
+		const pluto_iq_coeffs k = coeffs[c];
+
+		for (size_t n = 0; n < items; n++) {
+			const float i = float(chan_in[n * 2 * Channels]) - k.dc_i;
+			const float q = float(chan_in[n * 2 * Channels + 1]) - k.dc_q;
+			pluto_corrected_store<Raw, Fmt>::put(out + n * Fmt::values, i, k.k_qq * q + k.k_qi * i);
+		}
+	}
+}
+
+template <typename Raw, typename Fmt, size_t Channels>
+void pluto_rx_convert(const void *src, void * const *buffs, const size_t offset, const size_t items, const pluto_iq_coeffs *coeffs)
+{
+	const Raw *in = (const Raw *)src;
+
+	for (size_t c = 0; c < Channels; c++) {
+		typename Fmt::value_type *out = (typename Fmt::value_type *)buffs[c] + offset * Fmt::values;
+		const Raw *chan_in = in + 2 * c;
+
+		for (size_t k = 0; k < items; k++) {
+			Fmt::put(out + k * Fmt::values, chan_in[k * 2 * Channels], chan_in[k * 2 * Channels + 1]);
+		}
+	}
+}
+
+template <typename Fmt, typename Raw, size_t Channels>
+void pluto_tx_convert(const void * const *buffs, void *dst, const size_t items)
+{
+	Raw *out = (Raw *)dst;
+
+	for (size_t c = 0; c < Channels; c++) {
+		const typename Fmt::value_type *in = (const typename Fmt::value_type *)buffs[c];
+		Raw *chan_out = out + 2 * c;
+
+		for (size_t k = 0; k < items; k++) {
+			Fmt::get(in + k * Fmt::values, chan_out[k * 2 * Channels], chan_out[k * 2 * Channels + 1]);
+		}
+	}
+}
+
+// The host DSP stages work on complex floats in raw sample units, one channel at a time.
+// These converters bring a channel into that domain and back to the stream format.
+
+typedef void (*pluto_rx_to_float_fn)(const void *src, const size_t channel, float *out, const size_t items, const pluto_iq_coeffs &coeffs);
+typedef void (*pluto_rx_from_float_fn)(const float *in, void *dst, const size_t offset, const size_t items);
+typedef void (*pluto_tx_to_float_fn)(const void *src, const size_t offset, float *out, const size_t items);
+typedef void (*pluto_tx_from_float_fn)(const float *in, const size_t channel, void *dst, const size_t items);
+
+template <typename Raw, size_t Channels>
+void pluto_rx_to_float(const void *src, const size_t channel, float *out, const size_t items, const pluto_iq_coeffs &k)
+{
+	const Raw *in = (const Raw *)src + 2 * channel;
+
+	for (size_t n = 0; n < items; n++) {
+		const float i = float(in[n * 2 * Channels]) - k.dc_i;
+		const float q = float(in[n * 2 * Channels + 1]) - k.dc_q;
+		out[2 * n] = i;
+		out[2 * n + 1] = k.k_qq * q + k.k_qi * i;
+	}
+}
+
+template <typename Raw, typename Fmt>
+void pluto_rx_from_float(const float *in, void *dst, const size_t offset, const size_t items)
+{
+	typename Fmt::value_type *out = (typename Fmt::value_type *)dst + offset * Fmt::values;
+
+	for (size_t n = 0; n < items; n++)
+		pluto_corrected_store<Raw, Fmt>::put(out + n * Fmt::values, in[2 * n], in[2 * n + 1]);
+}
+
+// integer formats go through the raw type, they don't carry more precision than the DAC
+template <typename Fmt, typename Raw>
+struct pluto_tx_float_load {
+	static inline void get(const typename Fmt::value_type *s, float &i, float &q)
+	{
+		Raw ri, rq;
+		Fmt::get(s, ri, rq);
+		i = float(ri);
+		q = float(rq);
+	}
+};
+
+template <typename Raw>
+struct pluto_tx_float_load<pluto_fmt_cf32, Raw> {
+	static inline void get(const float *s, float &i, float &q)
+	{
+		const float scale = (sizeof(Raw) == 1) ? 128.0f : 32768.0f;
+		i = s[0] * scale;
+		q = s[1] * scale;
+	}
+};
+
+template <typename Fmt, typename Raw>
+void pluto_tx_to_float(const void *src, const size_t offset, float *out, const size_t items)
+{
+	const typename Fmt::value_type *in = (const typename Fmt::value_type *)src + offset * Fmt::values;
+
+	for (size_t n = 0; n < items; n++)
+		pluto_tx_float_load<Fmt, Raw>::get(in + n * Fmt::values, out[2 * n], out[2 * n + 1]);
+}
+
+template <typename Raw, size_t Channels>
+void pluto_tx_from_float(const float *in, const size_t channel, void *dst, const size_t items)
+{
+	Raw *out = (Raw *)dst + 2 * channel;
+
+	for (size_t n = 0; n < items; n++) {
+		out[n * 2 * Channels] = pluto_round_raw<Raw>(in[2 * n]);
+		out[n * 2 * Channels + 1] = pluto_round_raw<Raw>(in[2 * n + 1]);
+	}
+}
+
+template <typename Raw>
+pluto_rx_from_float_fn pluto_select_rx_from_float(const bool cf32, const bool cs16, const bool cs12)
+{
+	if (cf32) return &pluto_rx_from_float<Raw, pluto_fmt_cf32>;
+	if (cs16) return &pluto_rx_from_float<Raw, pluto_fmt_cs16>;
+	if (cs12) return &pluto_rx_from_float<Raw, pluto_fmt_cs12>;
+	return &pluto_rx_from_float<Raw, pluto_fmt_cs8>;
+}
+
+template <typename Raw>
+pluto_tx_to_float_fn pluto_select_tx_to_float(const bool cf32, const bool cs16, const bool cs12)
+{
+	if (cf32) return &pluto_tx_to_float<pluto_fmt_cf32, Raw>;
+	if (cs16) return &pluto_tx_to_float<pluto_fmt_cs16, Raw>;
+	if (cs12) return &pluto_tx_to_float<pluto_fmt_cs12, Raw>;
+	return &pluto_tx_to_float<pluto_fmt_cs8, Raw>;
+}
+
+template <typename Raw, size_t Channels>
+pluto_rx_convert_fn pluto_select_rx_converter(const bool cf32, const bool cs16, const bool cs12, const bool corrected)
+{
+	if (corrected) {
+		if (cf32) return &pluto_rx_convert_corrected<Raw, pluto_fmt_cf32, Channels>;
+		if (cs16) return &pluto_rx_convert_corrected<Raw, pluto_fmt_cs16, Channels>;
+		if (cs12) return &pluto_rx_convert_corrected<Raw, pluto_fmt_cs12, Channels>;
+		return &pluto_rx_convert_corrected<Raw, pluto_fmt_cs8, Channels>;
+	}
+	if (cf32) return &pluto_rx_convert<Raw, pluto_fmt_cf32, Channels>;
+	if (cs16) return &pluto_rx_convert<Raw, pluto_fmt_cs16, Channels>;
+	if (cs12) return &pluto_rx_convert<Raw, pluto_fmt_cs12, Channels>;
+	return &pluto_rx_convert<Raw, pluto_fmt_cs8, Channels>;
+}
+
+template <typename Raw, size_t Channels>
+pluto_tx_convert_fn pluto_select_tx_converter(const bool cf32, const bool cs16, const bool cs12)
+{
+	if (cf32) return &pluto_tx_convert<pluto_fmt_cf32, Raw, Channels>;
+	if (cs16) return &pluto_tx_convert<pluto_fmt_cs16, Raw, Channels>;
+	if (cs12) return &pluto_tx_convert<pluto_fmt_cs12, Raw, Channels>;
+	return &pluto_tx_convert<pluto_fmt_cs8, Raw, Channels>;
+}
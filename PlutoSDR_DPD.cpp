@@ -0,0 +1,392 @@
+#include "PlutoSDR_DSP.hpp"
+#include <cmath>
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+pluto_dpd::pluto_dpd(const pluto_dpd_coeffs &coeffs, const float full_scale):
+	order(std::max<size_t>(coeffs.order, 1)), memory(std::max<size_t>(coeffs.memory, 1)),
+	inv_full_scale(1.0f / full_scale)
+{
+	coeff_i.assign(order * memory, 0.0f);
+	coeff_q.assign(order * memory, 0.0f);
+
+	// missing coefficients leave the signal untouched
+	if (coeffs.values.size() == order * memory) {
+		for (size_t k = 0; k < coeffs.values.size(); k++) {
+			coeff_i[k] = coeffs.values[k].real();
+			coeff_q[k] = coeffs.values[k].imag();
+		}
+	}
+	else {
+		coeff_i[0] = 1.0f;
+	}
+
+	reset();
+}
+
+std::string pluto_dpd::name() const
+{
+	return "dpd";
+}
+
+void pluto_dpd::reset()
+{
+	hist_i.assign(memory - 1, 0.0f);
+	hist_q.assign(memory - 1, 0.0f);
+}
+
+void pluto_dpd::process(const float *in, const size_t items, std::vector<float> &out)
+{
+	const size_t kept = memory - 1;
+	const size_t total = kept + items;
+
+	hist_i.resize(total);
+	hist_q.resize(total);
+	for (size_t n = 0; n < items; n++) {
+		hist_i[kept + n] = in[2 * n];
+		hist_q[kept + n] = in[2 * n + 1];
+	}
+
+	magnitude.resize(total);
+	for (size_t n = 0; n < total; n++)
+		magnitude[n] = std::sqrt(hist_i[n] * hist_i[n] + hist_q[n] * hist_q[n]) * inv_full_scale;
+
+	acc_i.assign(items, 0.0f);
+	acc_q.assign(items, 0.0f);
+
+	// basis x * |x|^k over the history, then accumulated at each memory delay
+	basis_i = hist_i;
+	basis_q = hist_q;
+	for (size_t k = 0; k < order; k++) {
+		if (k > 0) {
+			for (size_t n = 0; n < total; n++) {
+				basis_i[n] *= magnitude[n];
+				basis_q[n] *= magnitude[n];
+			}
+		}
+
+		for (size_t m = 0; m < memory; m++) {
+			const float ci = coeff_i[k * memory + m];
+			const float cq = coeff_q[k * memory + m];
+			if (ci == 0.0f && cq == 0.0f)
+				continue;
+
+			const float *bi = basis_i.data() + kept - m;
+			const float *bq = basis_q.data() + kept - m;
+			for (size_t n = 0; n < items; n++) {
+				acc_i[n] += ci * bi[n] - cq * bq[n];
+				acc_q[n] += ci * bq[n] + cq * bi[n];
+			}
+		}
+	}
+
+	const size_t first = out.size();
+	out.resize(first + 2 * items);
+	float *dst = out.data() + first;
+	for (size_t n = 0; n < items; n++) {
+		dst[2 * n] = acc_i[n];
+		dst[2 * n + 1] = acc_q[n];
+	}
+
+	hist_i.erase(hist_i.begin(), hist_i.begin() + items);
+	hist_q.erase(hist_q.begin(), hist_q.begin() + items);
+}
+
+pluto_pa_model::pluto_pa_model(const float _full_scale, const float _memory):
+	full_scale(_full_scale), memory(std::min(std::max(_memory, 0.0f), 0.9f)),
+	alpha_a(2.1587f), beta_a(1.1517f), alpha_p(4.0033f), beta_p(9.1040f)
+{
+	reset();
+}
+
+std::string pluto_pa_model::name() const
+{
+	return "pa_model";
+}
+
+void pluto_pa_model::reset()
+{
+	last_i = 0.0f;
+	last_q = 0.0f;
+}
+
+void pluto_pa_model::process(const float *in, const size_t items, std::vector<float> &out)
+{
+	const size_t first = out.size();
+	out.resize(first + 2 * items);
+	float *dst = out.data() + first;
+
+	for (size_t n = 0; n < items; n++) {
+		// memory filter with unity DC gain, then the static nonlinearity
+		const float i = ((1.0f - memory) * in[2 * n] + memory * last_i) / full_scale;
+		const float q = ((1.0f - memory) * in[2 * n + 1] + memory * last_q) / full_scale;
+		last_i = in[2 * n];
+		last_q = in[2 * n + 1];
+
+		const float r = std::sqrt(i * i + q * q);
+		if (r < 1e-12f) {
+			dst[2 * n] = 0.0f;
+			dst[2 * n + 1] = 0.0f;
+			continue;
+		}
+
+		const float r2 = r * r;
+		const float amplitude = alpha_a * r / (1.0f + beta_a * r2);
+		const float phase = alpha_p * r2 / (1.0f + beta_p * r2);
+		const float c = std::cos(phase), s = std::sin(phase);
+		const float scale = amplitude / r * full_scale;
+
+		dst[2 * n] = (i * c - q * s) * scale;
+		dst[2 * n + 1] = (i * s + q * c) * scale;
+	}
+}
+
+// bounds the order * memory least squares system solved on the caller's thread
+static const size_t dpd_max_coeffs = 256;
+
+bool pluto_parse_dpd_coeffs(const std::string &text, pluto_dpd_coeffs &coeffs)
+{
+	std::string numbers = text;
+	std::replace(numbers.begin(), numbers.end(), ',', ' ');
+	std::istringstream list(numbers);
+	list.imbue(std::locale::classic());
+
+	pluto_dpd_coeffs parsed;
+	if (!(list >> parsed.order >> parsed.memory) || parsed.order == 0 || parsed.memory == 0 ||
+		parsed.order > dpd_max_coeffs / parsed.memory)
+		return false;
+
+	float re, im;
+	while (list >> re >> im)
+		parsed.values.push_back(std::complex<float>(re, im));
+
+	if (parsed.values.size() != parsed.order * parsed.memory)
+		return false;
+
+	coeffs = parsed;
+	return true;
+}
+
+std::string pluto_format_dpd_coeffs(const pluto_dpd_coeffs &coeffs)
+{
+	std::ostringstream text;
+	text.imbue(std::locale::classic());
+	text.precision(9);
+	text << coeffs.order << " " << coeffs.memory;
+	for (const auto &c : coeffs.values)
+		text << " " << c.real() << " " << c.imag();
+	return text.str();
+}
+
+// solve a * x = b in place with partial pivoting, a is n x n row major
+static bool solve_complex(std::vector<std::complex<double>> &a, std::vector<std::complex<double>> &b, const size_t n)
+{
+	for (size_t col = 0; col < n; col++) {
+		size_t pivot = col;
+		for (size_t row = col + 1; row < n; row++) {
+			if (std::abs(a[row * n + col]) > std::abs(a[pivot * n + col]))
+				pivot = row;
+		}
+		if (std::abs(a[pivot * n + col]) < 1e-300)
+			return false;
+
+		if (pivot != col) {
+			for (size_t k = 0; k < n; k++)
+				std::swap(a[col * n + k], a[pivot * n + k]);
+			std::swap(b[col], b[pivot]);
+		}
+
+		for (size_t row = col + 1; row < n; row++) {
+			const std::complex<double> f = a[row * n + col] / a[col * n + col];
+			for (size_t k = col; k < n; k++)
+				a[row * n + k] -= f * a[col * n + k];
+			b[row] -= f * b[col];
+		}
+	}
+
+	for (size_t col = n; col-- > 0;) {
+		std::complex<double> sum = b[col];
+		for (size_t k = col + 1; k < n; k++)
+			sum -= a[col * n + k] * b[k];
+		b[col] = sum / a[col * n + col];
+	}
+
+	return true;
+}
+
+pluto_dpd_coeffs pluto_dpd_train(const float *tx, const float *rx, const size_t items, const size_t order, const size_t memory, const float full_scale)
+{
+	pluto_dpd_coeffs coeffs;
+	coeffs.order = std::max<size_t>(order, 1);
+	coeffs.memory = std::max<size_t>(memory, 1);
+	if (coeffs.order > dpd_max_coeffs / coeffs.memory)
+		throw std::runtime_error("the predistorter is limited to " + std::to_string(dpd_max_coeffs) + " coefficients (order * memory)");
+	const size_t nb_coeffs = coeffs.order * coeffs.memory;
+
+	if (items < 4 * nb_coeffs + 64)
+		throw std::runtime_error("not enough samples to train the predistorter");
+
+	typedef std::complex<double> cd;
+	std::vector<cd> u(items), y(items);
+	for (size_t n = 0; n < items; n++) {
+		u[n] = cd(tx[2 * n], tx[2 * n + 1]) / double(full_scale);
+		y[n] = cd(rx[2 * n], rx[2 * n + 1]) / double(full_scale);
+	}
+
+	// the capture may lag the transmission, align on the correlation peak
+	const size_t max_lag = std::min<size_t>(64, items / 4);
+	size_t lag = 0;
+	double best = -1.0;
+	for (size_t l = 0; l <= max_lag; l++) {
+		cd corr = 0.0;
+		for (size_t n = 0; n + l < items; n++)
+			corr += y[n + l] * std::conj(u[n]);
+		if (std::abs(corr) > best) {
+			best = std::abs(corr);
+			lag = l;
+		}
+	}
+
+	const size_t count = items - lag;
+	cd cross = 0.0;
+	double energy = 0.0;
+	for (size_t n = 0; n < count; n++) {
+		cross += y[n + lag] * std::conj(u[n]);
+		energy += std::norm(u[n]);
+	}
+	if (energy <= 0.0 || std::abs(cross) <= 0.0)
+		throw std::runtime_error("the predistorter training capture is silent");
+
+	// the PA output without its linear gain, aligned on the input
+	const cd gain = cross / energy;
+	std::vector<cd> z(count);
+	for (size_t n = 0; n < count; n++)
+		z[n] = y[n + lag] / gain;
+
+	// normal equations of the postdistorter u = sum c * z[n - m] * |z[n - m]|^k
+	std::vector<cd> r(nb_coeffs * nb_coeffs, 0.0), b(nb_coeffs, 0.0), phi(nb_coeffs);
+	for (size_t n = coeffs.memory - 1; n < count; n++) {
+		for (size_t m = 0; m < coeffs.memory; m++) {
+			const cd s = z[n - m];
+			const double mag = std::abs(s);
+			cd basis = s;
+			for (size_t k = 0; k < coeffs.order; k++) {
+				phi[k * coeffs.memory + m] = basis;
+				basis *= mag;
+			}
+		}
+
+		for (size_t p = 0; p < nb_coeffs; p++) {
+			const cd conj_p = std::conj(phi[p]);
+			for (size_t q = p; q < nb_coeffs; q++)
+				r[p * nb_coeffs + q] += conj_p * phi[q];
+			b[p] += conj_p * u[n];
+		}
+	}
+
+	// mirror the upper triangle and load the diagonal slightly
+	double trace = 0.0;
+	for (size_t p = 0; p < nb_coeffs; p++) {
+		trace += r[p * nb_coeffs + p].real();
+		for (size_t q = 0; q < p; q++)
+			r[p * nb_coeffs + q] = std::conj(r[q * nb_coeffs + p]);
+	}
+	for (size_t p = 0; p < nb_coeffs; p++)
+		r[p * nb_coeffs + p] += 1e-9 * trace / nb_coeffs;
+
+	if (!solve_complex(r, b, nb_coeffs))
+		throw std::runtime_error("the predistorter training is ill conditioned");
+
+	for (const auto &c : b)
+		coeffs.values.push_back(std::complex<float>(float(c.real()), float(c.imag())));
+
+	return coeffs;
+}
+
+// run a whole signal through a stage in DSP block sized pieces
+static std::vector<float> run_stage(pluto_dsp_stage &stage, const std::vector<float> &in)
+{
+	std::vector<float> out;
+	const size_t items = in.size() / 2;
+	for (size_t done = 0; done < items; done += pluto_dsp_block_items)
+		stage.process(in.data() + 2 * done, std::min(pluto_dsp_block_items, items - done), out);
+	return out;
+}
+
+// error of the PA output against the undistorted signal, in dB, after removing the linear gain
+static double normalized_error_db(const std::vector<float> &reference, const std::vector<float> &output)
+{
+	typedef std::complex<double> cd;
+	const size_t items = std::min(reference.size(), output.size()) / 2;
+
+	cd cross = 0.0;
+	double energy = 0.0;
+	for (size_t n = 0; n < items; n++) {
+		const cd x(reference[2 * n], reference[2 * n + 1]);
+		cross += cd(output[2 * n], output[2 * n + 1]) * std::conj(x);
+		energy += std::norm(x);
+	}
+	const cd gain = cross / energy;
+
+	double error = 0.0;
+	for (size_t n = 0; n < items; n++) {
+		const cd x(reference[2 * n], reference[2 * n + 1]);
+		error += std::norm(cd(output[2 * n], output[2 * n + 1]) / gain - x);
+	}
+
+	return 10.0 * std::log10(std::max(error / energy, 1e-20));
+}
+
+std::string pluto_dpd_selftest(const size_t order, const size_t memory)
+{
+	const float full_scale = 32768.0f;
+	const size_t items = 1 << 16;
+	const size_t iterations = 3;
+
+	// band limited noise at -20 dBFS RMS, its peaks drive the model into compression
+	std::mt19937 rng(1);
+	std::normal_distribution<float> noise(0.0f, 1.0f);
+	std::vector<float> white(2 * items);
+	for (auto &v : white)
+		v = noise(rng);
+
+	pluto_fir_filter shaping(0.15, 63);
+	std::vector<float> signal = run_stage(shaping, white);
+	double power = 0.0;
+	for (const auto &v : signal)
+		power += double(v) * v;
+	const float scale = float(0.1 * full_scale / std::sqrt(power / items));
+	for (auto &v : signal)
+		v *= scale;
+
+	pluto_pa_model pa(full_scale, 0.2f);
+	const double before_db = normalized_error_db(signal, run_stage(pa, signal));
+
+	// indirect learning: each pass fits the postdistorter of the current PA input
+	pluto_dpd_coeffs coeffs;
+	coeffs.order = order;
+	coeffs.memory = memory;
+	std::vector<float> drive = signal;
+	double after_db = before_db;
+
+	for (size_t pass = 0; pass < iterations; pass++) {
+		pa.reset();
+		const std::vector<float> output = run_stage(pa, drive);
+		coeffs = pluto_dpd_train(drive.data(), output.data(), items, order, memory, full_scale);
+
+		pluto_dpd dpd(coeffs, full_scale);
+		drive = run_stage(dpd, signal);
+
+		pa.reset();
+		after_db = normalized_error_db(signal, run_stage(pa, drive));
+	}
+
+	std::ostringstream report;
+	report.imbue(std::locale::classic());
+	report << "nmse_without_dpd_db=" << before_db;
+	report << ",nmse_with_dpd_db=" << after_db;
+	report << ",coeffs=" << pluto_format_dpd_coeffs(coeffs);
+	return report.str();
+}
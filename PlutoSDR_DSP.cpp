@@ -0,0 +1,1464 @@
+#include "SoapyPlutoSDR.hpp"
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+pluto_iq_corrector::pluto_iq_corrector():
+	dc_enabled(false), iq_enabled(false), decimation(16), alpha(0.05),
+	mean_i(0.0), mean_q(0.0), p_ii(0.0), p_qq(0.0), p_iq(0.0), primed(false)
+{
+	refresh();
+}
+
+void pluto_iq_corrector::set_dc_mode(const bool automatic)
+{
+	dc_enabled = automatic;
+	refresh();
+}
+
+bool pluto_iq_corrector::dc_mode() const
+{
+	return dc_enabled;
+}
+
+void pluto_iq_corrector::set_iq_mode(const bool automatic)
+{
+	iq_enabled = automatic;
+	refresh();
+}
+
+bool pluto_iq_corrector::iq_mode() const
+{
+	return iq_enabled;
+}
+
+void pluto_iq_corrector::estimate(const int16_t *src, const size_t stride, const size_t items)
+{
+	accumulate(src, stride, items);
+}
+
+void pluto_iq_corrector::estimate(const int8_t *src, const size_t stride, const size_t items)
+{
+	accumulate(src, stride, items);
+}
+
+const pluto_iq_coeffs &pluto_iq_corrector::coeffs() const
+{
+	return coefficients;
+}
+
+template <typename Raw>
+void pluto_iq_corrector::accumulate(const Raw *src, const size_t stride, const size_t items)
+{
+	if (!dc_enabled && !iq_enabled)
+		return;
+
+	double sum_i = 0.0, sum_q = 0.0, sum_ii = 0.0, sum_qq = 0.0, sum_iq = 0.0;
+	size_t count = 0;
+
+	for (size_t k = 0; k < items; k += decimation) {
+		const double i = src[k * stride];
+		const double q = src[k * stride + 1];
+		sum_i += i;
+		sum_q += q;
+		sum_ii += i * i;
+		sum_qq += q * q;
+		sum_iq += i * q;
+		count++;
+	}
+
+	if (count == 0)
+		return;
+
+	// block statistics, folded into the running estimates with an exponential average
+	const double block_i = sum_i / count;
+	const double block_q = sum_q / count;
+	const double block_ii = sum_ii / count - block_i * block_i;
+	const double block_qq = sum_qq / count - block_q * block_q;
+	const double block_iq = sum_iq / count - block_i * block_q;
+
+	const double a = primed ? alpha : 1.0;
+	mean_i += a * (block_i - mean_i);
+	mean_q += a * (block_q - mean_q);
+	p_ii += a * (block_ii - p_ii);
+	p_qq += a * (block_qq - p_qq);
+	p_iq += a * (block_iq - p_iq);
+	primed = true;
+
+	refresh();
+}
+
+void pluto_iq_corrector::refresh()
+{
+	coefficients.dc_i = dc_enabled ? float(mean_i) : 0.0f;
+	coefficients.dc_q = dc_enabled ? float(mean_q) : 0.0f;
+	coefficients.k_qq = 1.0f;
+	coefficients.k_qi = 0.0f;
+
+	if (!iq_enabled || p_ii <= 0.0 || p_qq <= 0.0)
+		return;
+
+	// Q = g * (I * sin(phi) + I90 * cos(phi)), with g = sqrt(p_qq / p_ii) and sin(phi) = p_iq / sqrt(p_ii * p_qq)
+	const double sin_phi = p_iq / std::sqrt(p_ii * p_qq);
+	const double cos_phi = std::sqrt(std::max(1e-6, 1.0 - sin_phi * sin_phi));
+
+	coefficients.k_qq = float(std::sqrt(p_ii / p_qq) / cos_phi);
+	coefficients.k_qi = float(-sin_phi / cos_phi);
+}
+
+static double stage_arg(const SoapySDR::Kwargs &args, const std::string &key, const double fallback)
+{
+	if (args.count(key) == 0)
+		return fallback;
+
+	try
+	{
+		return std::stod(args.at(key));
+	}
+	catch (const std::invalid_argument &){}
+
+	return fallback;
+}
+
+static std::mutex stage_registry_mutex;
+
+static std::map<std::string, pluto_dsp_stage_factory> &stage_registry()
+{
+	static std::map<std::string, pluto_dsp_stage_factory> registry = {
+		{ "dc_block", [](const SoapySDR::Kwargs &args) {
+			return std::unique_ptr<pluto_dsp_stage>(new pluto_dc_blocker(float(stage_arg(args, "dc_block_alpha", 1e-3))));
+		} },
+		{ "fir", [](const SoapySDR::Kwargs &args) {
+			return std::unique_ptr<pluto_dsp_stage>(new pluto_fir_filter(stage_arg(args, "fir_cutoff", 0.25),
+				size_t(stage_arg(args, "fir_length", 63))));
+		} },
+		{ "dpd", [](const SoapySDR::Kwargs &args) {
+			pluto_dpd_coeffs coeffs{ 1, 1, {} };
+			if (args.count("dpd_coeffs") != 0)
+				pluto_parse_dpd_coeffs(args.at("dpd_coeffs"), coeffs);
+			return std::unique_ptr<pluto_dsp_stage>(new pluto_dpd(coeffs, float(stage_arg(args, "dsp_full_scale", 32768.0))));
+		} },
+		{ "pa_model", [](const SoapySDR::Kwargs &args) {
+			return std::unique_ptr<pluto_dsp_stage>(new pluto_pa_model(float(stage_arg(args, "dsp_full_scale", 32768.0)),
+				float(stage_arg(args, "pa_memory", 0.2))));
+		} },
+		{ "cfr", [](const SoapySDR::Kwargs &args) {
+			const bool window = (args.count("cfr_method") != 0 && args.at("cfr_method") == "peak_window");
+			return std::unique_ptr<pluto_dsp_stage>(new pluto_cfr(window ? pluto_cfr::PEAK_WINDOW : pluto_cfr::CLIP_FILTER,
+				stage_arg(args, "cfr_papr", 7.0), stage_arg(args, "cfr_evm", 8.0), size_t(stage_arg(args, "cfr_iterations", 2)),
+				stage_arg(args, "cfr_cutoff", 0.4), size_t(stage_arg(args, "cfr_length", 33))));
+		} },
+	};
+
+	return registry;
+}
+
+void pluto_register_dsp_stage(const std::string &name, const pluto_dsp_stage_factory &factory)
+{
+	std::lock_guard<std::mutex> lock(stage_registry_mutex);
+	stage_registry()[name] = factory;
+}
+
+std::unique_ptr<pluto_dsp_stage> pluto_make_dsp_stage(const std::string &name, const SoapySDR::Kwargs &args)
+{
+	pluto_dsp_stage_factory factory;
+	{
+		std::lock_guard<std::mutex> lock(stage_registry_mutex);
+		auto it = stage_registry().find(name);
+		if (it == stage_registry().end())
+			throw std::runtime_error("unknown DSP stage " + name);
+		factory = it->second;
+	}
+
+	return factory(args);
+}
+
+std::vector<std::string> pluto_list_dsp_stages()
+{
+	std::lock_guard<std::mutex> lock(stage_registry_mutex);
+	std::vector<std::string> names;
+	for (const auto &entry : stage_registry())
+		names.push_back(entry.first);
+	return names;
+}
+
+void pluto_dsp_chain::push_front(std::unique_ptr<pluto_dsp_stage> stage)
+{
+	timings.insert(timings.begin(), pluto_dsp_stage_stats{ stage->name(), 0, 0, 0 });
+	stages.insert(stages.begin(), std::move(stage));
+}
+
+void pluto_dsp_chain::push_back(std::unique_ptr<pluto_dsp_stage> stage)
+{
+	timings.push_back(pluto_dsp_stage_stats{ stage->name(), 0, 0, 0 });
+	stages.push_back(std::move(stage));
+}
+
+bool pluto_dsp_chain::empty() const
+{
+	return stages.empty();
+}
+
+void pluto_dsp_chain::process(const float *in, const size_t items, std::vector<float> &out)
+{
+	const float *src = in;
+	size_t count = items;
+
+	for (size_t k = 0; k < stages.size(); k++) {
+		// the last stage appends straight to out, the others alternate between the scratch vectors
+		const bool last = (k + 1 == stages.size());
+		std::vector<float> &dst = last ? out : ((k & 1) ? pong : ping);
+		const size_t before_size = last ? out.size() : 0;
+		if (!last)
+			dst.clear();
+
+		auto before = std::chrono::steady_clock::now();
+		stages[k]->process(src, count, dst);
+		timings[k].ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - before).count();
+
+		timings[k].items_in += count;
+		count = (dst.size() - before_size) / 2;
+		timings[k].items_out += count;
+		src = dst.data() + before_size;
+	}
+}
+
+void pluto_build_tx_chain(pluto_dsp_chain &chain, const std::vector<std::string> &names,
+	const SoapySDR::Kwargs &args, const double app_rate, const double hw_rate)
+{
+	if (app_rate > 0.0 && hw_rate > 0.0)
+		chain.push_back(std::unique_ptr<pluto_dsp_stage>(new pluto_resampler(app_rate, hw_rate)));
+	for (const auto &name : names)
+		chain.push_back(pluto_make_dsp_stage(name, args));
+}
+
+void pluto_dsp_chain::reset()
+{
+	for (auto &stage : stages)
+		stage->reset();
+}
+
+const std::vector<pluto_dsp_stage_stats> &pluto_dsp_chain::stats() const
+{
+	return timings;
+}
+
+std::string pluto_dsp_chain::report() const
+{
+	std::string reports;
+	for (const auto &stage : stages) {
+		const std::string report = stage->report();
+		if (report.empty())
+			continue;
+		if (!reports.empty())
+			reports += ",";
+		reports += report;
+	}
+	return reports;
+}
+
+pluto_dc_blocker::pluto_dc_blocker(const float alpha):
+	pole(1.0f - std::min(std::max(alpha, 0.0f), 1.0f))
+{
+	reset();
+}
+
+std::string pluto_dc_blocker::name() const
+{
+	return "dc_block";
+}
+
+void pluto_dc_blocker::reset()
+{
+	last_in_i = last_in_q = 0.0f;
+	last_out_i = last_out_q = 0.0f;
+}
+
+void pluto_dc_blocker::process(const float *in, const size_t items, std::vector<float> &out)
+{
+	const size_t first = out.size();
+	out.resize(first + 2 * items);
+	float *dst = out.data() + first;
+
+	for (size_t n = 0; n < items; n++) {
+		const float i = in[2 * n], q = in[2 * n + 1];
+		last_out_i = i - last_in_i + pole * last_out_i;
+		last_out_q = q - last_in_q + pole * last_out_q;
+		last_in_i = i;
+		last_in_q = q;
+		dst[2 * n] = last_out_i;
+		dst[2 * n + 1] = last_out_q;
+	}
+}
+
+// Blackman windowed sinc with unity DC gain, cutoff in cycles per sample
+static std::vector<float> lowpass_taps(const double cutoff, const size_t length)
+{
+	const size_t nb_taps = std::min<size_t>(std::max<size_t>(length, 1), 1024);
+	const double fc = std::min(std::max(cutoff, 1e-4), 0.5);
+	const double half = (nb_taps - 1) / 2.0;
+	double sum = 0.0;
+
+	std::vector<float> taps(nb_taps);
+	for (size_t k = 0; k < nb_taps; k++) {
+		const double x = double(k) - half;
+		const double arg = 2.0 * fc * x;
+		const double sinc = (std::fabs(arg) < 1e-9) ? 1.0 : std::sin(M_PI * arg) / (M_PI * arg);
+		const double w = (nb_taps > 1) ? 0.42 - 0.5 * std::cos(2.0 * M_PI * k / (nb_taps - 1)) + 0.08 * std::cos(4.0 * M_PI * k / (nb_taps - 1)) : 1.0;
+		taps[k] = float(sinc * w);
+		sum += taps[k];
+	}
+
+	for (auto &tap : taps)
+		tap = float(tap / sum);
+
+	return taps;
+}
+
+pluto_fir_filter::pluto_fir_filter(const double cutoff, const size_t length):
+	taps(lowpass_taps(cutoff, length))
+{
+	// stored reversed so the dot product runs forward over the history
+	std::reverse(taps.begin(), taps.end());
+
+	reset();
+}
+
+std::string pluto_fir_filter::name() const
+{
+	return "fir";
+}
+
+void pluto_fir_filter::reset()
+{
+	hist_i.assign(taps.size() - 1, 0.0f);
+	hist_q.assign(taps.size() - 1, 0.0f);
+}
+
+void pluto_fir_filter::process(const float *in, const size_t items, std::vector<float> &out)
+{
+	const size_t kept = taps.size() - 1;
+
+	hist_i.resize(kept + items);
+	hist_q.resize(kept + items);
+	for (size_t n = 0; n < items; n++) {
+		hist_i[kept + n] = in[2 * n];
+		hist_q[kept + n] = in[2 * n + 1];
+	}
+
+	const size_t first = out.size();
+	out.resize(first + 2 * items);
+	float *dst = out.data() + first;
+	const size_t nb_taps = taps.size();
+
+	for (size_t n = 0; n < items; n++) {
+		const float *xi = &hist_i[n];
+		const float *xq = &hist_q[n];
+
+		float acc_i[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		float acc_q[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		for (size_t k = 0; k < nb_taps; k += 4) {
+			for (size_t l = 0; l < 4 && k + l < nb_taps; l++) {
+				acc_i[l] += taps[k + l] * xi[k + l];
+				acc_q[l] += taps[k + l] * xq[k + l];
+			}
+		}
+
+		dst[2 * n] = (acc_i[0] + acc_i[1]) + (acc_i[2] + acc_i[3]);
+		dst[2 * n + 1] = (acc_q[0] + acc_q[1]) + (acc_q[2] + acc_q[3]);
+	}
+
+	hist_i.erase(hist_i.begin(), hist_i.begin() + items);
+	hist_q.erase(hist_q.begin(), hist_q.begin() + items);
+}
+
+pluto_cfr::pluto_cfr(const method _mode, const double papr_db, const double evm_pct, const size_t iterations,
+	const double cutoff, const size_t length):
+	mode(_mode), target_db(std::max(papr_db, 0.0)), evm_limit(std::max(evm_pct, 0.01)),
+	passes(std::min<size_t>(std::max<size_t>(iterations, 1), 8))
+{
+	// an odd length keeps the filter and the window centered on a sample
+	taps = lowpass_taps(cutoff, length | 1);
+	delay = (taps.size() - 1) / 2;
+
+	window.resize(taps.size());
+	for (size_t k = 0; k < window.size(); k++)
+		window[k] = float(0.5 - 0.5 * std::cos(2.0 * M_PI * (k + 1) / (window.size() + 1)));
+
+	if (mode == PEAK_WINDOW)
+		passes = 1;
+
+	reset();
+}
+
+std::string pluto_cfr::name() const
+{
+	return "cfr";
+}
+
+void pluto_cfr::reset()
+{
+	delay_i.assign(passes, std::vector<float>(delay, 0.0f));
+	delay_q.assign(passes, std::vector<float>(delay, 0.0f));
+	noise_i.assign(passes, std::vector<float>(taps.size() - 1, 0.0f));
+	noise_q.assign(passes, std::vector<float>(taps.size() - 1, 0.0f));
+	envelope.assign(2 * delay, 1.0f);
+	ref_i.assign(passes * delay, 0.0f);
+	ref_q.assign(passes * delay, 0.0f);
+
+	power = 0.0;
+	primed = false;
+	threshold_db = target_db;
+
+	blocks = 0;
+	last_papr_db = 0.0;
+	last_evm_pct = 0.0;
+	max_evm_pct = 0.0;
+}
+
+// block_i/q hold the pass input, replaced by its output delayed by `delay` items
+void pluto_cfr::clip_filter_pass(const size_t pass, const float threshold)
+{
+	const size_t items = block_i.size();
+	const size_t kept = taps.size() - 1;
+	const float threshold2 = threshold * threshold;
+
+	// clipping noise of the block, after the noise history
+	std::vector<float> &ni = noise_i[pass], &nq = noise_q[pass];
+	ni.resize(kept + items);
+	nq.resize(kept + items);
+	for (size_t n = 0; n < items; n++) {
+		const float mag2 = block_i[n] * block_i[n] + block_q[n] * block_q[n];
+		const float excess = (mag2 > threshold2) ? 1.0f - threshold / std::sqrt(mag2) : 0.0f;
+		ni[kept + n] = block_i[n] * excess;
+		nq[kept + n] = block_q[n] * excess;
+	}
+
+	// band limited noise, one tap at a time so the inner loops vectorize
+	filtered_i.assign(items, 0.0f);
+	filtered_q.assign(items, 0.0f);
+	for (size_t k = 0; k < taps.size(); k++) {
+		const float tap = taps[k];
+		const float *src_i = ni.data() + k;
+		const float *src_q = nq.data() + k;
+		for (size_t n = 0; n < items; n++) {
+			filtered_i[n] += tap * src_i[n];
+			filtered_q[n] += tap * src_q[n];
+		}
+	}
+
+	// the filter is centered `delay` items back, so is the subtraction
+	ext_i = delay_i[pass];
+	ext_q = delay_q[pass];
+	ext_i.insert(ext_i.end(), block_i.begin(), block_i.end());
+	ext_q.insert(ext_q.end(), block_q.begin(), block_q.end());
+	for (size_t n = 0; n < items; n++) {
+		block_i[n] = ext_i[n] - filtered_i[n];
+		block_q[n] = ext_q[n] - filtered_q[n];
+	}
+
+	delay_i[pass].assign(ext_i.end() - delay, ext_i.end());
+	delay_q[pass].assign(ext_q.end() - delay, ext_q.end());
+	ni.erase(ni.begin(), ni.begin() + items);
+	nq.erase(nq.begin(), nq.begin() + items);
+}
+
+// block_i/q hold the input, replaced by the output delayed by `delay` items
+void pluto_cfr::peak_window(const float threshold)
+{
+	const size_t items = block_i.size();
+	const float threshold2 = threshold * threshold;
+
+	// envelope[j] is the gain of ext[j], the peaks of the block reach 2 * delay items ahead
+	envelope.resize(items + 2 * delay, 1.0f);
+	for (size_t n = 0; n < items; n++) {
+		const float mag2 = block_i[n] * block_i[n] + block_q[n] * block_q[n];
+		if (mag2 <= threshold2)
+			continue;
+
+		const float depth = 1.0f - threshold / std::sqrt(mag2);
+		float *gain = envelope.data() + n;
+		for (size_t k = 0; k < window.size(); k++)
+			gain[k] = std::min(gain[k], 1.0f - depth * window[k]);
+	}
+
+	ext_i = delay_i[0];
+	ext_q = delay_q[0];
+	ext_i.insert(ext_i.end(), block_i.begin(), block_i.end());
+	ext_q.insert(ext_q.end(), block_q.begin(), block_q.end());
+	for (size_t n = 0; n < items; n++) {
+		block_i[n] = ext_i[n] * envelope[n];
+		block_q[n] = ext_q[n] * envelope[n];
+	}
+
+	delay_i[0].assign(ext_i.end() - delay, ext_i.end());
+	delay_q[0].assign(ext_q.end() - delay, ext_q.end());
+	envelope.erase(envelope.begin(), envelope.begin() + items);
+}
+
+void pluto_cfr::process(const float *in, const size_t items, std::vector<float> &out)
+{
+	if (items == 0)
+		return;
+
+	block_i.resize(items);
+	block_q.resize(items);
+	double block_power = 0.0;
+	for (size_t n = 0; n < items; n++) {
+		block_i[n] = in[2 * n];
+		block_q[n] = in[2 * n + 1];
+		block_power += double(block_i[n]) * block_i[n] + double(block_q[n]) * block_q[n];
+	}
+	block_power /= items;
+
+	// silence doesn't move the RMS the threshold is based on
+	if (block_power > 0.0) {
+		power = primed ? power + 0.1 * (block_power - power) : block_power;
+		primed = true;
+	}
+
+	const float threshold = float(std::sqrt(power) * std::pow(10.0, threshold_db / 20.0));
+
+	// until then the input and the delay lines are all zeros, and so is the output
+	if (primed) {
+		for (size_t pass = 0; pass < passes; pass++) {
+			if (mode == PEAK_WINDOW)
+				peak_window(threshold);
+			else
+				clip_filter_pass(pass, threshold);
+		}
+	}
+
+	// EVM against the input delayed by the stage latency
+	const size_t latency = passes * delay;
+	double error = 0.0, reference = 0.0, peak = 0.0, output = 0.0;
+	for (size_t n = 0; n < items; n++) {
+		const float ri = (n < latency) ? ref_i[n] : in[2 * (n - latency)];
+		const float rq = (n < latency) ? ref_q[n] : in[2 * (n - latency) + 1];
+		const double di = block_i[n] - ri, dq = block_q[n] - rq;
+		const double mag2 = double(block_i[n]) * block_i[n] + double(block_q[n]) * block_q[n];
+		error += di * di + dq * dq;
+		reference += double(ri) * ri + double(rq) * rq;
+		output += mag2;
+		peak = std::max(peak, mag2);
+	}
+
+	// the last `latency` inputs are the reference of the next block
+	std::vector<float> next_i(latency), next_q(latency);
+	for (size_t k = 0; k < latency; k++) {
+		const size_t pos = items + k;
+		next_i[k] = (pos < latency) ? ref_i[pos] : in[2 * (pos - latency)];
+		next_q[k] = (pos < latency) ? ref_q[pos] : in[2 * (pos - latency) + 1];
+	}
+	ref_i.swap(next_i);
+	ref_q.swap(next_q);
+
+	if (reference > 0.0 && output > 0.0) {
+		blocks++;
+		last_evm_pct = 100.0 * std::sqrt(error / reference);
+		last_papr_db = 10.0 * std::log10(peak * items / output);
+		max_evm_pct = std::max(max_evm_pct, last_evm_pct);
+
+		// trade PAPR for EVM while over the limit, come back to the target once well below
+		if (last_evm_pct > evm_limit)
+			threshold_db = std::min(threshold_db + 0.5, target_db + 12.0);
+		else if (last_evm_pct < 0.8 * evm_limit)
+			threshold_db = std::max(threshold_db - 0.1, target_db);
+	}
+
+	const size_t first = out.size();
+	out.resize(first + 2 * items);
+	float *dst = out.data() + first;
+	for (size_t n = 0; n < items; n++) {
+		dst[2 * n] = block_i[n];
+		dst[2 * n + 1] = block_q[n];
+	}
+}
+
+std::string pluto_cfr::report() const
+{
+	std::ostringstream report;
+	report.imbue(std::locale::classic());
+	report << "cfr_papr_db=" << last_papr_db;
+	report << ",cfr_evm_pct=" << last_evm_pct;
+	report << ",cfr_max_evm_pct=" << max_evm_pct;
+	report << ",cfr_threshold_db=" << threshold_db;
+	report << ",cfr_blocks=" << blocks;
+	return report.str();
+}
+
+pluto_resampler::pluto_resampler(const double _in_rate, const double _out_rate):
+	in_rate(_in_rate), out_rate(_out_rate), step(_in_rate / _out_rate), phases(64)
+{
+	const double ratio = std::min(1.0, out_rate / in_rate);
+
+	// longer filters as the decimation gets stronger, to keep the same transition band
+	taps_per_phase = size_t(std::ceil(16.0 / ratio));
+	taps_per_phase = std::min<size_t>((taps_per_phase + 1) & ~size_t(1), 1024);
+
+	const double fc = 0.45 * ratio; // cutoff in cycles per input sample
+	const double half = taps_per_phase / 2.0;
+
+	taps.resize((phases + 1) * taps_per_phase);
+	taps_delta.resize(phases * taps_per_phase);
+
+	for (size_t p = 0; p <= phases; p++) {
+		float *h = &taps[p * taps_per_phase];
+		double sum = 0.0;
+
+		for (size_t k = 0; k < taps_per_phase; k++) {
+			// distance between the output instant and input tap k, relative to the filter center
+			const double x = double(taps_per_phase - 1 - k) + double(p) / phases - half + 0.5;
+			const double arg = 2.0 * fc * x;
+			const double sinc = (std::fabs(arg) < 1e-9) ? 1.0 : std::sin(M_PI * arg) / (M_PI * arg);
+			const double w = 0.42 + 0.5 * std::cos(M_PI * x / half) + 0.08 * std::cos(2.0 * M_PI * x / half);
+			const double v = (std::fabs(x) <= half) ? 2.0 * fc * sinc * w : 0.0;
+			h[k] = float(v);
+			sum += v;
+		}
+
+		for (size_t k = 0; k < taps_per_phase; k++)
+			h[k] = float(h[k] / sum);
+	}
+
+	for (size_t p = 0; p < phases; p++) {
+		for (size_t k = 0; k < taps_per_phase; k++)
+			taps_delta[p * taps_per_phase + k] = taps[(p + 1) * taps_per_phase + k] - taps[p * taps_per_phase + k];
+	}
+
+	reset();
+}
+
+double pluto_resampler::get_in_rate() const
+{
+	return in_rate;
+}
+
+double pluto_resampler::get_out_rate() const
+{
+	return out_rate;
+}
+
+std::string pluto_resampler::name() const
+{
+	return "resample";
+}
+
+void pluto_resampler::reset()
+{
+	hist_i.assign(taps_per_phase - 1, 0.0f);
+	hist_q.assign(taps_per_phase - 1, 0.0f);
+	time = double(taps_per_phase - 1);
+}
+
+void pluto_resampler::process(const float *in, const size_t items, std::vector<float> &out)
+{
+	const size_t kept = taps_per_phase - 1;
+
+	hist_i.resize(kept + items);
+	hist_q.resize(kept + items);
+	for (size_t n = 0; n < items; n++) {
+		hist_i[kept + n] = in[2 * n];
+		hist_q[kept + n] = in[2 * n + 1];
+	}
+
+	const size_t length = hist_i.size();
+	out.reserve(out.size() + 2 * size_t(items / step + 2));
+
+	while (size_t(time) < length) {
+		const size_t idx = size_t(time);
+		const double pos = (time - idx) * phases;
+		const size_t p = std::min(size_t(pos), phases - 1);
+		const float frac = float(pos - p);
+
+		const float *h = &taps[p * taps_per_phase];
+		const float *dh = &taps_delta[p * taps_per_phase];
+		const float *xi = &hist_i[idx + 1 - taps_per_phase];
+		const float *xq = &hist_q[idx + 1 - taps_per_phase];
+
+		// independent partial sums so the dot products vectorize without fast-math
+		float acc_i[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		float acc_q[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		for (size_t k = 0; k < taps_per_phase; k += 4) {
+			for (size_t l = 0; l < 4 && k + l < taps_per_phase; l++) {
+				const float c = h[k + l] + frac * dh[k + l];
+				acc_i[l] += c * xi[k + l];
+				acc_q[l] += c * xq[k + l];
+			}
+		}
+
+		out.push_back((acc_i[0] + acc_i[1]) + (acc_i[2] + acc_i[3]));
+		out.push_back((acc_q[0] + acc_q[1]) + (acc_q[2] + acc_q[3]));
+
+		time += step;
+	}
+
+	// keep the last taps_per_phase - 1 inputs as history for the next call
+	const size_t consumed = length - kept;
+	hist_i.erase(hist_i.begin(), hist_i.begin() + consumed);
+	hist_q.erase(hist_q.begin(), hist_q.begin() + consumed);
+	time -= double(consumed);
+}
+
+pluto_nco::pluto_nco(const double frequency):
+	step(2.0 * M_PI * frequency)
+{
+	table_i.resize(pluto_dsp_block_items);
+	table_q.resize(pluto_dsp_block_items);
+	for (size_t n = 0; n < pluto_dsp_block_items; n++) {
+		table_i[n] = float(std::cos(step * n));
+		table_q[n] = float(std::sin(step * n));
+	}
+
+	reset();
+}
+
+void pluto_nco::reset()
+{
+	phase = 0.0;
+}
+
+void pluto_nco::mix(const float *in, const size_t items, const float gain, float *out)
+{
+	for (size_t done = 0; done < items; done += pluto_dsp_block_items) {
+		const size_t count = std::min(pluto_dsp_block_items, items - done);
+		const float ri = gain * float(std::cos(phase)), rq = gain * float(std::sin(phase));
+		const float *src = in + 2 * done;
+		float *dst = out + 2 * done;
+
+		for (size_t n = 0; n < count; n++) {
+			const float wi = ri * table_i[n] - rq * table_q[n];
+			const float wq = ri * table_q[n] + rq * table_i[n];
+			const float i = src[2 * n], q = src[2 * n + 1];
+			dst[2 * n] = i * wi - q * wq;
+			dst[2 * n + 1] = i * wq + q * wi;
+		}
+
+		// the phase is kept in double and wrapped, it doesn't drift
+		phase = std::fmod(phase + step * count, 2.0 * M_PI);
+	}
+}
+
+pluto_interpolator::pluto_interpolator(const size_t _factor, const size_t _taps_per_phase):
+	factor(std::max<size_t>(_factor, 1)), taps_per_phase(std::max<size_t>(_taps_per_phase, 1))
+{
+	// cut below the input Nyquist rate, the gain of factor keeps the amplitude
+	const std::vector<float> proto = lowpass_taps(0.45 / factor, factor * taps_per_phase);
+
+	taps.resize(factor * taps_per_phase);
+	for (size_t p = 0; p < factor; p++) {
+		for (size_t t = 0; t < taps_per_phase; t++)
+			taps[p * taps_per_phase + (taps_per_phase - 1 - t)] = proto[t * factor + p] * float(factor);
+	}
+
+	reset();
+}
+
+std::string pluto_interpolator::name() const
+{
+	return "interpolator";
+}
+
+void pluto_interpolator::reset()
+{
+	hist_i.assign(taps_per_phase - 1, 0.0f);
+	hist_q.assign(taps_per_phase - 1, 0.0f);
+}
+
+void pluto_interpolator::process(const float *in, const size_t items, std::vector<float> &out)
+{
+	const size_t kept = taps_per_phase - 1;
+
+	hist_i.resize(kept + items);
+	hist_q.resize(kept + items);
+	for (size_t n = 0; n < items; n++) {
+		hist_i[kept + n] = in[2 * n];
+		hist_q[kept + n] = in[2 * n + 1];
+	}
+
+	const size_t first = out.size();
+	out.resize(first + 2 * items * factor);
+	float *dst = out.data() + first;
+
+	acc_i.resize(items);
+	acc_q.resize(items);
+
+	// one phase at a time over the whole block, then interleaved into the output
+	for (size_t p = 0; p < factor; p++) {
+		const float *h = taps.data() + p * taps_per_phase;
+		std::fill(acc_i.begin(), acc_i.end(), 0.0f);
+		std::fill(acc_q.begin(), acc_q.end(), 0.0f);
+
+		for (size_t t = 0; t < taps_per_phase; t++) {
+			const float tap = h[t];
+			const float *xi = hist_i.data() + t;
+			const float *xq = hist_q.data() + t;
+			for (size_t n = 0; n < items; n++) {
+				acc_i[n] += tap * xi[n];
+				acc_q[n] += tap * xq[n];
+			}
+		}
+
+		for (size_t n = 0; n < items; n++) {
+			dst[2 * (n * factor + p)] = acc_i[n];
+			dst[2 * (n * factor + p) + 1] = acc_q[n];
+		}
+	}
+
+	hist_i.erase(hist_i.begin(), hist_i.begin() + items);
+	hist_q.erase(hist_q.begin(), hist_q.begin() + items);
+}
+
+pluto_ddc::pluto_ddc(const double frequency, const size_t _decimation, const size_t taps_per_phase):
+	nco(frequency), decimation(std::max<size_t>(_decimation, 1))
+{
+	if (decimation > 1) {
+		taps = lowpass_taps(0.45 / decimation, decimation * std::max<size_t>(taps_per_phase, 1) + 1);
+		std::reverse(taps.begin(), taps.end());
+	}
+
+	reset();
+}
+
+std::string pluto_ddc::name() const
+{
+	return "ddc";
+}
+
+void pluto_ddc::reset()
+{
+	nco.reset();
+	hist_i.assign(taps.empty() ? 0 : taps.size() - 1, 0.0f);
+	hist_q.assign(hist_i.size(), 0.0f);
+}
+
+void pluto_ddc::process(const float *in, const size_t items, std::vector<float> &out)
+{
+	if (decimation == 1) {
+		const size_t first = out.size();
+		out.resize(first + 2 * items);
+		nco.mix(in, items, 1.0f, out.data() + first);
+		return;
+	}
+
+	mixed.resize(2 * items);
+	nco.mix(in, items, 1.0f, mixed.data());
+
+	const size_t kept = hist_i.size();
+	hist_i.resize(kept + items);
+	hist_q.resize(kept + items);
+	for (size_t n = 0; n < items; n++) {
+		hist_i[kept + n] = mixed[2 * n];
+		hist_q[kept + n] = mixed[2 * n + 1];
+	}
+
+	// outputs whose whole window is in the history, the rest waits for the next block
+	const size_t nb_taps = taps.size();
+	const size_t count = (hist_i.size() >= nb_taps) ? (hist_i.size() - nb_taps) / decimation + 1 : 0;
+
+	const size_t first = out.size();
+	out.resize(first + 2 * count);
+	float *dst = out.data() + first;
+
+	for (size_t n = 0; n < count; n++) {
+		const float *xi = hist_i.data() + n * decimation;
+		const float *xq = hist_q.data() + n * decimation;
+		float acc_i = 0.0f, acc_q = 0.0f;
+		for (size_t t = 0; t < nb_taps; t++) {
+			acc_i += taps[t] * xi[t];
+			acc_q += taps[t] * xq[t];
+		}
+		dst[2 * n] = acc_i;
+		dst[2 * n + 1] = acc_q;
+	}
+
+	hist_i.erase(hist_i.begin(), hist_i.begin() + count * decimation);
+	hist_q.erase(hist_q.begin(), hist_q.begin() + count * decimation);
+}
+
+pluto_carrier_combiner::pluto_carrier_combiner(const std::vector<pluto_carrier> &_carriers, const double _sample_rate):
+	carriers(_carriers), sample_rate(_sample_rate), frame_items(1), items_out(0)
+{
+	for (auto &carrier : carriers) {
+		carrier.interpolation = std::max<size_t>(carrier.interpolation, 1);
+
+		size_t a = frame_items, b = carrier.interpolation;
+		while (b != 0) {
+			const size_t r = a % b;
+			a = b;
+			b = r;
+		}
+		frame_items = frame_items / a * carrier.interpolation;
+
+		interpolators.emplace_back(new pluto_interpolator(carrier.interpolation, 16));
+		ncos.emplace_back((sample_rate > 0.0) ? carrier.offset / sample_rate : 0.0);
+		gains.push_back(float(std::pow(10.0, carrier.gain_db / 20.0)));
+	}
+}
+
+size_t pluto_carrier_combiner::size() const
+{
+	return carriers.size();
+}
+
+size_t pluto_carrier_combiner::frame() const
+{
+	return frame_items;
+}
+
+size_t pluto_carrier_combiner::interpolation(const size_t carrier) const
+{
+	return carriers[carrier].interpolation;
+}
+
+void pluto_carrier_combiner::process(const float * const *in, const size_t items, float *out)
+{
+	std::fill(out, out + 2 * items, 0.0f);
+
+	for (size_t k = 0; k < carriers.size(); k++) {
+		scratch.clear();
+		interpolators[k]->process(in[k], items / carriers[k].interpolation, scratch);
+		ncos[k].mix(scratch.data(), items, gains[k], scratch.data());
+
+		const float *src = scratch.data();
+		for (size_t n = 0; n < 2 * items; n++)
+			out[n] += src[n];
+	}
+
+	items_out += items;
+}
+
+void pluto_carrier_combiner::reset()
+{
+	for (auto &interpolator : interpolators)
+		interpolator->reset();
+	for (auto &nco : ncos)
+		nco.reset();
+	items_out = 0;
+}
+
+std::string pluto_carrier_combiner::status() const
+{
+	std::ostringstream stats;
+	stats.imbue(std::locale::classic());
+	stats << "carriers=" << carriers.size();
+	stats << ",carrier_rate=" << sample_rate;
+	stats << ",carrier_items=" << items_out;
+	for (size_t k = 0; k < carriers.size(); k++)
+		stats << ",carrier" << k << "=" << carriers[k].offset << "Hz/" << carriers[k].gain_db << "dB/x" << carriers[k].interpolation;
+	return stats.str();
+}
+
+pluto_energy_gate::pluto_energy_gate(const double threshold_dbfs, const size_t _pre, const size_t _post, const size_t _chunk,
+	const float full_scale, const size_t _item_bytes, const bool _tezuka):
+	pre(_pre), post(_post), chunk(std::max<size_t>(_chunk, 1)), item_bytes(_item_bytes), tezuka(_tezuka)
+{
+	// compared to the mean power of a chunk, per item and channel
+	full_scale_power = double(full_scale) * double(full_scale);
+	threshold = float(std::pow(10.0, threshold_dbfs / 10.0) * full_scale_power);
+
+	reset();
+}
+
+void pluto_energy_gate::reset()
+{
+	staged.clear();
+	kept.clear();
+	tail.clear();
+	tail_first = 0;
+	hold_until = 0;
+	delivered_until = 0;
+	scanned_items = 0;
+	delivered_items = 0;
+	nb_bursts = 0;
+	last_power = 0.0f;
+}
+
+const std::vector<pluto_energy_gate::burst> &pluto_energy_gate::bursts() const
+{
+	return kept;
+}
+
+const uint8_t *pluto_energy_gate::staging() const
+{
+	return staged.data();
+}
+
+template <typename Raw>
+float pluto_energy_gate::chunk_power(const Raw *values, const size_t count) const
+{
+	float sum = 0.0f;
+	for (size_t k = 0; k < count; k++)
+		sum += float(values[k]) * float(values[k]);
+	return sum;
+}
+
+// append the items [from, to) to the staging, extending the last burst when contiguous
+void pluto_energy_gate::keep(const uint8_t *data, const unsigned long long first_item, unsigned long long from, const unsigned long long to)
+{
+	if (from >= to)
+		return;
+
+	if (kept.empty() || kept.back().first_item + kept.back().items != from) {
+		if (!kept.empty())
+			kept.back().closed = true;
+		kept.push_back(burst{ staged.size(), 0, from, false });
+		// a burst left open by the previous block goes on
+		if (from != delivered_until || nb_bursts == 0)
+			nb_bursts++;
+	}
+
+	// the pre margin may start in the tail of the previous block
+	if (from < first_item) {
+		const size_t skip = size_t(from - tail_first);
+		staged.insert(staged.end(), tail.begin() + skip * item_bytes, tail.end());
+		kept.back().items += size_t(first_item - from);
+		from = first_item;
+	}
+
+	const uint8_t *src = data + size_t(from - first_item) * item_bytes;
+	staged.insert(staged.end(), src, src + size_t(to - from) * item_bytes);
+	kept.back().items += size_t(to - from);
+
+	delivered_until = to;
+	delivered_items += to - from;
+}
+
+void pluto_energy_gate::process(const uint8_t *data, const size_t items, const unsigned long long first_item)
+{
+	staged.clear();
+	kept.clear();
+
+	// the tail only helps when it directly precedes this block
+	if (tail_first + tail.size() / item_bytes != first_item) {
+		tail.clear();
+		tail_first = first_item;
+	}
+
+	const size_t values_per_item = tezuka ? 2 : item_bytes / sizeof(int16_t);
+	const size_t nb_channels = values_per_item / 2;
+
+	for (size_t s = 0; s < items; s += chunk) {
+		const size_t count = std::min(chunk, items - s);
+		const float power = tezuka ?
+			chunk_power((const int8_t *)(data + s * item_bytes), count * values_per_item) :
+			chunk_power((const int16_t *)(data + s * item_bytes), count * values_per_item);
+		last_power = power / (count * nb_channels);
+
+		const unsigned long long start = first_item + s;
+		const unsigned long long end = start + count;
+
+		if (last_power >= threshold) {
+			const unsigned long long earliest = std::max(delivered_until, tail_first);
+			keep(data, first_item, std::max(start >= pre ? start - pre : 0, earliest), end);
+			hold_until = end + post;
+		}
+		else if (start < hold_until) {
+			keep(data, first_item, std::max(start, delivered_until), std::min(end, hold_until));
+		}
+	}
+
+	// the last burst is still open when it reaches the end of the block
+	// and the gate holds on into the next one
+	if (!kept.empty())
+		kept.back().closed = (delivered_until < first_item + items || hold_until <= first_item + items);
+
+	const size_t tail_items = std::min(pre, items);
+	tail.assign(data + (items - tail_items) * item_bytes, data + items * item_bytes);
+	tail_first = first_item + items - tail_items;
+
+	scanned_items += items;
+}
+
+std::string pluto_energy_gate::status() const
+{
+	std::ostringstream stats;
+	stats.imbue(std::locale::classic());
+	stats << "gate_scanned=" << scanned_items;
+	stats << ",gate_delivered=" << delivered_items;
+	stats << ",gate_bursts=" << nb_bursts;
+	stats << ",gate_threshold_dbfs=" << 10.0 * std::log10(std::max(threshold / full_scale_power, 1e-20));
+	stats << ",gate_power_dbfs=" << 10.0 * std::log10(std::max(last_power / full_scale_power, 1e-20));
+	return stats.str();
+}
+
+pluto_fft::pluto_fft(const size_t size):
+	fft_size(size)
+{
+	twiddles.resize(fft_size);
+	for (size_t k = 0; k < fft_size / 2; k++) {
+		twiddles[2 * k] = float(std::cos(2.0 * M_PI * k / fft_size));
+		twiddles[2 * k + 1] = float(-std::sin(2.0 * M_PI * k / fft_size));
+	}
+
+	size_t bits = 0;
+	while ((size_t(1) << bits) < fft_size)
+		bits++;
+
+	bit_reverse.resize(fft_size);
+	for (size_t k = 0; k < fft_size; k++) {
+		size_t r = 0;
+		for (size_t b = 0; b < bits; b++)
+			r |= ((k >> b) & 1) << (bits - 1 - b);
+		bit_reverse[k] = r;
+	}
+}
+
+void pluto_fft::transform(float *work) const
+{
+	for (size_t len = 2; len <= fft_size; len <<= 1) {
+		const size_t half = len / 2;
+		const size_t stride = fft_size / len;
+
+		for (size_t base = 0; base < fft_size; base += len) {
+			for (size_t k = 0; k < half; k++) {
+				const float wr = twiddles[2 * k * stride];
+				const float wi = twiddles[2 * k * stride + 1];
+				float *a = &work[2 * (base + k)];
+				float *b = &work[2 * (base + k + half)];
+				const float tr = b[0] * wr - b[1] * wi;
+				const float ti = b[0] * wi + b[1] * wr;
+				b[0] = a[0] - tr;
+				b[1] = a[1] - ti;
+				a[0] += tr;
+				a[1] += ti;
+			}
+		}
+	}
+}
+
+pluto_channelizer::pluto_channelizer(const size_t bands, const size_t _taps_per_band, const std::vector<size_t> &selected):
+	fft(bands), nb_bands(bands), taps_per_band(std::max<size_t>(_taps_per_band, 1)), row_items(0)
+{
+	// sub-band c is centered on FFT bin k = c - bands / 2, read back at bin -k
+	for (const auto c : selected)
+		selected_bins.push_back((nb_bands - (c + nb_bands / 2) % nb_bands) % nb_bands);
+
+	// cut at the sub-band Nyquist rate, the gain of bands is undone by the FFT sum
+	const std::vector<float> proto = lowpass_taps(0.5 / nb_bands, nb_bands * taps_per_band);
+
+	taps.resize(nb_bands * taps_per_band);
+	for (size_t m = 0; m < taps_per_band; m++) {
+		for (size_t p = 0; p < nb_bands; p++)
+			taps[(nb_bands - 1 - p) * taps_per_band + (taps_per_band - 1 - m)] = proto[m * nb_bands + p];
+	}
+
+	reset();
+}
+
+size_t pluto_channelizer::bands() const
+{
+	return nb_bands;
+}
+
+void pluto_channelizer::reset()
+{
+	hist.assign(2 * nb_bands * (taps_per_band - 1), 0.0f);
+}
+
+// frames [first, last) of the history, frame f covering its items [f * bands, (f + taps_per_band) * bands)
+void pluto_channelizer::run_frames(const size_t first, const size_t last, std::vector<float> &acc, std::vector<std::vector<float>> &out, const size_t out_first)
+{
+	const size_t count = last - first;
+	acc.assign(2 * nb_bands * (count + 1), 0.0f);
+	float *branch = acc.data();
+	float *spectrum = acc.data() + 2 * nb_bands * count;
+
+	// one branch at a time, the innermost loop runs over consecutive frames
+	// so it vectorizes without reordering the sums
+	for (size_t q = 0; q < nb_bands; q++) {
+		const float *h = taps.data() + q * taps_per_band;
+		const float *xi = rows.data() + 2 * q * row_items + first;
+		const float *xq = xi + row_items;
+		float *yi = branch + 2 * q * count;
+		float *yq = yi + count;
+
+		for (size_t m = 0; m < taps_per_band; m++) {
+			const float c = h[m];
+			for (size_t f = 0; f < count; f++) {
+				yi[f] += c * xi[f + m];
+				yq[f] += c * xq[f + m];
+			}
+		}
+	}
+
+	for (size_t f = 0; f < count; f++) {
+		// branch p is the item bands - 1 - p of the last segment
+		for (size_t p = 0; p < nb_bands; p++) {
+			const size_t r = fft.reversed(p);
+			const float *y = branch + 2 * (nb_bands - 1 - p) * count;
+			spectrum[2 * r] = y[f];
+			spectrum[2 * r + 1] = y[count + f];
+		}
+
+		fft.transform(spectrum);
+
+		for (size_t c = 0; c < selected_bins.size(); c++) {
+			float *dst = out[c].data() + 2 * (out_first + first + f);
+			dst[0] = spectrum[2 * selected_bins[c]];
+			dst[1] = spectrum[2 * selected_bins[c] + 1];
+		}
+	}
+}
+
+void pluto_channelizer::process(const float *in, const size_t items, std::vector<std::vector<float>> &out,
+	pluto_worker_pool *pool, const size_t parallel_min_items)
+{
+	hist.insert(hist.end(), in, in + 2 * items);
+
+	const size_t frame_values = 2 * nb_bands;
+	const size_t window = taps_per_band * frame_values;
+	const size_t frames = (hist.size() >= window) ? (hist.size() - window) / frame_values + 1 : 0;
+
+	const size_t out_first = out[0].size() / 2;
+	for (auto &band : out)
+		band.resize(2 * (out_first + frames));
+
+	if (frames == 0)
+		return;
+
+	// the history of each branch as contiguous I and Q rows
+	row_items = frames + taps_per_band - 1;
+	rows.resize(2 * nb_bands * row_items);
+	for (size_t t = 0; t < row_items; t++) {
+		const float *src = hist.data() + t * frame_values;
+		for (size_t q = 0; q < nb_bands; q++) {
+			rows[2 * q * row_items + t] = src[2 * q];
+			rows[(2 * q + 1) * row_items + t] = src[2 * q + 1];
+		}
+	}
+
+	if (pool && frames * nb_bands >= parallel_min_items) {
+		const size_t nb_slices = pool->slices();
+		work.resize(nb_slices);
+		pool->run([&](size_t slice, size_t slices) {
+			run_frames(frames * slice / slices, frames * (slice + 1) / slices, work[slice], out, out_first);
+		});
+	}
+	else {
+		work.resize(1);
+		run_frames(0, frames, work[0], out, out_first);
+	}
+
+	hist.erase(hist.begin(), hist.begin() + frames * frame_values);
+}
+
+pluto_spectrum::pluto_spectrum(const size_t _fft_size, const size_t _average, const double overlap, const float full_scale):
+	fft_size(_fft_size), average(std::max<size_t>(_average, 1)), fft(_fft_size)
+{
+	hop = std::max<size_t>(1, size_t(fft_size * (1.0 - std::min(std::max(overlap, 0.0), 0.95))));
+
+	window.resize(fft_size);
+	double gain = 0.0;
+	for (size_t k = 0; k < fft_size; k++) {
+		const double x = 2.0 * M_PI * k / fft_size;
+		window[k] = float(0.35875 - 0.48829 * std::cos(x) + 0.14128 * std::cos(2.0 * x) - 0.01168 * std::cos(3.0 * x));
+		gain += window[k];
+	}
+
+	// a full scale complex tone reads 0 dBFS
+	norm = 1.0 / (gain * gain * double(full_scale) * double(full_scale));
+
+	work.resize(2 * fft_size);
+	reset();
+}
+
+size_t pluto_spectrum::size() const
+{
+	return fft_size;
+}
+
+void pluto_spectrum::reset()
+{
+	pending.clear();
+	power.assign(fft_size, 0.0);
+	accumulated = 0;
+}
+
+void pluto_spectrum::process(const float *in, const size_t items, std::vector<float> &frames)
+{
+	pending.insert(pending.end(), in, in + 2 * items);
+
+	size_t start = 0;
+	while (pending.size() / 2 - start >= fft_size) {
+		const float *src = &pending[2 * start];
+
+		for (size_t k = 0; k < fft_size; k++) {
+			const size_t r = fft.reversed(k);
+			work[2 * r] = src[2 * k] * window[k];
+			work[2 * r + 1] = src[2 * k + 1] * window[k];
+		}
+
+		fft.transform(work.data());
+
+		for (size_t k = 0; k < fft_size; k++)
+			power[k] += double(work[2 * k]) * work[2 * k] + double(work[2 * k + 1]) * work[2 * k + 1];
+
+		start += hop;
+
+		if (++accumulated < average)
+			continue;
+
+		// swap the halves so the bins run from -fs/2 to +fs/2
+		const size_t first = frames.size();
+		frames.resize(first + fft_size);
+		const double scale = norm / accumulated;
+		for (size_t k = 0; k < fft_size; k++) {
+			const double p = power[(k + fft_size / 2) % fft_size] * scale;
+			frames[first + k] = float(10.0 * std::log10(std::max(p, 1e-20)));
+		}
+
+		power.assign(fft_size, 0.0);
+		accumulated = 0;
+	}
+
+	pending.erase(pending.begin(), pending.begin() + 2 * start);
+}
+
+pluto_tx_meter::pluto_tx_meter()
+{
+	reset();
+}
+
+void pluto_tx_meter::reset()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	mean_power = 0.0;
+	peak_current = 0.0;
+	peak_previous = 0.0;
+	window_blocks = 0;
+	primed = false;
+	total = 0;
+	clipped_count = 0;
+	std::fill(ccdf_counts, ccdf_counts + ccdf_bins, 0ull);
+}
+
+void pluto_tx_meter::measure(const int16_t *iq, const size_t items)
+{
+	accumulate<int16_t>(iq, items, 32768.0f, 32767, -32768);
+}
+
+void pluto_tx_meter::measure(const int8_t *iq, const size_t items)
+{
+	accumulate<int8_t>(iq, items, 128.0f, 127, -128);
+}
+
+template <typename Raw>
+void pluto_tx_meter::accumulate(const Raw *iq, const size_t items, const float full_scale, const Raw high, const Raw low)
+{
+	if (items == 0)
+		return;
+
+	std::lock_guard<std::mutex> measure_lock(measure_mutex);
+
+	// first pass: power relative to full scale, its sum and max, railed components
+	const float norm = 1.0f / (full_scale * full_scale);
+	power.resize(items);
+	float *p = power.data();
+	double sum = 0.0;
+	float peak = 0.0f;
+	unsigned long long railed = 0;
+
+	for (size_t n = 0; n < items; n++) {
+		const float i = iq[2 * n], q = iq[2 * n + 1];
+		p[n] = (i * i + q * q) * norm;
+		railed += (iq[2 * n] == high) + (iq[2 * n] == low) + (iq[2 * n + 1] == high) + (iq[2 * n + 1] == low);
+	}
+	for (size_t n = 0; n < items; n++) {
+		sum += p[n];
+		peak = std::max(peak, p[n]);
+	}
+
+	double average = 0.0;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		const double block_mean = sum / items;
+		mean_power = primed ? mean_power + 0.1 * (block_mean - mean_power) : block_mean;
+		primed = true;
+		average = mean_power;
+
+		// the peak is held over the current and the previous window of blocks
+		peak_current = std::max(peak_current, double(peak));
+		if (++window_blocks == peak_window_blocks) {
+			peak_previous = peak_current;
+			peak_current = 0.0;
+			window_blocks = 0;
+		}
+	}
+
+	// second pass: one comparison sweep per CCDF threshold, into a local
+	// histogram merged under the lock
+	unsigned long long counts[ccdf_bins] = {};
+	if (average > 0.0) {
+		for (size_t k = 0; k < ccdf_bins; k++) {
+			const float threshold = float(average * std::pow(10.0, k / 10.0));
+			size_t above = 0;
+			for (size_t n = 0; n < items; n++)
+				above += (p[n] > threshold);
+			counts[k] = above;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (size_t k = 0; k < ccdf_bins; k++)
+		ccdf_counts[k] += counts[k];
+	total += items;
+	clipped_count += railed;
+}
+
+static double to_db(const double ratio)
+{
+	return 10.0 * std::log10(std::max(ratio, 1e-20));
+}
+
+double pluto_tx_meter::peak_dbfs() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return to_db(std::max(peak_current, peak_previous));
+}
+
+double pluto_tx_meter::rms_dbfs() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return to_db(mean_power);
+}
+
+double pluto_tx_meter::papr_db() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (mean_power <= 0.0)
+		return 0.0;
+	return to_db(std::max(peak_current, peak_previous) / mean_power);
+}
+
+unsigned long long pluto_tx_meter::clipped() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return clipped_count;
+}
+
+unsigned long long pluto_tx_meter::samples() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return total;
+}
+
+std::string pluto_tx_meter::ccdf() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::ostringstream ccdf;
+	ccdf.imbue(std::locale::classic());
+	for (size_t k = 0; k < ccdf_bins; k++) {
+		if (k > 0)
+			ccdf << ",";
+		ccdf << k << "dB=" << (total ? double(ccdf_counts[k]) / total : 0.0);
+	}
+	return ccdf.str();
+}
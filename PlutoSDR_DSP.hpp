@@ -0,0 +1,608 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <complex>
+#include <mutex>
+#include <SoapySDR/Types.hpp>
+
+// DC offset and IQ imbalance correction coefficients of one RX channel,
+// applied in raw sample units as:
+//   I' = I - dc_i
+//   Q' = k_qq * (Q - dc_q) + k_qi * (I - dc_i)
+struct pluto_iq_coeffs {
+	float dc_i, dc_q;
+	float k_qq, k_qi;
+};
+
+// Tracks the DC offset and the gain/phase imbalance of one RX channel.
+// Only one sample out of `decimation` feeds the running estimates, so
+// the estimator costs a small fraction of the conversion itself.
+class pluto_iq_corrector {
+
+	public:
+		pluto_iq_corrector();
+
+		void set_dc_mode(const bool automatic);
+		bool dc_mode() const;
+
+		void set_iq_mode(const bool automatic);
+		bool iq_mode() const;
+
+		// src points to the I sample of this channel, stride is in samples between two items
+		void estimate(const int16_t *src, const size_t stride, const size_t items);
+		void estimate(const int8_t *src, const size_t stride, const size_t items);
+
+		const pluto_iq_coeffs &coeffs() const;
+
+	private:
+		template <typename Raw>
+		void accumulate(const Raw *src, const size_t stride, const size_t items);
+		void refresh();
+
+		bool dc_enabled;
+		bool iq_enabled;
+		size_t decimation;
+		double alpha;
+
+		double mean_i, mean_q;
+		double p_ii, p_qq, p_iq;
+		bool primed;
+
+		pluto_iq_coeffs coefficients;
+};
+
+// One block processing step of a stream DSP chain. Stages work on the
+// interleaved complex float samples of a single channel, in raw units
+// (2048 full scale for RX, 32768 for TX, 128 with the Tezuka transport),
+// and may produce a different number of items than they consume.
+class pluto_dsp_stage {
+
+	public:
+		virtual ~pluto_dsp_stage() {}
+
+		virtual std::string name() const = 0;
+
+		// process items complex samples from in, appending the outputs to out
+		virtual void process(const float *in, const size_t items, std::vector<float> &out) = 0;
+
+		virtual void reset() {}
+
+		// stage specific measurements, as "key=value" pairs separated by commas
+		virtual std::string report() const { return std::string(); }
+};
+
+// Stages are created by name from the stream args, one instance per channel.
+typedef std::function<std::unique_ptr<pluto_dsp_stage>(const SoapySDR::Kwargs &args)> pluto_dsp_stage_factory;
+
+void pluto_register_dsp_stage(const std::string &name, const pluto_dsp_stage_factory &factory);
+std::unique_ptr<pluto_dsp_stage> pluto_make_dsp_stage(const std::string &name, const SoapySDR::Kwargs &args);
+std::vector<std::string> pluto_list_dsp_stages();
+
+struct pluto_dsp_stage_stats {
+	std::string name;
+	unsigned long long ns;
+	unsigned long long items_in;
+	unsigned long long items_out;
+};
+
+// Ordered chain of stages for one channel. Blocks are handed from stage to
+// stage through two scratch vectors that are reused across calls, so the
+// data stays in cache between stages when blocks are kept small.
+class pluto_dsp_chain {
+
+	public:
+		void push_front(std::unique_ptr<pluto_dsp_stage> stage);
+		void push_back(std::unique_ptr<pluto_dsp_stage> stage);
+
+		bool empty() const;
+
+		// run items complex samples from in through every stage, appending the result to out
+		void process(const float *in, const size_t items, std::vector<float> &out);
+
+		void reset();
+
+		const std::vector<pluto_dsp_stage_stats> &stats() const;
+
+		// the non empty report() of the stages
+		std::string report() const;
+
+	private:
+		std::vector<std::unique_ptr<pluto_dsp_stage>> stages;
+		std::vector<pluto_dsp_stage_stats> timings;
+		std::vector<float> ping, pong;
+};
+
+// items per channel converted to float and pushed through the chains at once
+const size_t pluto_dsp_block_items = 4096;
+
+// Fills the chain of one TX channel. With both rates set the resampler comes
+// first, so CFR and the predistorter run at the hardware rate on the
+// interpolated waveform the PA actually sees.
+void pluto_build_tx_chain(pluto_dsp_chain &chain, const std::vector<std::string> &names,
+	const SoapySDR::Kwargs &args, const double app_rate, const double hw_rate);
+
+// Single pole DC blocker, y[n] = x[n] - x[n-1] + (1 - alpha) * y[n-1].
+class pluto_dc_blocker : public pluto_dsp_stage {
+
+	public:
+		explicit pluto_dc_blocker(const float alpha);
+
+		std::string name() const override;
+		void process(const float *in, const size_t items, std::vector<float> &out) override;
+		void reset() override;
+
+	private:
+		float pole;
+		float last_in_i, last_in_q;
+		float last_out_i, last_out_q;
+};
+
+// Windowed sinc low pass FIR with real taps, cutoff in cycles per sample.
+class pluto_fir_filter : public pluto_dsp_stage {
+
+	public:
+		pluto_fir_filter(const double cutoff, const size_t length);
+
+		std::string name() const override;
+		void process(const float *in, const size_t items, std::vector<float> &out) override;
+		void reset() override;
+
+	private:
+		std::vector<float> taps;
+		std::vector<float> hist_i;
+		std::vector<float> hist_q;
+};
+
+// Crest factor reduction of one TX channel, run on each block with a latency
+// of (length - 1) / 2 items per pass. The clip threshold is the target PAPR
+// above the running RMS of the input; while a block ends up with more EVM
+// than allowed, the threshold is raised for the next blocks.
+//  CLIP_FILTER: the part of the signal above the threshold is low pass
+//               filtered and subtracted, in `iterations` passes
+//  PEAK_WINDOW: the gain around each peak is lowered by a Hann window
+class pluto_cfr : public pluto_dsp_stage {
+
+	public:
+		enum method { CLIP_FILTER, PEAK_WINDOW };
+
+		pluto_cfr(const method mode, const double papr_db, const double evm_pct, const size_t iterations,
+			const double cutoff, const size_t length);
+
+		std::string name() const override;
+		void process(const float *in, const size_t items, std::vector<float> &out) override;
+		void reset() override;
+
+		// achieved PAPR and EVM of the last block, worst EVM and current threshold
+		std::string report() const override;
+
+	private:
+		void clip_filter_pass(const size_t pass, const float threshold);
+		void peak_window(const float threshold);
+
+		method mode;
+		double target_db;
+		double evm_limit;
+		size_t passes;
+		size_t delay;
+		std::vector<float> taps;
+		std::vector<float> window;
+
+		// block being processed and the state carried between blocks
+		std::vector<float> block_i, block_q;
+		std::vector<float> ext_i, ext_q;
+		std::vector<float> filtered_i, filtered_q;
+		std::vector<std::vector<float>> delay_i, delay_q;
+		std::vector<std::vector<float>> noise_i, noise_q;
+		std::vector<float> envelope;
+		std::vector<float> ref_i, ref_q;
+
+		double power;
+		bool primed;
+		double threshold_db;
+
+		unsigned long long blocks;
+		double last_papr_db;
+		double last_evm_pct;
+		double max_evm_pct;
+};
+
+// Memory polynomial coefficients, c[k * memory + m] weighting x[n - m] * |x[n - m]|^k
+// with amplitudes relative to full scale. As text: "<order> <memory> <re> <im> ...".
+struct pluto_dpd_coeffs {
+	size_t order;
+	size_t memory;
+	std::vector<std::complex<float>> values;
+};
+
+bool pluto_parse_dpd_coeffs(const std::string &text, pluto_dpd_coeffs &coeffs);
+std::string pluto_format_dpd_coeffs(const pluto_dpd_coeffs &coeffs);
+
+// Memory polynomial predistorter of one TX channel,
+//   y[n] = sum over k < order, m < memory of c[k * memory + m] * x[n - m] * |x[n - m]|^k
+// computed one basis function at a time over the whole block. Coefficients
+// not matching order and memory leave the signal untouched.
+class pluto_dpd : public pluto_dsp_stage {
+
+	public:
+		pluto_dpd(const pluto_dpd_coeffs &coeffs, const float full_scale);
+
+		std::string name() const override;
+		void process(const float *in, const size_t items, std::vector<float> &out) override;
+		void reset() override;
+
+	private:
+		size_t order;
+		size_t memory;
+		float inv_full_scale;
+		std::vector<float> coeff_i, coeff_q;
+		std::vector<float> hist_i, hist_q;
+		std::vector<float> magnitude;
+		std::vector<float> basis_i, basis_q;
+		std::vector<float> acc_i, acc_q;
+};
+
+// Software power amplifier to exercise the predistorter without hardware:
+// a two tap memory filter followed by the Saleh AM/AM and AM/PM curves, on
+// amplitudes relative to full scale.
+class pluto_pa_model : public pluto_dsp_stage {
+
+	public:
+		pluto_pa_model(const float full_scale, const float memory);
+
+		std::string name() const override;
+		void process(const float *in, const size_t items, std::vector<float> &out) override;
+		void reset() override;
+
+	private:
+		float full_scale;
+		float memory;
+		float alpha_a, beta_a;
+		float alpha_p, beta_p;
+		float last_i, last_q;
+};
+
+// Indirect learning of the predistorter from a capture of the PA input (tx)
+// and output (rx), interleaved complex samples on the same scale. The capture
+// is aligned on its correlation peak and normalized by the linear gain, then
+// the postdistorter mapping it back to the input is fitted by least squares.
+// Throws std::runtime_error on captures that can't be trained on.
+pluto_dpd_coeffs pluto_dpd_train(const float *tx, const float *rx, const size_t items,
+	const size_t order, const size_t memory, const float full_scale);
+
+// Trains against pluto_pa_model on a synthetic signal, reports the normalized
+// error of the PA output with and without the predistorter and the coefficients.
+std::string pluto_dpd_selftest(const size_t order, const size_t memory);
+
+// Polyphase fractional resampler for interleaved complex float samples.
+// The filter bank is derived from a Blackman windowed sinc with the cutoff
+// below the lower of both Nyquist rates; outputs between two phases use a
+// linear blend of the adjacent phase filters.
+class pluto_resampler : public pluto_dsp_stage {
+
+	public:
+		pluto_resampler(const double in_rate, const double out_rate);
+
+		double get_in_rate() const;
+		double get_out_rate() const;
+
+		std::string name() const override;
+
+		// resample items complex samples from in, appending the outputs to out
+		void process(const float *in, const size_t items, std::vector<float> &out) override;
+
+		void reset() override;
+
+	private:
+		double in_rate;
+		double out_rate;
+		double step;
+		size_t phases;
+		size_t taps_per_phase;
+
+		// phases + 1 filters of taps_per_phase, and their differences for the blend
+		std::vector<float> taps;
+		std::vector<float> taps_delta;
+
+		std::vector<float> hist_i;
+		std::vector<float> hist_q;
+		double time;
+};
+
+// Numerically controlled oscillator shifting a block by a fixed frequency,
+// in cycles per sample. The rotation of each item in a block comes from a
+// table, only the start phase is tracked from block to block, so the inner
+// loop is a plain complex multiply.
+class pluto_nco {
+
+	public:
+		explicit pluto_nco(const double frequency);
+
+		// out = in * gain * exp(j * phase), out may be in
+		void mix(const float *in, const size_t items, const float gain, float *out);
+
+		void reset();
+
+	private:
+		double step;
+		double phase;
+		std::vector<float> table_i, table_q;
+};
+
+// Integer polyphase interpolator: each input item gives `factor` outputs,
+// one per phase of a windowed sinc low pass cut at the input Nyquist rate.
+class pluto_interpolator : public pluto_dsp_stage {
+
+	public:
+		pluto_interpolator(const size_t factor, const size_t taps_per_phase);
+
+		std::string name() const override;
+		void process(const float *in, const size_t items, std::vector<float> &out) override;
+		void reset() override;
+
+	private:
+		size_t factor;
+		size_t taps_per_phase;
+		std::vector<float> taps; // phase major, each phase reversed
+		std::vector<float> hist_i, hist_q;
+		std::vector<float> acc_i, acc_q;
+};
+
+// Digital downconverter of one RX channel: the NCO shifts the block by
+// frequency, in cycles per sample, then a windowed sinc low pass decimates
+// it, only the kept outputs being computed. A decimation of 1 only mixes.
+class pluto_ddc : public pluto_dsp_stage {
+
+	public:
+		pluto_ddc(const double frequency, const size_t decimation, const size_t taps_per_phase);
+
+		std::string name() const override;
+		void process(const float *in, const size_t items, std::vector<float> &out) override;
+		void reset() override;
+
+	private:
+		pluto_nco nco;
+		size_t decimation;
+		std::vector<float> taps; // reversed
+		std::vector<float> hist_i, hist_q;
+		std::vector<float> mixed;
+};
+
+// One narrowband TX carrier of a pluto_carrier_combiner.
+struct pluto_carrier {
+	double offset; // in Hz from the TX LO
+	double gain_db;
+	size_t interpolation;
+};
+
+// Sums several carriers into one TX channel. Each carrier is interpolated
+// to the combined rate, shifted by its offset and scaled by its gain. The
+// combined stream advances in frames, the least common multiple of the
+// interpolations, so every carrier consumes whole items.
+class pluto_carrier_combiner {
+
+	public:
+		pluto_carrier_combiner(const std::vector<pluto_carrier> &carriers, const double sample_rate);
+
+		size_t size() const;
+		size_t frame() const;
+		size_t interpolation(const size_t carrier) const;
+
+		// in[k] holds items / interpolation(k) items of carrier k, items being
+		// a multiple of frame(); the sum is written to out
+		void process(const float * const *in, const size_t items, float *out);
+
+		void reset();
+
+		std::string status() const;
+
+	private:
+		std::vector<pluto_carrier> carriers;
+		double sample_rate;
+		size_t frame_items;
+		std::vector<std::unique_ptr<pluto_interpolator>> interpolators;
+		std::vector<pluto_nco> ncos;
+		std::vector<float> gains;
+		std::vector<float> scratch;
+		unsigned long long items_out;
+};
+
+// Squelch of the raw RX blocks: the mean power of every chunk of items is
+// compared to a threshold before any conversion. Chunks above it are kept
+// with `pre` items before them and `post` items after the last one, the
+// pre margin reaching back into the previous block. The kept items are
+// copied to a staging area as contiguous bursts, quiet blocks cost the
+// power sums only.
+class pluto_energy_gate {
+
+	public:
+		struct burst {
+			size_t offset;                // in bytes into staging()
+			size_t items;
+			unsigned long long first_item; // counted since the stream was set up
+			bool closed;                  // the gate closed at its end
+		};
+
+		pluto_energy_gate(const double threshold_dbfs, const size_t pre, const size_t post, const size_t chunk,
+			const float full_scale, const size_t item_bytes, const bool tezuka);
+
+		// scan a raw block whose first item is first_item
+		void process(const uint8_t *data, const size_t items, const unsigned long long first_item);
+
+		const std::vector<burst> &bursts() const;
+		const uint8_t *staging() const;
+
+		void reset();
+
+		std::string status() const;
+
+	private:
+		template <typename Raw>
+		float chunk_power(const Raw *values, const size_t count) const;
+		void keep(const uint8_t *data, const unsigned long long first_item, unsigned long long from, const unsigned long long to);
+
+		double full_scale_power;
+		float threshold;
+		size_t pre, post, chunk;
+		size_t item_bytes;
+		bool tezuka;
+
+		std::vector<uint8_t> staged;
+		std::vector<burst> kept;
+
+		// last pre items of the previous block
+		std::vector<uint8_t> tail;
+		unsigned long long tail_first;
+
+		unsigned long long hold_until;
+		unsigned long long delivered_until;
+
+		unsigned long long scanned_items;
+		unsigned long long delivered_items;
+		unsigned long long nb_bursts;
+		float last_power;
+};
+
+// In place radix-2 decimation in time FFT of a power of two size, on
+// interleaved complex floats stored in bit reversed order.
+class pluto_fft {
+
+	public:
+		explicit pluto_fft(const size_t size);
+
+		size_t size() const { return fft_size; }
+
+		// position of item k in the order transform() expects
+		size_t reversed(const size_t k) const { return bit_reverse[k]; }
+
+		void transform(float *work) const;
+
+	private:
+		size_t fft_size;
+		std::vector<float> twiddles;
+		std::vector<size_t> bit_reverse;
+};
+
+class pluto_worker_pool;
+
+// Critically sampled polyphase channelizer splitting one channel in `bands`
+// equal sub-bands at 1 / bands of its rate. Sub-band c is centered at
+// (c - bands / 2) / bands cycles per sample, so they run from the lowest to
+// the highest frequency. Every input frame of `bands` items goes through the
+// polyphase branches of a windowed sinc prototype and one FFT, which gives
+// all the sub-bands at once; the frames of a block are split across the
+// worker pool when one is given.
+class pluto_channelizer {
+
+	public:
+		pluto_channelizer(const size_t bands, const size_t taps_per_band, const std::vector<size_t> &selected);
+
+		size_t bands() const;
+
+		// append the selected sub-bands of items complex samples from in to
+		// out, one vector per selected sub-band
+		void process(const float *in, const size_t items, std::vector<std::vector<float>> &out,
+			pluto_worker_pool *pool, const size_t parallel_min_items);
+
+		void reset();
+
+	private:
+		void run_frames(const size_t first, const size_t last, std::vector<float> &work, std::vector<std::vector<float>> &out, const size_t out_first);
+
+		pluto_fft fft;
+		size_t nb_bands;
+		size_t taps_per_band;
+		std::vector<size_t> selected_bins;
+
+		// the taps of the branch fed by item q of a frame at [q * taps_per_band, (q + 1) * taps_per_band),
+		// in increasing time like its history rows
+		std::vector<float> taps;
+		std::vector<float> hist;
+		// hist split per branch for the frames of a call: the I row then the Q row
+		// of item q at [2 * q * rows, (2 * q + 2) * rows)
+		std::vector<float> rows;
+		size_t row_items;
+		std::vector<std::vector<float>> work;
+};
+
+// Welch power spectrum of one channel: Blackman-Harris windowed FFTs with
+// overlap, averaged over `average` transforms and reported in dBFS with
+// DC in the center bin.
+class pluto_spectrum {
+
+	public:
+		pluto_spectrum(const size_t fft_size, const size_t average, const double overlap, const float full_scale);
+
+		size_t size() const;
+
+		// feed items complex samples from in, appending fft_size floats to frames
+		// for every completed average
+		void process(const float *in, const size_t items, std::vector<float> &frames);
+
+		void reset();
+
+	private:
+		size_t fft_size;
+		size_t average;
+		size_t hop;
+		double norm;
+
+		std::vector<float> window;
+		pluto_fft fft;
+
+		std::vector<float> pending;
+		std::vector<float> work;
+		std::vector<double> power;
+		size_t accumulated;
+};
+
+// Statistics of the raw samples pushed to the DAC, over all TX channels:
+// peak and RMS relative to full scale, PAPR, components sitting on the
+// converter rails and the CCDF of the instantaneous power above the average
+// in 1 dB steps. Peak and RMS follow the signal over the last blocks, the
+// counters run since the last reset. Blocks are measured in plain loops over
+// a power array the compiler vectorizes, outside of the lock the readers take.
+class pluto_tx_meter {
+
+	public:
+		pluto_tx_meter();
+
+		// items interleaved I/Q pairs in DAC units
+		void measure(const int16_t *iq, const size_t items);
+		void measure(const int8_t *iq, const size_t items);
+
+		void reset();
+
+		double peak_dbfs() const;
+		double rms_dbfs() const;
+		double papr_db() const;
+		unsigned long long clipped() const;
+		unsigned long long samples() const;
+
+		// "0dB=<probability>,1dB=...", the probability of exceeding the average power by that much
+		std::string ccdf() const;
+
+	private:
+		template <typename Raw>
+		void accumulate(const Raw *iq, const size_t items, const float full_scale, const Raw high, const Raw low);
+
+		static const size_t ccdf_bins = 16;
+		static const size_t peak_window_blocks = 32;
+
+		// serializes the measuring threads over the power scratch
+		std::mutex measure_mutex;
+		std::vector<float> power;
+
+		mutable std::mutex mutex;
+		double mean_power;
+		double peak_current;
+		double peak_previous;
+		size_t window_blocks;
+		bool primed;
+		unsigned long long total;
+		unsigned long long clipped_count;
+		unsigned long long ccdf_counts[ccdf_bins];
+};
@@ -0,0 +1,699 @@
+#include "SoapyPlutoSDR.hpp"
+#include <cstring>
+#include <cmath>
+#include <cerrno>
+#include <ctime>
+#include <sstream>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+// chunks are written whole, a multiple of the direct I/O alignment
+static const size_t record_chunk_bytes = 4 << 20;
+static const size_t record_chunk_count = 16;
+static const size_t record_alignment = 4096;
+
+// the data file grows by preallocated extents to limit fragmentation
+static const unsigned long long record_prealloc_bytes = 256ull << 20;
+
+static std::string utc_datetime()
+{
+	char text[32];
+	const time_t now = time(nullptr);
+	struct tm utc;
+	gmtime_r(&now, &utc);
+	strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &utc);
+	return text;
+}
+
+pluto_recorder::pluto_recorder(const std::string &_base_path, const pluto_raw_info &_raw, const double _sample_rate,
+	const double frequency, const double gain, const pluto_thread_policy &policy):
+	base_path(_base_path), raw(_raw), sample_rate(_sample_rate), fd(-1), direct_io(false),
+	written_bytes(0), allocated_bytes(0), failed(false), filling(nullptr), quit(false), finished(false),
+	recorded_items(0), dropped_items(0)
+{
+	item_bytes = raw.num_channels * ((raw.datatype == "ci8") ? 2 : 4);
+
+	const std::string data_path = base_path + ".sigmf-data";
+
+#ifdef __linux__
+	fd = open(data_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	direct_io = (fd >= 0);
+	// tmpfs and some network file systems refuse O_DIRECT
+	if (fd < 0 && errno == EINVAL)
+		fd = open(data_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#else
+	fd = open(data_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+
+	if (fd < 0) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to open %s: %s", data_path.c_str(), strerror(errno));
+		throw std::runtime_error("Unable to open " + data_path);
+	}
+
+#ifdef __APPLE__
+	fcntl(fd, F_NOCACHE, 1);
+#endif
+
+	chunks.resize(record_chunk_count);
+	for (auto &c : chunks) {
+		void *data = nullptr;
+		if (posix_memalign(&data, record_alignment, record_chunk_bytes) != 0) {
+			for (auto &allocated : chunks)
+				free(allocated.data);
+			close(fd);
+			throw std::runtime_error("Unable to allocate the recorder buffers");
+		}
+		c.data = (uint8_t *)data;
+		c.used = 0;
+		free_chunks.push_back(&c);
+	}
+
+	captures.push_back(capture{ 0, frequency, gain, utc_datetime() });
+
+	thread = std::thread([this, policy]() {
+		pluto_thread_setup("pluto-rx-rec", policy);
+		writer();
+		pluto_thread_release("pluto-rx-rec", policy);
+	});
+
+	SoapySDR_logf(SOAPY_SDR_INFO, "Recording %s at %.1f S/s%s", data_path.c_str(), sample_rate, direct_io ? " (direct I/O)" : "");
+}
+
+pluto_recorder::~pluto_recorder()
+{
+	finish();
+
+	for (auto &c : chunks)
+		free(c.data);
+}
+
+void pluto_recorder::on_block(const uint8_t *data, const size_t bytes, const size_t items, const unsigned long long first_item)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (finished || failed)
+		return;
+
+	size_t done = 0;
+
+	while (done < bytes) {
+		if (!filling) {
+			if (free_chunks.empty()) {
+				// the writer is behind, drop the rest of this block
+				const unsigned long long dropped = (bytes - done) / item_bytes;
+				if (!annotations.empty() && annotations.back().sample_start == recorded_items)
+					annotations.back().dropped += dropped;
+				else
+					annotations.push_back(annotation{ recorded_items, dropped });
+				dropped_items += dropped;
+				break;
+			}
+			filling = free_chunks.back();
+			free_chunks.pop_back();
+			filling->used = 0;
+		}
+
+		const size_t copied = std::min(bytes - done, record_chunk_bytes - filling->used);
+		std::memcpy(filling->data + filling->used, data + done, copied);
+		filling->used += copied;
+		done += copied;
+		recorded_items += copied / item_bytes;
+
+		if (filling->used == record_chunk_bytes) {
+			full_chunks.push_back(filling);
+			filling = nullptr;
+			cond.notify_one();
+		}
+	}
+}
+
+void pluto_recorder::set_frequency(const double frequency)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	captures.push_back(capture{ recorded_items, frequency, captures.back().gain, utc_datetime() });
+}
+
+void pluto_recorder::set_gain(const double gain)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	captures.push_back(capture{ recorded_items, captures.back().frequency, gain, utc_datetime() });
+}
+
+void pluto_recorder::writer()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true) {
+		cond.wait(lock, [this]{ return quit || !full_chunks.empty(); });
+
+		if (full_chunks.empty())
+			break;
+
+		chunk *c = full_chunks.front();
+		full_chunks.pop_front();
+
+		lock.unlock();
+		const bool written = write_chunk(c, record_chunk_bytes);
+		lock.lock();
+
+		free_chunks.push_back(c);
+
+		// the file ends at the last whole chunk, no more blocks are taken
+		if (!written) {
+			failed = true;
+			SoapySDR_logf(SOAPY_SDR_ERROR, "Recording to %s.sigmf-data stopped after %llu samples",
+				base_path.c_str(), written_bytes / item_bytes);
+			break;
+		}
+	}
+}
+
+bool pluto_recorder::write_chunk(const chunk *c, const size_t bytes)
+{
+#ifdef __linux__
+	if (written_bytes + bytes > allocated_bytes) {
+		if (fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated_bytes, record_prealloc_bytes) == 0)
+			allocated_bytes += record_prealloc_bytes;
+		else
+			allocated_bytes = ~0ull; // not supported by this file system
+	}
+#endif
+
+	size_t done = 0;
+	while (done < bytes) {
+		const ssize_t ret = write(fd, c->data + done, bytes - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			SoapySDR_logf(SOAPY_SDR_ERROR, "Recording write failed: %s", strerror(errno));
+			return false;
+		}
+		done += ret;
+	}
+
+	written_bytes += bytes;
+	return true;
+}
+
+void pluto_recorder::finish()
+{
+	chunk *last = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (finished)
+			return;
+		finished = true;
+		quit = true;
+		last = filling;
+		filling = nullptr;
+	}
+
+	cond.notify_one();
+	if (thread.joinable())
+		thread.join();
+
+	// the tail is not a multiple of the direct I/O alignment
+	if (!failed && last && last->used > 0) {
+#ifdef __linux__
+		if (direct_io)
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+#endif
+		failed = !write_chunk(last, last->used);
+	}
+
+	// the metadata only describes the samples that made it to the file
+	if (failed) {
+		if (ftruncate(fd, written_bytes) != 0)
+			SoapySDR_logf(SOAPY_SDR_WARNING, "Unable to truncate %s.sigmf-data: %s", base_path.c_str(), strerror(errno));
+		dropped_items += recorded_items - written_bytes / item_bytes;
+		recorded_items = written_bytes / item_bytes;
+		while (captures.size() > 1 && captures.back().sample_start > recorded_items)
+			captures.pop_back();
+		while (!annotations.empty() && annotations.back().sample_start > recorded_items)
+			annotations.pop_back();
+	}
+
+	close(fd);
+	fd = -1;
+
+	write_meta();
+
+	SoapySDR_logf(SOAPY_SDR_INFO, "Recorded %llu samples to %s.sigmf-data, %llu dropped",
+		recorded_items, base_path.c_str(), dropped_items);
+}
+
+void pluto_recorder::write_meta()
+{
+	std::ostringstream meta;
+	meta.imbue(std::locale::classic());
+	meta.precision(17);
+
+	meta << "{\n";
+	meta << "  \"global\": {\n";
+	meta << "    \"core:datatype\": \"" << raw.datatype << "\",\n";
+	meta << "    \"core:sample_rate\": " << sample_rate << ",\n";
+	meta << "    \"core:num_channels\": " << raw.num_channels << ",\n";
+	meta << "    \"core:version\": \"1.0.0\",\n";
+	meta << "    \"core:hw\": \"PlutoSDR\",\n";
+	meta << "    \"core:recorder\": \"SoapyPlutoSDR\"\n";
+	meta << "  },\n";
+
+	meta << "  \"captures\": [";
+	for (size_t k = 0; k < captures.size(); k++) {
+		meta << (k ? ",\n" : "\n");
+		meta << "    { \"core:sample_start\": " << captures[k].sample_start;
+		meta << ", \"core:frequency\": " << captures[k].frequency;
+		meta << ", \"core:datetime\": \"" << captures[k].datetime << "\"";
+		meta << ", \"pluto:gain\": " << captures[k].gain << " }";
+	}
+	meta << "\n  ],\n";
+
+	meta << "  \"annotations\": [";
+	for (size_t k = 0; k < annotations.size(); k++) {
+		meta << (k ? ",\n" : "\n");
+		meta << "    { \"core:sample_start\": " << annotations[k].sample_start;
+		meta << ", \"core:sample_count\": 0";
+		meta << ", \"core:label\": \"overflow\"";
+		meta << ", \"core:comment\": \"" << annotations[k].dropped << " samples dropped\" }";
+	}
+	meta << (annotations.empty() ? "]\n" : "\n  ]\n");
+	meta << "}\n";
+
+	std::ofstream file(base_path + ".sigmf-meta");
+	file << meta.str();
+	if (!file)
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to write %s.sigmf-meta", base_path.c_str());
+}
+
+std::string pluto_recorder::status() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::ostringstream stats;
+	stats.imbue(std::locale::classic());
+	stats << "path=" << base_path;
+	stats << ",recorded=" << recorded_items;
+	stats << ",dropped=" << dropped_items;
+	stats << ",queued_chunks=" << full_chunks.size();
+	if (failed)
+		stats << ",failed=true";
+	return stats.str();
+}
+
+// the raw blocks run at the hardware rate, before any host resampling
+void SoapyPlutoSDR::read_rx_capture(double &sample_rate, double &frequency, double &gain) const
+{
+	long long value = 0;
+
+	if (rx_app_rate > 0.0)
+		sample_rate = rx_hw_rate;
+	else if (iio_channel_attr_read_longlong(iio_device_find_channel(rx_dev, "voltage0", false), "sampling_frequency", &value) == 0)
+		sample_rate = double(value);
+	else
+		sample_rate = 0.0;
+
+	value = 0;
+	iio_channel_attr_read_longlong(iio_device_find_channel(dev, "altvoltage0", true), "frequency", &value);
+	frequency = double(value);
+
+	value = 0;
+	iio_channel_attr_read_longlong(iio_device_find_channel(dev, "voltage0", false), "hardwaregain", &value);
+	gain = double(value);
+}
+
+void SoapyPlutoSDR::start_recording(const std::string &base_path)
+{
+	stop_recording();
+
+	// read along with the raw format, so the metadata matches the stream
+	double sample_rate, frequency, gain;
+	pluto_raw_info raw;
+	{
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		if (!rx_stream) {
+			SoapySDR_logf(SOAPY_SDR_ERROR, "Recording needs an RX stream set up first");
+			return;
+		}
+		raw = rx_stream->get_raw_info();
+		read_rx_capture(sample_rate, frequency, gain);
+	}
+
+	// opening and allocating the buffers is kept out of the spin lock
+	std::shared_ptr<pluto_recorder> started;
+	try
+	{
+		started = std::make_shared<pluto_recorder>(base_path, raw, sample_rate, frequency, gain, rx_thread_policy);
+	}
+	catch (const std::exception &e)
+	{
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Recording not started: %s", e.what());
+		return;
+	}
+
+	std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+	if (rx_stream) {
+		recorder = started;
+		rx_stream->add_tap(recorder);
+	}
+}
+
+void SoapyPlutoSDR::stop_recording()
+{
+	std::shared_ptr<pluto_recorder> stopped;
+	{
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		stopped.swap(recorder);
+		if (stopped && rx_stream)
+			rx_stream->remove_tap(stopped.get());
+	}
+
+	// flushing may take a while, don't hold the device lock meanwhile
+	if (stopped)
+		stopped->finish();
+}
+
+pluto_snapshot::pluto_snapshot(const std::string &_base_path, const pluto_raw_info &_raw, const double _sample_rate,
+	const double _frequency, const double _gain, const double pre_ms, const double post_ms,
+	const double threshold_dbfs, const bool _energy_trigger, const pluto_thread_policy &policy):
+	base_path(_base_path), raw(_raw), ring_first(0), ring_end(0), energy_trigger(_energy_trigger), chunk(1024),
+	armed(true), triggered(false), trigger_item(0), frozen_items(0), frozen_first(0), frozen_trigger(0),
+	frozen_rate(0), frozen_frequency(0), frozen_gain(0), exporting(false),
+	sample_rate(_sample_rate), frequency(_frequency), gain(_gain), quit(false), nb_snapshots(0), nb_missed(0)
+{
+	item_bytes = raw.num_channels * ((raw.datatype == "ci8") ? 2 : 4);
+	pre_items = size_t(std::max(pre_ms, 0.0) * 1e-3 * sample_rate);
+	post_items = size_t(std::max(post_ms, 0.0) * 1e-3 * sample_rate);
+
+	// a window ends post_items after its trigger, at most that far into the
+	// block which completes it, so the ring never has to reach further back
+	ring_items = std::max<size_t>(pre_items + post_items, 1);
+
+	// everything is allocated here, the refill path only copies
+	ring.resize(ring_items * item_bytes);
+	frozen.resize(ring_items * item_bytes);
+
+	const float full_scale = (raw.datatype == "ci8") ? 128.0f : 2048.0f;
+	threshold = float(std::pow(10.0, threshold_dbfs / 10.0)) * full_scale * full_scale;
+
+	thread = std::thread([this, policy]() {
+		pluto_thread_setup("pluto-rx-snap", policy);
+		writer();
+		pluto_thread_release("pluto-rx-snap", policy);
+	});
+
+	SoapySDR_logf(SOAPY_SDR_INFO, "Snapshot ring of %lu samples for %s, %.0f ms before and %.0f ms after the trigger",
+		(unsigned long)ring_items, base_path.c_str(), pre_ms, post_ms);
+}
+
+pluto_snapshot::~pluto_snapshot()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	cond.notify_one();
+	if (thread.joinable())
+		thread.join();
+}
+
+template <typename Raw>
+static float mean_power(const Raw *values, const size_t count)
+{
+	float sum = 0.0f;
+	for (size_t k = 0; k < count; k++)
+		sum += float(values[k]) * float(values[k]);
+	return sum / (count / 2);
+}
+
+void pluto_snapshot::on_block(const uint8_t *data, const size_t bytes, const size_t items, const unsigned long long first_item)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// the stream restarted, what the ring holds is not contiguous anymore
+	if (first_item != ring_end) {
+		ring_first = ring_end = first_item;
+		triggered = false;
+	}
+
+	if (energy_trigger) {
+		const size_t values_per_item = item_bytes / ((raw.datatype == "ci8") ? 1 : 2);
+
+		for (size_t s = 0; s < items; s += chunk) {
+			const size_t count = std::min(chunk, items - s) * values_per_item;
+			const float power = (raw.datatype == "ci8") ?
+				mean_power((const int8_t *)(data + s * item_bytes), count) :
+				mean_power((const int16_t *)(data + s * item_bytes), count);
+
+			// only the rising edge triggers, a steady carrier doesn't retrigger
+			const bool above = (power >= threshold);
+			if (above && !armed)
+				continue;
+			if (!above) {
+				armed = true;
+				continue;
+			}
+			armed = false;
+
+			if (triggered || exporting) {
+				nb_missed++;
+			}
+			else {
+				triggered = true;
+				trigger_item = first_item + s;
+				std::ostringstream label;
+				label.imbue(std::locale::classic());
+				label.precision(3);
+				label << "energy " << std::fixed << 10.0 * std::log10(power / threshold) << " dB over the threshold";
+				trigger_label = label.str();
+			}
+		}
+	}
+
+	if (triggered && trigger_item + post_items <= first_item + items)
+		freeze(data, first_item);
+
+	// keep the newest ring_items items of the block
+	const size_t kept = std::min(items, ring_items);
+	for (size_t k = items - kept; k < items; ) {
+		const size_t pos = size_t((first_item + k) % ring_items);
+		const size_t count = std::min(items - k, ring_items - pos);
+		std::memcpy(&ring[pos * item_bytes], data + k * item_bytes, count * item_bytes);
+		k += count;
+	}
+	ring_end = first_item + items;
+	ring_first = std::max(ring_first, ring_end - std::min<unsigned long long>(ring_end, ring_items));
+}
+
+// copy the window around the trigger, from the ring up to first_item and from
+// the current block after, and hand it to the writer
+void pluto_snapshot::freeze(const uint8_t *data, const unsigned long long first_item)
+{
+	const unsigned long long start = std::max(trigger_item >= pre_items ? trigger_item - pre_items : 0, ring_first);
+	const unsigned long long end = trigger_item + post_items;
+
+	size_t done = 0;
+	for (unsigned long long p = start; p < std::min(end, first_item); ) {
+		const size_t pos = size_t(p % ring_items);
+		const size_t count = size_t(std::min<unsigned long long>(std::min(end, first_item) - p, ring_items - pos));
+		std::memcpy(&frozen[done * item_bytes], &ring[pos * item_bytes], count * item_bytes);
+		done += count;
+		p += count;
+	}
+	if (end > first_item) {
+		const unsigned long long from = std::max(start, first_item);
+		std::memcpy(&frozen[done * item_bytes], data + size_t(from - first_item) * item_bytes, size_t(end - from) * item_bytes);
+		done += size_t(end - from);
+	}
+
+	frozen_items = done;
+	frozen_first = start;
+	frozen_trigger = trigger_item;
+	frozen_label = trigger_label;
+	frozen_rate = sample_rate;
+	frozen_frequency = frequency;
+	frozen_gain = gain;
+
+	triggered = false;
+	exporting = true;
+	cond.notify_one();
+}
+
+void pluto_snapshot::trigger()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (triggered || exporting) {
+		nb_missed++;
+		return;
+	}
+
+	triggered = true;
+	trigger_item = ring_end;
+	trigger_label = "manual";
+}
+
+void pluto_snapshot::set_frequency(const double _frequency)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	frequency = _frequency;
+}
+
+void pluto_snapshot::set_gain(const double _gain)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	gain = _gain;
+}
+
+void pluto_snapshot::set_sample_rate(const double _sample_rate)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// the ring is sized in items, the windows shrink or grow in time until
+	// the next snapshot is set up; older items were received at another rate
+	sample_rate = _sample_rate;
+	ring_first = ring_end;
+	triggered = false;
+}
+
+void pluto_snapshot::writer()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true) {
+		cond.wait(lock, [this]{ return quit || exporting; });
+
+		if (!exporting)
+			break;
+
+		// frozen is left alone by on_block while exporting is set
+		lock.unlock();
+		write_snapshot();
+		lock.lock();
+
+		exporting = false;
+		nb_snapshots++;
+	}
+}
+
+void pluto_snapshot::write_snapshot()
+{
+	const std::string path = base_path + "_" + std::to_string(nb_snapshots);
+
+	std::ofstream file(path + ".sigmf-data", std::ios::binary);
+	file.write((const char *)frozen.data(), frozen_items * item_bytes);
+	if (!file) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to write %s.sigmf-data", path.c_str());
+		return;
+	}
+
+	std::ostringstream meta;
+	meta.imbue(std::locale::classic());
+	meta.precision(17);
+
+	meta << "{\n";
+	meta << "  \"global\": {\n";
+	meta << "    \"core:datatype\": \"" << raw.datatype << "\",\n";
+	meta << "    \"core:sample_rate\": " << frozen_rate << ",\n";
+	meta << "    \"core:num_channels\": " << raw.num_channels << ",\n";
+	meta << "    \"core:version\": \"1.0.0\",\n";
+	meta << "    \"core:hw\": \"PlutoSDR\",\n";
+	meta << "    \"core:recorder\": \"SoapyPlutoSDR\"\n";
+	meta << "  },\n";
+	meta << "  \"captures\": [\n";
+	meta << "    { \"core:sample_start\": 0";
+	meta << ", \"core:global_index\": " << frozen_first;
+	meta << ", \"core:frequency\": " << frozen_frequency;
+	meta << ", \"core:datetime\": \"" << utc_datetime() << "\"";
+	meta << ", \"pluto:gain\": " << frozen_gain << " }\n";
+	meta << "  ],\n";
+	meta << "  \"annotations\": [\n";
+	meta << "    { \"core:sample_start\": " << frozen_trigger - frozen_first;
+	meta << ", \"core:sample_count\": 0";
+	meta << ", \"core:label\": \"trigger\"";
+	meta << ", \"core:comment\": \"" << frozen_label << "\" }\n";
+	meta << "  ]\n";
+	meta << "}\n";
+
+	std::ofstream meta_file(path + ".sigmf-meta");
+	meta_file << meta.str();
+	if (!meta_file)
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to write %s.sigmf-meta", path.c_str());
+	else
+		SoapySDR_logf(SOAPY_SDR_INFO, "Snapshot of %lu samples written to %s.sigmf-data", (unsigned long)frozen_items, path.c_str());
+}
+
+std::string pluto_snapshot::status() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::ostringstream stats;
+	stats.imbue(std::locale::classic());
+	stats << "path=" << base_path;
+	stats << ",snapshots=" << nb_snapshots;
+	stats << ",missed=" << nb_missed;
+	stats << ",ring_samples=" << (ring_end - ring_first);
+	stats << ",pending=" << ((triggered || exporting) ? 1 : 0);
+	return stats.str();
+}
+
+void SoapyPlutoSDR::start_snapshots(const std::string &base_path)
+{
+	stop_snapshots();
+
+	double threshold = 0.0;
+	bool energy_trigger = false;
+	if (!snapshot_threshold.empty()) {
+		try
+		{
+			threshold = std::stod(snapshot_threshold);
+			energy_trigger = true;
+		}
+		catch (const std::invalid_argument &){}
+	}
+
+	double sample_rate, frequency, gain;
+	pluto_raw_info raw;
+	{
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		if (!rx_stream) {
+			SoapySDR_logf(SOAPY_SDR_ERROR, "Snapshots need an RX stream set up first");
+			return;
+		}
+		raw = rx_stream->get_raw_info();
+		read_rx_capture(sample_rate, frequency, gain);
+	}
+
+	// the ring is allocated out of the spin lock
+	std::shared_ptr<pluto_snapshot> started;
+	try
+	{
+		started = std::make_shared<pluto_snapshot>(base_path, raw, sample_rate, frequency, gain,
+			snapshot_pre_ms, snapshot_post_ms, threshold, energy_trigger, rx_thread_policy);
+	}
+	catch (const std::exception &e)
+	{
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Snapshots not started: %s", e.what());
+		return;
+	}
+
+	std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+	if (rx_stream) {
+		snapshot = started;
+		rx_stream->add_tap(snapshot);
+	}
+}
+
+void SoapyPlutoSDR::stop_snapshots()
+{
+	std::shared_ptr<pluto_snapshot> stopped;
+	{
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		stopped.swap(snapshot);
+		if (stopped && rx_stream)
+			rx_stream->remove_tap(stopped.get());
+	}
+
+	// a pending export finishes when the writer joins
+	stopped.reset();
+}
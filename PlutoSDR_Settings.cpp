@@ -1,5 +1,8 @@
 #include "SoapyPlutoSDR.hpp"
 #include <cstring>
+#include <sstream>
+#include <fstream>
+#include <cmath>
 #ifdef HAS_AD9361_IIO
 #include <ad9361.h>
 #endif
@@ -7,10 +10,13 @@
 static iio_context *ctx = nullptr; 
 
 SoapyPlutoSDR::SoapyPlutoSDR( const SoapySDR::Kwargs &args ):
-	dev(nullptr), rx_dev(nullptr),tx_dev(nullptr), decimation(false), interpolation(false), rx_stream(nullptr)
+	dev(nullptr), rx_dev(nullptr),tx_dev(nullptr), sensor_quit(false), sensor_interval_ms(0), tx_meter(std::make_shared<pluto_tx_meter>()),
+	rx_dc_offset_mode(false), rx_iq_balance_mode(false), resampler_enabled(false),
+	rx_hw_rate(0), rx_app_rate(0), tx_hw_rate(0), tx_app_rate(0), rx_bb_frequency(0), rx_ppm(0), rx_channelizer_bands(0), shm_size_mb(64), snapshot_pre_ms(300), snapshot_post_ms(100), play_loop(false), decimation(false), interpolation(false), rx_stream(nullptr)
 {
 
 	gainMode = false;
+	rx_thread_policy.device = tx_thread_policy.device = this;
 
 	if (args.count("label") != 0)
 		SoapySDR_logf( SOAPY_SDR_INFO, "Opening %s...", args.at("label").c_str());
@@ -43,6 +49,8 @@ SoapyPlutoSDR::SoapyPlutoSDR( const SoapySDR::Kwargs &args ):
 		throw std::runtime_error("no device found in this context");
 	}
 
+	discover_sensors();
+
 	this->setAntenna(SOAPY_SDR_RX, 0, "A_BALANCED");
 	this->setGainMode(SOAPY_SDR_RX, 0, false);
 	this->setAntenna(SOAPY_SDR_TX, 0, "A");
@@ -67,10 +75,23 @@ SoapyPlutoSDR::SoapyPlutoSDR( const SoapySDR::Kwargs &args ):
 			UseExtendedTezukaFeatures=false;		
 	
 	}	
+
+	if (args.count("sensor_interval_ms") != 0) {
+		try
+		{
+			start_sensor_sampler(std::stol(args.at("sensor_interval_ms")));
+		}
+		catch (const std::invalid_argument &){}
+	}
+
+	if (args.count("resampler") != 0)
+		resampler_enabled = (args.at("resampler") == "true" || args.at("resampler") == "1");
 }
 
 SoapyPlutoSDR::~SoapyPlutoSDR(void){
 
+	stop_sensor_sampler();
+
 	long long samplerate=0;
 	if(decimation){
 		iio_channel_attr_read_longlong(iio_device_find_channel(dev, "voltage0", false),"sampling_frequency",&samplerate);
@@ -139,6 +160,8 @@ SoapySDR::Kwargs SoapyPlutoSDR::getHardwareInfo( void ) const
 
 size_t SoapyPlutoSDR::getNumChannels( const int dir ) const
 {
+	if (dir == SOAPY_SDR_RX && rx_channelizer_bands > 1)
+		return rx_channelizer_bands;
 	return(1);
 }
 
@@ -170,34 +193,128 @@ double SoapyPlutoSDR::double_from_buf(const char *buf) const
 	return val;
 }
 
-double SoapyPlutoSDR::get_sensor_value(struct iio_channel *chn) const
+// the scale and offset of the sensors are constant, only the value attribute is read on each update
+double SoapyPlutoSDR::read_sensor_value(const pluto_sensor &sensor) const
 {
 	char buf[32];
 	double val = 0.0;
 
-	if (iio_channel_find_attr(chn, "input")) {
-		if (iio_channel_attr_read(chn, "input", buf, sizeof(buf)) > 0) {
-			val = double_from_buf(buf);
-		}
-	} else {
-		if (iio_channel_attr_read(chn, "raw", buf, sizeof(buf)) > 0) {
-			val = double_from_buf(buf);
-		}
+	if (iio_channel_attr_read(sensor.chn, sensor.has_input ? "input" : "raw", buf, sizeof(buf)) > 0)
+		val = double_from_buf(buf);
 
-		if (iio_channel_find_attr(chn, "offset")) {
-			if (iio_channel_attr_read(chn, "offset", buf, sizeof(buf)) > 0) {
-				val += double_from_buf(buf);
-			}
-		}
+	if (!sensor.has_input)
+		val = (val + sensor.offset) * sensor.scale;
 
-		if (iio_channel_find_attr(chn, "scale")) {
-			if (iio_channel_attr_read(chn, "scale", buf, sizeof(buf)) > 0) {
-				val *= double_from_buf(buf);
+	return val / 1000.0;
+}
+
+void SoapyPlutoSDR::discover_sensors()
+{
+	char buf[32];
+
+	sensors.clear();
+	sensor_index.clear();
+
+	unsigned int nb_devices = iio_context_get_devices_count(ctx);
+	for (unsigned int i = 0; i < nb_devices; i++) {
+		iio_device *sensor_dev = iio_context_get_device(ctx, i);
+		const char *dev_name = iio_device_get_name(sensor_dev);
+		if (!dev_name)
+			dev_name = iio_device_get_id(sensor_dev);
+
+		unsigned int nb_channels = iio_device_get_channels_count(sensor_dev);
+		for (unsigned int j = 0; j < nb_channels; j++) {
+			iio_channel *chn = iio_device_get_channel(sensor_dev, j);
+			if (!is_sensor_channel(chn))
+				continue;
+
+			pluto_sensor sensor;
+			std::string id = iio_channel_get_id(chn);
+			const char *name = iio_channel_get_name(chn);
+
+			sensor.key = std::string(dev_name) + "_" + id;
+			sensor.name = name ? name : "";
+			sensor.units = id_to_unit(id);
+			sensor.chn = chn;
+			sensor.has_input = iio_channel_find_attr(chn, "input") != nullptr;
+			sensor.offset = 0.0;
+			sensor.scale = 1.0;
+
+			if (!sensor.has_input) {
+				if (iio_channel_find_attr(chn, "offset") && iio_channel_attr_read(chn, "offset", buf, sizeof(buf)) > 0)
+					sensor.offset = double_from_buf(buf);
+				if (iio_channel_find_attr(chn, "scale") && iio_channel_attr_read(chn, "scale", buf, sizeof(buf)) > 0)
+					sensor.scale = double_from_buf(buf);
 			}
+
+			sensor_index[sensor.key] = sensors.size();
+			sensors.push_back(sensor);
 		}
 	}
 
-	return val / 1000.0;
+	SoapySDR_logf(SOAPY_SDR_DEBUG, "Found %lu sensors", (unsigned long)sensors.size());
+}
+
+void SoapyPlutoSDR::start_sensor_sampler(const long interval_ms)
+{
+	stop_sensor_sampler();
+
+	if (interval_ms <= 0)
+		return;
+
+	// sensor polling is not latency critical, only keep it away from the
+	// reserved cpus. The policy is copied here, writeSetting("rx_cpu") may
+	// replace it while the sampler runs
+	pluto_thread_policy policy;
+	{
+		std::lock_guard<std::mutex> lock(sensor_mutex);
+		sensor_interval_ms = interval_ms;
+		sensor_quit = false;
+		policy.cpus = rx_thread_policy.cpus;
+	}
+	policy.device = this;
+
+	sensor_thread = std::thread(&SoapyPlutoSDR::sensor_sampler, this, policy);
+}
+
+void SoapyPlutoSDR::stop_sensor_sampler()
+{
+	if (!sensor_thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(sensor_mutex);
+		sensor_quit = true;
+	}
+	sensor_cond.notify_all();
+	sensor_thread.join();
+
+	std::lock_guard<std::mutex> lock(sensor_mutex);
+	sensor_interval_ms = 0;
+	sensor_cache.clear();
+}
+
+void SoapyPlutoSDR::sensor_sampler(const pluto_thread_policy policy)
+{
+	pluto_thread_setup("pluto-sensors", policy);
+
+	std::unique_lock<std::mutex> lock(sensor_mutex);
+
+	while (!sensor_quit) {
+		lock.unlock();
+
+		std::vector<double> values(sensors.size());
+		for (size_t i = 0; i < sensors.size(); i++)
+			values[i] = read_sensor_value(sensors[i]);
+
+		lock.lock();
+		sensor_cache.swap(values);
+		sensor_time = std::chrono::steady_clock::now();
+
+		sensor_cond.wait_for(lock, std::chrono::milliseconds(sensor_interval_ms.load()), [this]{ return sensor_quit; });
+	}
+
+	pluto_thread_release("pluto-sensors", policy);
 }
 
 std::string SoapyPlutoSDR::id_to_unit(const std::string& id) const
@@ -222,73 +339,79 @@ std::string SoapyPlutoSDR::id_to_unit(const std::string& id) const
 std::vector<std::string> SoapyPlutoSDR::listSensors(void) const
 {
 	/*
-	iio:device2: xadc
-		10 channels found:
-			temp0:  (input)
-			voltage0: vccint (input)
-			voltage1: vccaux (input)
-			voltage2: vccbram (input)
-			voltage3: vccpint (input)
-			voltage4: vccpaux (input)
-			voltage5: vccoddr (input)
-			voltage6: vrefp (input)
-			voltage7: vrefn (input)
-			voltage8:  (input)
-	iio:device0: adm1177
-		2 channels found:
-			current0:  (input)
-			voltage0:  (input)
- 	iio:device1: ad9361-phy
-		9 channels found:
-			temp0:  (input)
-			voltage2:  (input)
+	discovered once per context, e.g. on a stock Pluto:
+	iio:device2: xadc -> xadc_temp0, xadc_voltage0 ... xadc_voltage8
+	iio:device0: adm1177 -> adm1177_current0, adm1177_voltage0
+ 	iio:device1: ad9361-phy -> ad9361-phy_temp0, ad9361-phy_voltage2
 	*/
-	std::vector<std::string> sensors;
-
-	sensors.push_back("xadc_temp0");
-	sensors.push_back("xadc_voltage0");
-	sensors.push_back("xadc_voltage1");
-	sensors.push_back("xadc_voltage2");
-	sensors.push_back("xadc_voltage3");
-	sensors.push_back("xadc_voltage4");
-	sensors.push_back("xadc_voltage5");
-	sensors.push_back("xadc_voltage6");
-	sensors.push_back("xadc_voltage7");
-	sensors.push_back("xadc_voltage8");
-	sensors.push_back("adm1177_current0");
-	sensors.push_back("adm1177_voltage0");
-	sensors.push_back("ad9361-phy_temp0");
-	sensors.push_back("ad9361-phy_voltage2");
-
-	return sensors;
+	std::vector<std::string> keys;
+
+	for (const pluto_sensor &sensor : sensors)
+		keys.push_back(sensor.key);
+
+	// statistics of the samples pushed to the DAC
+	keys.push_back("tx_peak");
+	keys.push_back("tx_rms");
+	keys.push_back("tx_papr");
+	keys.push_back("tx_clipped");
+	keys.push_back("tx_ccdf");
+
+	return keys;
 }
 
 SoapySDR::ArgInfo SoapyPlutoSDR::getSensorInfo(const std::string &key) const
 {
 	SoapySDR::ArgInfo info;
 
-	std::size_t dash = key.find("_");
-	if (dash < std::string::npos)
-	{
-		std::string deviceStr = key.substr(0, dash);
-		std::string channelStr = key.substr(dash + 1);
-
-		iio_device *dev = iio_context_find_device(ctx, deviceStr.c_str());
-		if (!dev)
-			return info;
-		iio_channel *chn = iio_device_find_channel(dev, channelStr.c_str(), false);
-		if (!chn)
-			return info;
-
-		const char *name = iio_channel_get_name(chn);
+	if (key.compare(0, 3, "tx_") == 0) {
 		info.key = key;
-		if (name)
-			info.name = name;
 		info.type = SoapySDR::ArgInfo::FLOAT;
 		info.value = "0.0";
-		info.units = id_to_unit(channelStr);
+		if (key == "tx_peak") {
+			info.name = "TX Peak";
+			info.units = "dBFS";
+			info.description = "Peak power of the TX samples over the last blocks pushed to the DAC.";
+		}
+		else if (key == "tx_rms") {
+			info.name = "TX RMS";
+			info.units = "dBFS";
+			info.description = "Average power of the TX samples, following the last blocks pushed to the DAC.";
+		}
+		else if (key == "tx_papr") {
+			info.name = "TX PAPR";
+			info.units = "dB";
+			info.description = "Ratio of tx_peak to tx_rms.";
+		}
+		else if (key == "tx_clipped") {
+			info.name = "TX Clipped";
+			info.type = SoapySDR::ArgInfo::INT;
+			info.value = "0";
+			info.description = "I or Q values on the DAC rails since the TX stream was set up.";
+		}
+		else if (key == "tx_ccdf") {
+			info.name = "TX CCDF";
+			info.type = SoapySDR::ArgInfo::STRING;
+			info.value = "";
+			info.description = "Probability of the instantaneous power exceeding the average by 0 to 15 dB, "
+				"as <n>dB=<probability> pairs, since the TX stream was set up.";
+		}
+		else {
+			return SoapySDR::ArgInfo();
+		}
+		return info;
 	}
 
+	auto it = sensor_index.find(key);
+	if (it == sensor_index.end())
+		return info;
+
+	const pluto_sensor &sensor = sensors[it->second];
+	info.key = key;
+	info.name = sensor.name;
+	info.type = SoapySDR::ArgInfo::FLOAT;
+	info.value = "0.0";
+	info.units = sensor.units;
+
 	return info;
 }
 
@@ -296,23 +419,34 @@ std::string SoapyPlutoSDR::readSensor(const std::string &key) const
 {
 	std::string sensorValue;
 
-	std::size_t dash = key.find("_");
-	if (dash < std::string::npos)
-	{
-		std::string deviceStr = key.substr(0, dash);
-		std::string channelStr = key.substr(dash + 1);
+	// the meter has its own lock, the TX stream may be blocked in a push meanwhile
+	if (key == "tx_peak")
+		return std::to_string(tx_meter->peak_dbfs());
+	if (key == "tx_rms")
+		return std::to_string(tx_meter->rms_dbfs());
+	if (key == "tx_papr")
+		return std::to_string(tx_meter->papr_db());
+	if (key == "tx_clipped")
+		return std::to_string(tx_meter->clipped());
+	if (key == "tx_ccdf")
+		return tx_meter->ccdf();
+
+	auto it = sensor_index.find(key);
+	if (it == sensor_index.end())
+		return sensorValue;
 
-		iio_device *dev = iio_context_find_device(ctx, deviceStr.c_str());
-		if (!dev)
-			return sensorValue;
-		iio_channel *chn = iio_device_find_channel(dev, channelStr.c_str(), false);
-		if (!chn)
+	{
+		std::lock_guard<std::mutex> lock(sensor_mutex);
+		if (sensor_interval_ms > 0) {
+			if (it->second < sensor_cache.size())
+				sensorValue.assign(std::to_string(sensor_cache[it->second]));
 			return sensorValue;
-
-		double value = get_sensor_value(chn);
-		sensorValue.assign(std::to_string(value));
+		}
 	}
 
+	double value = read_sensor_value(sensors[it->second]);
+	sensorValue.assign(std::to_string(value));
+
 	return sensorValue;
 }
 
@@ -325,14 +459,305 @@ SoapySDR::ArgInfoList SoapyPlutoSDR::getSettingInfo(void) const
 {
 	SoapySDR::ArgInfoList setArgs;
 
+	SoapySDR::ArgInfo rxCpuArg;
+	rxCpuArg.key = "rx_cpu";
+	rxCpuArg.value = "";
+	rxCpuArg.name = "RX Thread CPUs";
+	rxCpuArg.description = "Comma separated CPU list for the RX driver threads, applied to streams set up afterwards.";
+	rxCpuArg.type = SoapySDR::ArgInfo::STRING;
+	setArgs.push_back(rxCpuArg);
+
+	SoapySDR::ArgInfo txCpuArg;
+	txCpuArg.key = "tx_cpu";
+	txCpuArg.value = "";
+	txCpuArg.name = "TX Thread CPUs";
+	txCpuArg.description = "Comma separated CPU list for the TX driver threads, applied to streams set up afterwards.";
+	txCpuArg.type = SoapySDR::ArgInfo::STRING;
+	setArgs.push_back(txCpuArg);
+
+	SoapySDR::ArgInfo sensorArg;
+	sensorArg.key = "sensor_interval_ms";
+	sensorArg.value = "0";
+	sensorArg.name = "Sensor Sampling Interval";
+	sensorArg.description = "Sample all sensors in the background at this interval, readSensor then returns cached values. 0 reads on demand.";
+	sensorArg.units = "ms";
+	sensorArg.type = SoapySDR::ArgInfo::INT;
+	setArgs.push_back(sensorArg);
+
+	SoapySDR::ArgInfo priorityArg;
+	priorityArg.key = "rt_priority";
+	priorityArg.value = "0";
+	priorityArg.name = "Real-time Priority";
+	priorityArg.description = "SCHED_FIFO priority for the driver threads, 0 keeps the default scheduler.";
+	priorityArg.type = SoapySDR::ArgInfo::INT;
+	priorityArg.range = SoapySDR::Range(0, 99);
+	setArgs.push_back(priorityArg);
+
+	SoapySDR::ArgInfo resamplerArg;
+	resamplerArg.key = "resampler";
+	resamplerArg.value = "false";
+	resamplerArg.name = "Host Resampler";
+	resamplerArg.description = "Reach sample rates the AD9361 chain can't produce exactly by resampling on the host, applied on the next setSampleRate.";
+	resamplerArg.type = SoapySDR::ArgInfo::BOOL;
+	setArgs.push_back(resamplerArg);
+
+	SoapySDR::ArgInfo recordArg;
+	recordArg.key = "record";
+	recordArg.value = "";
+	recordArg.name = "Record RX";
+	recordArg.description = "Record the raw RX blocks of the open stream to <path>.sigmf-data/.sigmf-meta, an empty path stops.";
+	recordArg.type = SoapySDR::ArgInfo::STRING;
+	setArgs.push_back(recordArg);
+
+	SoapySDR::ArgInfo playArg;
+	playArg.key = "play";
+	playArg.value = "";
+	playArg.name = "Play File on TX";
+	playArg.description = "Transmit a file of samples in the TX stream format at the hardware rate, an empty path stops.";
+	playArg.type = SoapySDR::ArgInfo::STRING;
+	setArgs.push_back(playArg);
+
+	SoapySDR::ArgInfo playLoopArg;
+	playLoopArg.key = "play_loop";
+	playLoopArg.value = "false";
+	playLoopArg.name = "Loop Playback";
+	playLoopArg.description = "Restart the played file from the beginning when it ends.";
+	playLoopArg.type = SoapySDR::ArgInfo::BOOL;
+	setArgs.push_back(playLoopArg);
+
+	SoapySDR::ArgInfo shmArg;
+	shmArg.key = "shm_publish";
+	shmArg.value = "";
+	shmArg.name = "Publish RX to Shared Memory";
+	shmArg.description = "Publish the raw RX blocks of the open stream to this POSIX shared memory ring, "
+		"read with PlutoSDR_SharedRing.hpp. An empty name stops.";
+	shmArg.type = SoapySDR::ArgInfo::STRING;
+	setArgs.push_back(shmArg);
+
+	SoapySDR::ArgInfo shmSizeArg;
+	shmSizeArg.key = "shm_size_mb";
+	shmSizeArg.value = "64";
+	shmSizeArg.name = "Shared Memory Ring Size";
+	shmSizeArg.description = "Data size of the shared memory ring created by the next shm_publish.";
+	shmSizeArg.units = "MiB";
+	shmSizeArg.type = SoapySDR::ArgInfo::INT;
+	setArgs.push_back(shmSizeArg);
+
+	SoapySDR::ArgInfo snapshotArg;
+	snapshotArg.key = "snapshot";
+	snapshotArg.value = "";
+	snapshotArg.name = "RX Snapshots";
+	snapshotArg.description = "Keep the last raw RX blocks of the open stream in a ring and write the window around each "
+		"trigger to <path>_<n>.sigmf-data/.sigmf-meta, an empty path stops.";
+	snapshotArg.type = SoapySDR::ArgInfo::STRING;
+	setArgs.push_back(snapshotArg);
+
+	SoapySDR::ArgInfo snapshotPreArg;
+	snapshotPreArg.key = "snapshot_pre_ms";
+	snapshotPreArg.value = "300";
+	snapshotPreArg.name = "Snapshot Pre-trigger";
+	snapshotPreArg.description = "Time kept before the trigger by the next snapshot ring.";
+	snapshotPreArg.units = "ms";
+	snapshotPreArg.type = SoapySDR::ArgInfo::FLOAT;
+	setArgs.push_back(snapshotPreArg);
+
+	SoapySDR::ArgInfo snapshotPostArg;
+	snapshotPostArg.key = "snapshot_post_ms";
+	snapshotPostArg.value = "100";
+	snapshotPostArg.name = "Snapshot Post-trigger";
+	snapshotPostArg.description = "Time recorded after the trigger by the next snapshot ring.";
+	snapshotPostArg.units = "ms";
+	snapshotPostArg.type = SoapySDR::ArgInfo::FLOAT;
+	setArgs.push_back(snapshotPostArg);
+
+	SoapySDR::ArgInfo snapshotThresholdArg;
+	snapshotThresholdArg.key = "snapshot_threshold";
+	snapshotThresholdArg.value = "";
+	snapshotThresholdArg.name = "Snapshot Energy Trigger";
+	snapshotThresholdArg.description = "Trigger the next snapshot ring when the mean power of 1024 samples rises over this level, "
+		"empty for manual triggers only.";
+	snapshotThresholdArg.units = "dBFS";
+	snapshotThresholdArg.type = SoapySDR::ArgInfo::STRING;
+	setArgs.push_back(snapshotThresholdArg);
+
+	SoapySDR::ArgInfo snapshotTriggerArg;
+	snapshotTriggerArg.key = "snapshot_trigger";
+	snapshotTriggerArg.value = "";
+	snapshotTriggerArg.name = "Trigger Snapshot";
+	snapshotTriggerArg.description = "Write any value to trigger a snapshot at the current sample.";
+	snapshotTriggerArg.type = SoapySDR::ArgInfo::STRING;
+	setArgs.push_back(snapshotTriggerArg);
+
+	SoapySDR::ArgInfo dpdArg;
+	dpdArg.key = "dpd_coeffs";
+	dpdArg.value = "";
+	dpdArg.name = "Predistorter Coefficients";
+	dpdArg.description = "Memory polynomial of the dpd TX stage, \"<order> <memory> <re> <im> ...\" "
+		"with c[k * memory + m] weighting x[n - m] * |x[n - m]|^k. An empty value restores the identity.";
+	dpdArg.type = SoapySDR::ArgInfo::STRING;
+	setArgs.push_back(dpdArg);
+
+	SoapySDR::ArgInfo dpdTrainArg;
+	dpdTrainArg.key = "dpd_train";
+	dpdTrainArg.value = "";
+	dpdTrainArg.name = "Train Predistorter";
+	dpdTrainArg.description = "\"<tx.cf32> <rx.cf32> [order [memory]]\": fit the predistorter to a capture of "
+		"the PA input and output and load it, read back the training report.";
+	dpdTrainArg.type = SoapySDR::ArgInfo::STRING;
+	setArgs.push_back(dpdTrainArg);
+
+	SoapySDR::ArgInfo dpdTestArg;
+	dpdTestArg.key = "dpd_selftest";
+	dpdTestArg.value = "";
+	dpdTestArg.name = "Predistorter Self Test";
+	dpdTestArg.description = "\"[order [memory]]\": train against the pa_model stage without hardware, "
+		"read back the error with and without the predistorter.";
+	dpdTestArg.type = SoapySDR::ArgInfo::STRING;
+	setArgs.push_back(dpdTestArg);
+
+	SoapySDR::ArgInfo channelizerArg;
+	channelizerArg.key = "channelizer";
+	channelizerArg.value = "0";
+	channelizerArg.name = "RX Channelizer";
+	channelizerArg.description = "Split the RX band in this power of two number of sub-bands, exposed as RX channels from the "
+		"lowest to the highest frequency. Sub-band c is centered (c - n / 2) * rate / n from the RX center and runs at rate / n. "
+		"Applies to RX streams set up afterwards, convert_threads spreads the filtering across threads. 0 turns it off.";
+	channelizerArg.type = SoapySDR::ArgInfo::INT;
+	channelizerArg.range = SoapySDR::Range(0, 1024);
+	setArgs.push_back(channelizerArg);
+
+#ifdef PLUTO_TRACE
+	SoapySDR::ArgInfo traceArg;
+	traceArg.key = "trace_dump";
+	traceArg.value = "";
+	traceArg.name = "Dump Trace";
+	traceArg.description = "Write the last hot path events of every driver thread to this file as Chrome trace JSON, "
+		"for chrome://tracing or ui.perfetto.dev. Read back the number of events each thread recorded.";
+	traceArg.type = SoapySDR::ArgInfo::STRING;
+	setArgs.push_back(traceArg);
+#endif
+
 	return setArgs;
 }
 
 void SoapyPlutoSDR::writeSetting(const std::string &key, const std::string &value)
 {
-
-
-
+	if (key == "rx_cpu") {
+		rx_thread_policy.cpus = pluto_parse_cpu_list(value);
+	}
+	else if (key == "tx_cpu") {
+		tx_thread_policy.cpus = pluto_parse_cpu_list(value);
+	}
+	else if (key == "rt_priority") {
+		try
+		{
+			rx_thread_policy.rt_priority = tx_thread_policy.rt_priority = std::stoi(value);
+		}
+		catch (const std::invalid_argument &){}
+	}
+	else if (key == "sensor_interval_ms") {
+		try
+		{
+			start_sensor_sampler(std::stol(value));
+		}
+		catch (const std::invalid_argument &){}
+	}
+	else if (key == "resampler") {
+		resampler_enabled = (value == "true" || value == "1");
+	}
+	else if (key == "record") {
+		if (value.empty())
+			stop_recording();
+		else
+			start_recording(value);
+	}
+	else if (key == "play_loop") {
+		play_loop = (value == "true" || value == "1");
+	}
+	else if (key == "shm_publish") {
+		if (value.empty())
+			stop_publishing();
+		else
+			start_publishing(value);
+	}
+	else if (key == "shm_size_mb") {
+		try
+		{
+			shm_size_mb = std::stoul(value);
+		}
+		catch (const std::invalid_argument &){}
+	}
+	else if (key == "snapshot") {
+		if (value.empty())
+			stop_snapshots();
+		else
+			start_snapshots(value);
+	}
+	else if (key == "snapshot_pre_ms") {
+		try
+		{
+			snapshot_pre_ms = std::stod(value);
+		}
+		catch (const std::invalid_argument &){}
+	}
+	else if (key == "snapshot_post_ms") {
+		try
+		{
+			snapshot_post_ms = std::stod(value);
+		}
+		catch (const std::invalid_argument &){}
+	}
+	else if (key == "snapshot_threshold") {
+		snapshot_threshold = value;
+	}
+	else if (key == "snapshot_trigger") {
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		if (snapshot)
+			snapshot->trigger();
+		else
+			SoapySDR_logf(SOAPY_SDR_ERROR, "No snapshot ring to trigger, set snapshot first");
+	}
+	else if (key == "channelizer") {
+		try
+		{
+			const size_t bands = std::stoul(value);
+			if (bands > 1024 || (bands & (bands - 1)) != 0)
+				SoapySDR_logf(SOAPY_SDR_ERROR, "The channelizer needs a power of two number of sub-bands, up to 1024");
+			else
+				rx_channelizer_bands = bands;
+		}
+		catch (const std::invalid_argument &){}
+	}
+	else if (key == "dpd_coeffs") {
+		load_dpd(value);
+	}
+	else if (key == "dpd_train") {
+		train_dpd(value);
+	}
+	else if (key == "dpd_selftest") {
+		selftest_dpd(value);
+	}
+	else if (key == "trace_dump") {
+#ifdef PLUTO_TRACE
+		pluto_trace_dump(value);
+#else
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Tracing is not compiled in, configure with -DENABLE_TRACE=ON");
+#endif
+	}
+	else if (key == "play") {
+		// the file holds samples at the hardware rate
+		const double sample_rate = (tx_app_rate > 0.0) ? tx_hw_rate : getSampleRate(SOAPY_SDR_TX, 0);
+
+		std::lock_guard<std::mutex> playback_lock(tx_playback_mutex);
+		std::unique_lock<pluto_spin_mutex> lock(tx_device_mutex);
+		if (!tx_stream)
+			SoapySDR_logf(SOAPY_SDR_ERROR, "Playback needs a TX stream set up first");
+		else {
+			stop_tx_playback(lock);
+			if (!value.empty())
+				tx_stream->start_playback(value, play_loop, sample_rate);
+		}
+	}
 }
 
 
@@ -340,6 +765,104 @@ std::string SoapyPlutoSDR::readSetting(const std::string &key) const
 {
 	std::string info;
 
+	if (key == "rx_activation_us") {
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		if (rx_stream)
+			info = std::to_string(rx_stream->get_activation_us());
+	}
+	else if (key == "rx_cpu") {
+		info = pluto_format_cpu_list(rx_thread_policy.cpus);
+	}
+	else if (key == "tx_cpu") {
+		info = pluto_format_cpu_list(tx_thread_policy.cpus);
+	}
+	else if (key == "rt_priority") {
+		info = std::to_string(rx_thread_policy.rt_priority);
+	}
+	else if (key == "sensor_interval_ms") {
+		info = std::to_string(sensor_interval_ms.load());
+	}
+	else if (key == "sensor_age_ms") {
+		// age of the values readSensor currently returns
+		std::lock_guard<std::mutex> lock(sensor_mutex);
+		if (sensor_interval_ms > 0 && !sensor_cache.empty())
+			info = std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - sensor_time).count());
+	}
+	else if (key == "threads") {
+		// what was actually applied to each running driver thread
+		info = pluto_thread_report(this);
+	}
+	else if (key == "resampler") {
+		info = resampler_enabled ? "true" : "false";
+	}
+	else if (key == "record") {
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		if (recorder)
+			info = recorder->status();
+	}
+	else if (key == "play_loop") {
+		info = play_loop ? "true" : "false";
+	}
+	else if (key == "shm_publish") {
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		if (shm_publisher)
+			info = shm_publisher->status();
+	}
+	else if (key == "shm_size_mb") {
+		info = std::to_string(shm_size_mb);
+	}
+	else if (key == "snapshot") {
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		if (snapshot)
+			info = snapshot->status();
+	}
+	else if (key == "snapshot_pre_ms") {
+		info = std::to_string(snapshot_pre_ms);
+	}
+	else if (key == "snapshot_post_ms") {
+		info = std::to_string(snapshot_post_ms);
+	}
+	else if (key == "snapshot_threshold") {
+		info = snapshot_threshold;
+	}
+	else if (key == "play") {
+		std::lock_guard<pluto_spin_mutex> lock(tx_device_mutex);
+		if (tx_stream)
+			info = tx_stream->get_playback_status();
+	}
+	else if (key == "channelizer") {
+		info = std::to_string(rx_channelizer_bands);
+	}
+#ifdef PLUTO_TRACE
+	else if (key == "trace_dump") {
+		info = pluto_trace_status();
+	}
+#endif
+	else if (key == "dpd_coeffs") {
+		std::lock_guard<std::mutex> lock(dpd_mutex);
+		info = dpd_coeffs;
+	}
+	else if (key == "dpd_train" || key == "dpd_selftest") {
+		std::lock_guard<std::mutex> lock(dpd_mutex);
+		info = dpd_report;
+	}
+	else if (key == "rx_stats") {
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		if (rx_stream)
+			info = rx_stream->get_stats();
+	}
+	else if (key == "rx_consumers") {
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		if (rx_broadcast)
+			info = rx_broadcast->status();
+	}
+	else if (key == "tx_stats") {
+		std::lock_guard<pluto_spin_mutex> lock(tx_device_mutex);
+		if (tx_stream)
+			info = tx_stream->get_stats();
+	}
+
 	return info;
 }
 
@@ -390,9 +913,54 @@ std::string SoapyPlutoSDR::getAntenna( const int direction, const size_t channel
 
 bool SoapyPlutoSDR::hasDCOffsetMode( const int direction, const size_t channel ) const
 {
+	// software correction in the RX conversion
+	return(direction == SOAPY_SDR_RX);
+}
+
+void SoapyPlutoSDR::setDCOffsetMode( const int direction, const size_t channel, const bool automatic )
+{
+	if (direction == SOAPY_SDR_RX) {
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		rx_dc_offset_mode = automatic;
+		if (rx_stream)
+			rx_stream->set_correction(rx_dc_offset_mode, rx_iq_balance_mode);
+	}
+}
+
+bool SoapyPlutoSDR::getDCOffsetMode( const int direction, const size_t channel ) const
+{
+	if (direction == SOAPY_SDR_RX)
+		return rx_dc_offset_mode;
+	return(false);
+}
+
+#ifdef SOAPY_SDR_API_HAS_IQ_BALANCE_MODE
+
+bool SoapyPlutoSDR::hasIQBalanceMode( const int direction, const size_t channel ) const
+{
+	// software correction in the RX conversion
+	return(direction == SOAPY_SDR_RX);
+}
+
+void SoapyPlutoSDR::setIQBalanceMode( const int direction, const size_t channel, const bool automatic )
+{
+	if (direction == SOAPY_SDR_RX) {
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		rx_iq_balance_mode = automatic;
+		if (rx_stream)
+			rx_stream->set_correction(rx_dc_offset_mode, rx_iq_balance_mode);
+	}
+}
+
+bool SoapyPlutoSDR::getIQBalanceMode( const int direction, const size_t channel ) const
+{
+	if (direction == SOAPY_SDR_RX)
+		return rx_iq_balance_mode;
 	return(false);
 }
 
+#endif
+
 /*******************************************************************
  * Gain API
  ******************************************************************/
@@ -440,6 +1008,10 @@ void SoapyPlutoSDR::setGain( const int direction, const size_t channel, const do
 	if(direction==SOAPY_SDR_RX){
         std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
 		iio_channel_attr_write_longlong(iio_device_find_channel(dev, "voltage0", false),"hardwaregain", gain);
+		if (recorder)
+			recorder->set_gain(double(gain));
+		if (snapshot)
+			snapshot->set_gain(double(gain));
 
 	}
 
@@ -493,13 +1065,50 @@ SoapySDR::Range SoapyPlutoSDR::getGainRange( const int direction, const size_t c
  * Frequency API
  ******************************************************************/
 
+// LO readback error of the AD9361 synthesizers plus the integer Hz truncation
+static const double rx_lo_resolution = 5.0;
+
 void SoapyPlutoSDR::setFrequency( const int direction, const size_t channel, const std::string &name, const double frequency, const SoapySDR::Kwargs &args )
 {
 	long long freq = (long long)frequency;
+	PLUTO_TRACE_SCOPE("retune", freq);
 	if(direction==SOAPY_SDR_RX){
 
         std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+
+		if (args.count("ppm") != 0) {
+			try
+			{
+				rx_ppm = std::stod(args.at("ppm"));
+			}
+			catch (const std::invalid_argument &){}
+		}
+
+		if (name == "BB") {
+			// the generic setFrequency hands the LO rounding error to BB, only
+			// an explicit offset is worth running the DDC for
+			rx_bb_frequency = (std::fabs(frequency) < rx_lo_resolution) ? 0.0 : frequency;
+			update_rx_ddc();
+			return;
+		}
+
+		// the LO is tuned off the requested frequency, the DDC brings it back
+		if (args.count("freq_offset") != 0) {
+			try
+			{
+				const double offset = std::stod(args.at("freq_offset"));
+				freq = (long long)(frequency + offset);
+				rx_bb_frequency = -offset;
+			}
+			catch (const std::invalid_argument &){}
+		}
+
 		iio_channel_attr_write_longlong(iio_device_find_channel(dev, "altvoltage0", true),"frequency", freq);
+		update_rx_ddc();
+		if (recorder)
+			recorder->set_frequency(double(freq));
+		if (snapshot)
+			snapshot->set_frequency(double(freq));
 	}
 
 	else if(direction==SOAPY_SDR_TX){
@@ -518,6 +1127,9 @@ double SoapyPlutoSDR::getFrequency( const int direction, const size_t channel, c
 
         std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
 
+		if (name == "BB")
+			return rx_bb_frequency;
+
 		if(iio_channel_attr_read_longlong(iio_device_find_channel(dev, "altvoltage0", true),"frequency",&freq )!=0)
 			return 0;
 
@@ -541,18 +1153,64 @@ SoapySDR::ArgInfoList SoapyPlutoSDR::getFrequencyArgsInfo(const int direction, c
 
 	SoapySDR::ArgInfoList freqArgs;
 
+	if (direction == SOAPY_SDR_RX) {
+		SoapySDR::ArgInfo offsetArg;
+		offsetArg.key = "freq_offset";
+		offsetArg.value = "0";
+		offsetArg.name = "LO Offset";
+		offsetArg.description = "Tune the LO this far from the requested frequency to keep its leakage out of the band, "
+			"the DDC stage of the RX stream shifts the signal back to DC. Sets the BB component to -freq_offset.";
+		offsetArg.units = "Hz";
+		offsetArg.type = SoapySDR::ArgInfo::FLOAT;
+		freqArgs.push_back(offsetArg);
+
+		SoapySDR::ArgInfo ppmArg;
+		ppmArg.key = "ppm";
+		ppmArg.value = "0";
+		ppmArg.name = "Frequency Correction";
+		ppmArg.description = "Error of the reference clock, the DDC corrects the resulting LO error.";
+		ppmArg.units = "ppm";
+		ppmArg.type = SoapySDR::ArgInfo::FLOAT;
+		freqArgs.push_back(ppmArg);
+	}
+
 	return freqArgs;
 }
 
+void SoapyPlutoSDR::update_rx_ddc()
+{
+	if (!rx_stream)
+		return;
+
+	long long lo = 0;
+	iio_channel_attr_read_longlong(iio_device_find_channel(dev, "altvoltage0", true), "frequency", &lo);
+
+	// the signal sits at the BB frequency, moved by the LO error
+	const double shift = -rx_bb_frequency + double(lo) * rx_ppm * 1e-6;
+	if (shift == rx_stream->get_ddc())
+		return;
+
+	rx_stream->set_ddc(shift);
+	rx_stream->set_resampling(rx_hw_rate, rx_app_rate);
+}
+
 std::vector<std::string> SoapyPlutoSDR::listFrequencies( const int direction, const size_t channel ) const
 {
 	std::vector<std::string> names;
 	names.push_back( "RF" );
+	if (direction == SOAPY_SDR_RX)
+		names.push_back( "BB" );
 	return(names);
 }
 
 SoapySDR::RangeList SoapyPlutoSDR::getFrequencyRange( const int direction, const size_t channel, const std::string &name ) const
 {
+	if (direction == SOAPY_SDR_RX && name == "BB") {
+		// the DDC runs at the hardware rate, ahead of any resampling
+		const double rate = (rx_app_rate > 0.0) ? rx_hw_rate : getSampleRate(SOAPY_SDR_RX, channel);
+		return(SoapySDR::RangeList( 1, SoapySDR::Range( -rate / 2, rate / 2 ) ) );
+	}
+
 	return(SoapySDR::RangeList( 1, SoapySDR::Range( 46000000, 6000000000ull ) ) );
 
 }
@@ -572,6 +1230,13 @@ void SoapyPlutoSDR::setSampleRate( const int direction, const size_t channel, co
 	// note: sample rates below 25e6/12 need x8 decimation/interpolation or x4 FIR to 25e6/48,
 	// below 25e6/96 need x8 decimation/interpolation and x4 FIR, minimum is 25e6/384
 	// if libad9361 is available it will load an approporiate FIR.
+	const double min_hw_rate = 25e6 / (96 * fir);
+
+	// with the host resampler, run the hardware at the smallest integer multiple
+	// of the requested rate it supports, integer ratios keep the polyphase filter cheap
+	if (resampler_enabled && rate < min_hw_rate)
+		samplerate = (long long)std::ceil(rate * std::ceil(min_hw_rate / rate));
+
 	if(direction==SOAPY_SDR_RX){
         std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
 		decimation = false;
@@ -598,8 +1263,19 @@ void SoapyPlutoSDR::setSampleRate( const int direction, const size_t channel, co
 		// reconfigures the entire decimation chain and resets the FPGA rate.
 		iio_channel_attr_write_longlong(iio_device_find_channel(rx_dev, "voltage0", false), "sampling_frequency", decimation?samplerate/8:samplerate);
 
-		if(rx_stream)
+		long long hw_rate = 0;
+		iio_channel_attr_read_longlong(iio_device_find_channel(rx_dev, "voltage0", false), "sampling_frequency", &hw_rate);
+		rx_hw_rate = double(hw_rate);
+		rx_app_rate = (resampler_enabled && std::fabs(rx_hw_rate - rate) >= 1.0) ? rate : 0.0;
+
+		if(rx_stream) {
 			rx_stream->set_buffer_size_by_samplerate(decimation ? samplerate / 8 : samplerate);
+			rx_stream->set_resampling(rx_hw_rate, rx_app_rate);
+		}
+		if (shm_publisher)
+			shm_publisher->set_sample_rate(rx_hw_rate);
+		if (snapshot)
+			snapshot->set_sample_rate(rx_hw_rate);
 	}
 
 	else if(direction==SOAPY_SDR_TX){
@@ -627,6 +1303,14 @@ void SoapyPlutoSDR::setSampleRate( const int direction, const size_t channel, co
 		// FPGA data port rate must be set AFTER ad9361_set_bb_rate()
 		iio_channel_attr_write_longlong(iio_device_find_channel(tx_dev, "voltage0", true), "sampling_frequency", interpolation?samplerate / 8:samplerate);
 
+		long long hw_rate = 0;
+		iio_channel_attr_read_longlong(iio_device_find_channel(tx_dev, "voltage0", true), "sampling_frequency", &hw_rate);
+		tx_hw_rate = double(hw_rate);
+		tx_app_rate = (resampler_enabled && std::fabs(tx_hw_rate - rate) >= 1.0) ? rate : 0.0;
+
+		if(tx_stream)
+			tx_stream->set_resampling(tx_hw_rate, tx_app_rate);
+
 	}
 
 }
@@ -639,6 +1323,9 @@ double SoapyPlutoSDR::getSampleRate( const int direction, const size_t channel )
 
         std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
 
+		if (rx_app_rate > 0.0)
+			return rx_app_rate;
+
 		if(iio_channel_attr_read_longlong(iio_device_find_channel(rx_dev, "voltage0", false),"sampling_frequency",&samplerate )!=0)
 			return 0;
 	}
@@ -647,6 +1334,9 @@ double SoapyPlutoSDR::getSampleRate( const int direction, const size_t channel )
         
         std::lock_guard<pluto_spin_mutex> lock(tx_device_mutex);
 
+		if (tx_app_rate > 0.0)
+			return tx_app_rate;
+
 		if(iio_channel_attr_read_longlong(iio_device_find_channel(tx_dev, "voltage0", true),"sampling_frequency",&samplerate)!=0)
 			return 0;
 
@@ -685,6 +1375,12 @@ SoapySDR::RangeList SoapyPlutoSDR::getSampleRateRange( const int direction, cons
 {
 	SoapySDR::RangeList results;
 
+	// the host resampler reaches any rate below the hardware range
+	if (resampler_enabled) {
+		results.push_back(SoapySDR::Range(1e3, 61440000));
+		return results;
+	}
+
 	// note that there are some gaps and rounding errors since we get truncated values form IIO
 	// e.g. 25e6/12 = 2083333.333 is read as 2083333 but written as 2083334
 #ifdef HAS_AD9361_IIO
@@ -760,3 +1456,99 @@ std::vector<double> SoapyPlutoSDR::listBandwidths( const int direction, const si
 	return(options);
 
 }
+
+void SoapyPlutoSDR::load_dpd(const std::string &coeffs)
+{
+	pluto_dpd_coeffs parsed;
+	if (!coeffs.empty() && !pluto_parse_dpd_coeffs(coeffs, parsed)) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Invalid predistorter coefficients, expected \"<order> <memory> <re> <im> ...\"");
+		return;
+	}
+
+	const std::string loaded = coeffs.empty() ? "" : pluto_format_dpd_coeffs(parsed);
+	{
+		std::lock_guard<std::mutex> lock(dpd_mutex);
+		dpd_coeffs = loaded;
+	}
+
+	// rebuilding the chains resets the stage history, the stream keeps running
+	std::lock_guard<pluto_spin_mutex> lock(tx_device_mutex);
+	if (tx_stream) {
+		tx_stream->set_dsp_arg("dpd_coeffs", loaded);
+		tx_stream->set_resampling(tx_hw_rate, tx_app_rate);
+	}
+}
+
+static std::vector<float> read_cf32(const std::string &path)
+{
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file)
+		throw std::runtime_error("Unable to open " + path);
+
+	const std::streamsize bytes = file.tellg();
+	std::vector<float> samples(size_t(bytes) / sizeof(float) / 2 * 2);
+	file.seekg(0);
+	file.read((char *)samples.data(), samples.size() * sizeof(float));
+	return samples;
+}
+
+void SoapyPlutoSDR::train_dpd(const std::string &args)
+{
+	std::istringstream list(args);
+	std::string tx_path, rx_path;
+	size_t order = 5, memory = 3;
+	list >> tx_path >> rx_path;
+	if (list >> order)
+		list >> memory;
+
+	if (rx_path.empty()) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "dpd_train expects \"<tx.cf32> <rx.cf32> [order [memory]]\"");
+		return;
+	}
+
+	try
+	{
+		const std::vector<float> tx = read_cf32(tx_path);
+		const std::vector<float> rx = read_cf32(rx_path);
+		const size_t items = std::min(tx.size(), rx.size()) / 2;
+
+		// CF32 captures are relative to full scale already
+		const pluto_dpd_coeffs coeffs = pluto_dpd_train(tx.data(), rx.data(), items, order, memory, 1.0f);
+		set_dpd_report("items=" + std::to_string(items) + ",coeffs=" + pluto_format_dpd_coeffs(coeffs));
+		load_dpd(pluto_format_dpd_coeffs(coeffs));
+
+		SoapySDR_logf(SOAPY_SDR_INFO, "Predistorter trained on %lu samples, order %lu, memory %lu",
+			(unsigned long)items, (unsigned long)coeffs.order, (unsigned long)coeffs.memory);
+	}
+	catch (const std::runtime_error &e)
+	{
+		set_dpd_report(std::string("error=") + e.what());
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Predistorter training failed: %s", e.what());
+	}
+}
+
+void SoapyPlutoSDR::selftest_dpd(const std::string &args)
+{
+	std::istringstream list(args);
+	size_t order = 5, memory = 3;
+	if (list >> order)
+		list >> memory;
+
+	try
+	{
+		const std::string report = pluto_dpd_selftest(std::max<size_t>(order, 1), std::max<size_t>(memory, 1));
+		set_dpd_report(report);
+		SoapySDR_logf(SOAPY_SDR_INFO, "Predistorter self test: %s", report.c_str());
+	}
+	catch (const std::runtime_error &e)
+	{
+		set_dpd_report(std::string("error=") + e.what());
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Predistorter self test failed: %s", e.what());
+	}
+}
+
+void SoapyPlutoSDR::set_dpd_report(const std::string &report)
+{
+	std::lock_guard<std::mutex> lock(dpd_mutex);
+	dpd_report = report;
+}
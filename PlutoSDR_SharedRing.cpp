@@ -0,0 +1,179 @@
+#include "SoapyPlutoSDR.hpp"
+#include "PlutoSDR_SharedRing.hpp"
+#include <sstream>
+#include <new>
+
+// true when no object of that name exists or it is a ring its publisher has left
+static bool shm_ring_released(const std::string &name)
+{
+	const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return errno == ENOENT;
+
+	struct stat st;
+	void *base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(pluto_shm_ring_header))
+		base = mmap(nullptr, sizeof(pluto_shm_ring_header), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return false;
+
+	const pluto_shm_ring_header *header = (const pluto_shm_ring_header *)base;
+	const bool released = (header->magic == PLUTO_SHM_RING_MAGIC && header->writer_alive.load(std::memory_order_acquire) == 0);
+	munmap(base, sizeof(pluto_shm_ring_header));
+	return released;
+}
+
+pluto_shm_publisher::pluto_shm_publisher(const std::string &_name, const pluto_raw_info &raw, const double sample_rate, const size_t capacity):
+	name((_name.empty() || _name[0] != '/') ? "/" + _name : _name), header(nullptr), data(nullptr), mapped(0)
+{
+	const size_t item_bytes = raw.num_channels * ((raw.datatype == "ci8") ? 2 : 4);
+	const size_t data_offset = (sizeof(pluto_shm_ring_header) + 4095) & ~size_t(4095);
+	const size_t ring_bytes = std::max(capacity, size_t(1) << 20) / item_bytes * item_bytes;
+
+	// a ring is only replaced once its publisher marked it as left, a crashed
+	// publisher can't, its ring has to be removed by hand
+	if (!shm_ring_released(name)) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Shared memory %s is in use, remove /dev/shm%s if its publisher is gone", name.c_str(), name.c_str());
+		throw std::runtime_error("Shared memory " + name + " is in use");
+	}
+	shm_unlink(name.c_str());
+
+	const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+	if (fd < 0) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to create shared memory %s: %s", name.c_str(), strerror(errno));
+		throw std::runtime_error("Unable to create shared memory " + name);
+	}
+
+	mapped = data_offset + ring_bytes;
+	void *base = MAP_FAILED;
+	if (ftruncate(fd, mapped) == 0)
+		base = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED) {
+		shm_unlink(name.c_str());
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to map shared memory %s: %s", name.c_str(), strerror(errno));
+		throw std::runtime_error("Unable to map shared memory " + name);
+	}
+
+	// the new mapping is zero filled, which is a valid state for the atomics
+	header = new (base) pluto_shm_ring_header();
+	header->version = PLUTO_SHM_RING_VERSION;
+	header->data_offset = data_offset;
+	header->capacity = ring_bytes;
+	header->item_bytes = uint32_t(item_bytes);
+	header->num_channels = uint32_t(raw.num_channels);
+	strncpy(header->datatype, raw.datatype.c_str(), sizeof(header->datatype) - 1);
+	header->sample_rate = uint64_t(sample_rate);
+	header->writer_alive = 1;
+	data = (uint8_t *)base + data_offset;
+
+	// readers check the magic last
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic = PLUTO_SHM_RING_MAGIC;
+
+	SoapySDR_logf(SOAPY_SDR_INFO, "Publishing RX blocks to shared memory %s (%lu MiB)", name.c_str(), (unsigned long)(ring_bytes >> 20));
+}
+
+pluto_shm_publisher::~pluto_shm_publisher()
+{
+	header->writer_alive.store(0, std::memory_order_release);
+	munmap((void *)header, mapped);
+	// attached readers keep their mapping until they close it
+	shm_unlink(name.c_str());
+}
+
+void pluto_shm_publisher::on_block(const uint8_t *block, const size_t bytes, const size_t items, const unsigned long long first_item)
+{
+	uint64_t pos = header->write_pos.load(std::memory_order_relaxed);
+	size_t count = bytes;
+
+	// only the tail of a block larger than the ring can be kept
+	if (count > header->capacity) {
+		const size_t skipped = count - header->capacity;
+		block += skipped;
+		pos += skipped;
+		count = header->capacity;
+	}
+
+	header->write_reserve.store(pos + count, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	const size_t offset = pos % header->capacity;
+	const size_t first = std::min<size_t>(count, header->capacity - offset);
+	std::memcpy(data + offset, block, first);
+	std::memcpy(data, block + first, count - first);
+
+	header->write_pos.store(pos + count, std::memory_order_release);
+}
+
+void pluto_shm_publisher::set_sample_rate(const double sample_rate)
+{
+	header->sample_rate.store(uint64_t(sample_rate), std::memory_order_release);
+}
+
+std::string pluto_shm_publisher::status() const
+{
+	const uint64_t pos = header->write_pos.load(std::memory_order_acquire);
+
+	std::ostringstream status;
+	status.imbue(std::locale::classic());
+	status << "name=" << name;
+	status << ",published=" << pos / header->item_bytes;
+
+	for (const auto &reader : header->readers) {
+		const int32_t pid = reader.pid.load();
+		if (pid == 0)
+			continue;
+		status << ",reader" << pid << "_lag=" << (pos - reader.cursor.load()) / header->item_bytes;
+		status << ",reader" << pid << "_overruns=" << reader.overruns.load();
+	}
+
+	return status.str();
+}
+
+void SoapyPlutoSDR::start_publishing(const std::string &name)
+{
+	stop_publishing();
+
+	double sample_rate, frequency, gain;
+	pluto_raw_info raw;
+	{
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		if (!rx_stream) {
+			SoapySDR_logf(SOAPY_SDR_ERROR, "Publishing needs an RX stream set up first");
+			return;
+		}
+		raw = rx_stream->get_raw_info();
+		read_rx_capture(sample_rate, frequency, gain);
+	}
+
+	std::shared_ptr<pluto_shm_publisher> started;
+	try
+	{
+		started = std::make_shared<pluto_shm_publisher>(name, raw, sample_rate, shm_size_mb << 20);
+	}
+	catch (const std::exception &e)
+	{
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Publishing not started: %s", e.what());
+		return;
+	}
+
+	std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+	if (rx_stream) {
+		shm_publisher = started;
+		rx_stream->add_tap(shm_publisher);
+	}
+}
+
+void SoapyPlutoSDR::stop_publishing()
+{
+	std::shared_ptr<pluto_shm_publisher> stopped;
+	{
+		std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+		stopped.swap(shm_publisher);
+		if (stopped && rx_stream)
+			rx_stream->remove_tap(stopped.get());
+	}
+}
@@ -0,0 +1,192 @@
+#pragma once
+// Shared memory ring the SoapyPlutoSDR module publishes its raw RX blocks to,
+// see writeSetting("shm_publish", "<name>"). This header is all another
+// process needs to read the ring: C++11, POSIX, no link dependency besides
+// librt on older glibc.
+//
+// Layout: a pluto_shm_ring_header followed, at data_offset, by a circular
+// data area of capacity bytes. Positions are byte counts since the ring was
+// created, the byte at position p lives at data[p % capacity]. The publisher
+// announces the end of the region it is about to overwrite in write_reserve
+// before copying, then advances write_pos. Readers keep their own cursor and
+// only trust data that write_reserve has not caught up with.
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PLUTO_SHM_RING_MAGIC 0x52534c50u // "PLSR"
+#define PLUTO_SHM_RING_VERSION 1
+#define PLUTO_SHM_RING_MAX_READERS 16
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the shared ring needs lock free 64 bit atomics");
+
+struct pluto_shm_reader_slot {
+	std::atomic<int32_t> pid; // 0 when the slot is free
+	uint32_t reserved;
+	std::atomic<uint64_t> cursor;
+	std::atomic<uint64_t> overruns;
+};
+
+struct pluto_shm_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t data_offset;
+	uint64_t capacity;
+	uint32_t item_bytes;   // bytes of one item, all channels interleaved
+	uint32_t num_channels;
+	char datatype[16];     // SigMF datatype of the items, "ci16_le" or "ci8"
+	std::atomic<uint64_t> sample_rate; // in S/s, updated on rate changes
+	std::atomic<uint64_t> write_reserve;
+	std::atomic<uint64_t> write_pos;
+	std::atomic<uint32_t> writer_alive;
+	uint32_t reserved;
+	pluto_shm_reader_slot readers[PLUTO_SHM_RING_MAX_READERS];
+};
+
+class pluto_shm_reader {
+
+	public:
+		pluto_shm_reader() : header(nullptr), data(nullptr), mapped(0), slot(nullptr), cursor(0) {}
+		~pluto_shm_reader() { close(); }
+
+		// attach to the ring, reading starts with the next published block
+		bool open(const std::string &name)
+		{
+			close();
+
+			const std::string path = (name.empty() || name[0] != '/') ? "/" + name : name;
+			const int fd = shm_open(path.c_str(), O_RDWR, 0);
+			if (fd < 0)
+				return false;
+
+			struct stat st;
+			if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(pluto_shm_ring_header)) {
+				::close(fd);
+				return false;
+			}
+
+			void *base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			::close(fd);
+			if (base == MAP_FAILED)
+				return false;
+
+			header = (pluto_shm_ring_header *)base;
+			mapped = st.st_size;
+
+			if (header->magic != PLUTO_SHM_RING_MAGIC || header->version != PLUTO_SHM_RING_VERSION ||
+				header->data_offset + header->capacity > mapped || !claim_slot()) {
+				close();
+				return false;
+			}
+
+			data = (const uint8_t *)base + header->data_offset;
+			cursor = header->write_pos.load(std::memory_order_acquire);
+			slot->cursor = cursor;
+			return true;
+		}
+
+		void close()
+		{
+			if (slot)
+				slot->pid = 0;
+			if (header)
+				munmap((void *)header, mapped);
+			header = nullptr;
+			data = nullptr;
+			slot = nullptr;
+		}
+
+		const pluto_shm_ring_header *info() const { return header; }
+
+		bool writer_alive() const { return header && header->writer_alive.load(std::memory_order_acquire); }
+
+		// The next readable bytes, contiguous up to the end of the data area, 0
+		// when nothing new was published. overrun is set when the reader fell
+		// more than the capacity behind, it then resumes at the oldest safe data.
+		size_t peek(const uint8_t *&bytes, bool &overrun)
+		{
+			overrun = false;
+
+			const uint64_t pos = header->write_pos.load(std::memory_order_acquire);
+			const uint64_t reserve = header->write_reserve.load(std::memory_order_acquire);
+
+			if (reserve - cursor > header->capacity) {
+				// keep whole items when jumping ahead
+				cursor = reserve - header->capacity;
+				cursor += (header->item_bytes - cursor % header->item_bytes) % header->item_bytes;
+				slot->overruns++;
+				overrun = true;
+			}
+
+			const uint64_t offset = cursor % header->capacity;
+			bytes = data + offset;
+			return size_t(std::min<uint64_t>(pos - cursor, header->capacity - offset));
+		}
+
+		// Release the bytes returned by peek. Returns false if the publisher
+		// overwrote them while they were being used.
+		bool consume(const size_t count)
+		{
+			// the data reads above must not move past the check
+			std::atomic_thread_fence(std::memory_order_acquire);
+			const bool valid = header->write_reserve.load(std::memory_order_relaxed) - cursor <= header->capacity;
+			cursor += count;
+			slot->cursor.store(cursor, std::memory_order_release);
+			if (!valid)
+				slot->overruns++;
+			return valid;
+		}
+
+		// poll until new data is published or timeout_us elapsed
+		bool wait(const long timeout_us)
+		{
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us);
+			while (header->write_pos.load(std::memory_order_acquire) == cursor) {
+				if (!writer_alive() || std::chrono::steady_clock::now() >= deadline)
+					return false;
+				std::this_thread::sleep_for(std::chrono::microseconds(200));
+			}
+			return true;
+		}
+
+		// position of the next item to read, counted from the creation of the ring
+		uint64_t item_position() const { return cursor / header->item_bytes; }
+
+	private:
+		bool claim_slot()
+		{
+			const int32_t self = int32_t(getpid());
+
+			for (auto &s : header->readers) {
+				int32_t owner = s.pid.load();
+				// reclaim the slots of readers which exited without closing
+				if (owner != 0 && kill(owner, 0) != 0 && errno == ESRCH)
+					s.pid.compare_exchange_strong(owner, 0);
+
+				int32_t expected = 0;
+				if (s.pid.compare_exchange_strong(expected, self)) {
+					s.overruns = 0;
+					slot = &s;
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		pluto_shm_ring_header *header;
+		const uint8_t *data;
+		size_t mapped;
+		pluto_shm_reader_slot *slot;
+		uint64_t cursor;
+};
@@ -6,11 +6,200 @@
 #include <iterator>
 #include <algorithm>
 #include <chrono>
+#include <sstream>
+#include <cerrno>
+#include <SoapySDR/Time.hpp>
  #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 //TODO: Need to be a power of 2 for maximum efficiency ?
 # define DEFAULT_RX_BUFFER_SIZE (1 << 16)
 
 
+static bool is_tezuka_format(const plutosdrStreamFormat format)
+{
+	return format >= PLUTO_SDR_CF32_TEZUKA;
+}
+
+static pluto_rx_convert_fn select_rx_converter(const plutosdrStreamFormat format, const size_t nb_channels, const bool corrected)
+{
+	const bool cf32 = (format == PLUTO_SDR_CF32 || format == PLUTO_SDR_CF32_TEZUKA);
+	const bool cs16 = (format == PLUTO_SDR_CS16 || format == PLUTO_SDR_CS16_TEZUKA);
+	const bool cs12 = (format == PLUTO_SDR_CS12 || format == PLUTO_SDR_CS12_TEZUKA);
+
+	if (is_tezuka_format(format))
+		return pluto_select_rx_converter<int8_t, 1>(cf32, cs16, cs12, corrected);
+	if (nb_channels == 2)
+		return pluto_select_rx_converter<int16_t, 2>(cf32, cs16, cs12, corrected);
+	return pluto_select_rx_converter<int16_t, 1>(cf32, cs16, cs12, corrected);
+}
+
+// bytes of one complex sample of one channel in the stream format
+static size_t stream_item_bytes(const plutosdrStreamFormat format)
+{
+	switch (format) {
+	case PLUTO_SDR_CF32:
+	case PLUTO_SDR_CF32_TEZUKA:
+		return 8;
+	case PLUTO_SDR_CS16:
+	case PLUTO_SDR_CS16_TEZUKA:
+		return 4;
+	case PLUTO_SDR_CS12:
+	case PLUTO_SDR_CS12_TEZUKA:
+		return 3;
+	default:
+		return 2;
+	}
+}
+
+static pluto_rx_to_float_fn select_rx_to_float(const plutosdrStreamFormat format, const size_t nb_channels)
+{
+	if (is_tezuka_format(format))
+		return &pluto_rx_to_float<int8_t, 1>;
+	if (nb_channels == 2)
+		return &pluto_rx_to_float<int16_t, 2>;
+	return &pluto_rx_to_float<int16_t, 1>;
+}
+
+static pluto_rx_from_float_fn select_rx_from_float(const plutosdrStreamFormat format)
+{
+	const bool cf32 = (format == PLUTO_SDR_CF32 || format == PLUTO_SDR_CF32_TEZUKA);
+	const bool cs16 = (format == PLUTO_SDR_CS16 || format == PLUTO_SDR_CS16_TEZUKA);
+	const bool cs12 = (format == PLUTO_SDR_CS12 || format == PLUTO_SDR_CS12_TEZUKA);
+
+	if (is_tezuka_format(format))
+		return pluto_select_rx_from_float<int8_t>(cf32, cs16, cs12);
+	return pluto_select_rx_from_float<int16_t>(cf32, cs16, cs12);
+}
+
+static pluto_tx_to_float_fn select_tx_to_float(const plutosdrStreamFormat format)
+{
+	const bool cf32 = (format == PLUTO_SDR_CF32 || format == PLUTO_SDR_CF32_TEZUKA);
+	const bool cs16 = (format == PLUTO_SDR_CS16 || format == PLUTO_SDR_CS16_TEZUKA);
+	const bool cs12 = (format == PLUTO_SDR_CS12 || format == PLUTO_SDR_CS12_TEZUKA);
+
+	if (is_tezuka_format(format))
+		return pluto_select_tx_to_float<int8_t>(cf32, cs16, cs12);
+	return pluto_select_tx_to_float<int16_t>(cf32, cs16, cs12);
+}
+
+static pluto_tx_from_float_fn select_tx_from_float(const plutosdrStreamFormat format, const size_t nb_channels)
+{
+	if (is_tezuka_format(format))
+		return &pluto_tx_from_float<int8_t, 1>;
+	if (nb_channels == 2)
+		return &pluto_tx_from_float<int16_t, 2>;
+	return &pluto_tx_from_float<int16_t, 1>;
+}
+
+static pluto_tx_convert_fn select_tx_converter(const plutosdrStreamFormat format, const size_t nb_channels)
+{
+	const bool cf32 = (format == PLUTO_SDR_CF32 || format == PLUTO_SDR_CF32_TEZUKA);
+	const bool cs16 = (format == PLUTO_SDR_CS16 || format == PLUTO_SDR_CS16_TEZUKA);
+	const bool cs12 = (format == PLUTO_SDR_CS12 || format == PLUTO_SDR_CS12_TEZUKA);
+
+	if (is_tezuka_format(format))
+		return pluto_select_tx_converter<int8_t, 1>(cf32, cs16, cs12);
+	if (nb_channels == 2)
+		return pluto_select_tx_converter<int16_t, 2>(cf32, cs16, cs12);
+	return pluto_select_tx_converter<int16_t, 1>(cf32, cs16, cs12);
+}
+
+// ordered stage names from the comma separated "dsp" stream arg
+static std::vector<std::string> parse_dsp_stages(const SoapySDR::Kwargs &args)
+{
+	std::vector<std::string> names;
+
+	if (args.count("dsp") == 0)
+		return names;
+
+	std::istringstream list(args.at("dsp"));
+	std::string name;
+	while (std::getline(list, name, ',')) {
+		if (!name.empty())
+			names.push_back(name);
+	}
+
+	return names;
+}
+
+// "carriers=<n>" with carrier<k>_offset in Hz, carrier<k>_gain in dB and
+// carrier<k>_interp for each carrier
+static std::vector<pluto_carrier> parse_carriers(const SoapySDR::Kwargs &args)
+{
+	std::vector<pluto_carrier> carriers;
+
+	size_t count = 0;
+	if (args.count("carriers") != 0) {
+		try
+		{
+			count = std::stoul(args.at("carriers"));
+		}
+		catch (const std::invalid_argument &){}
+	}
+
+	for (size_t k = 0; k < count; k++) {
+		const std::string prefix = "carrier" + std::to_string(k) + "_";
+		pluto_carrier carrier{ 0.0, 0.0, 1 };
+
+		try
+		{
+			if (args.count(prefix + "offset") != 0)
+				carrier.offset = std::stod(args.at(prefix + "offset"));
+			if (args.count(prefix + "gain") != 0)
+				carrier.gain_db = std::stod(args.at(prefix + "gain"));
+			if (args.count(prefix + "interp") != 0)
+				carrier.interpolation = std::max<size_t>(std::stoul(args.at(prefix + "interp")), 1);
+		}
+		catch (const std::invalid_argument &){}
+
+		carriers.push_back(carrier);
+	}
+
+	return carriers;
+}
+
+// "<stage>_in=..,<stage>_out=..,<stage>_ns_per_item=.." for each stage, the time summed over the channels,
+// followed by the report() of the stages
+static std::string format_dsp_stats(const std::vector<pluto_dsp_chain> &chains)
+{
+	std::ostringstream stats;
+	stats.imbue(std::locale::classic());
+
+	if (chains.empty())
+		return stats.str();
+
+	const auto &first = chains[0].stats();
+	for (size_t k = 0; k < first.size(); k++) {
+		unsigned long long ns = 0;
+		for (const auto &chain : chains)
+			ns += chain.stats()[k].ns;
+
+		if (k > 0)
+			stats << ",";
+		stats << first[k].name << "_in=" << first[k].items_in;
+		stats << "," << first[k].name << "_out=" << first[k].items_out;
+		stats << "," << first[k].name << "_ns_per_item=" << (first[k].items_in ? double(ns) / first[k].items_in : 0.0);
+	}
+
+	for (size_t c = 0; c < chains.size(); c++) {
+		std::string report = chains[c].report();
+		if (report.empty())
+			continue;
+		// ch<n>_ prefixes on each key when there are several channels
+		if (chains.size() > 1) {
+			const std::string prefix = "ch" + std::to_string(c) + "_";
+			report.insert(0, prefix);
+			for (size_t pos = report.find(','); pos != std::string::npos; pos = report.find(',', pos + 1))
+				report.insert(pos + 1, prefix);
+		}
+		stats << "," << report;
+	}
+
+	return stats.str();
+}
+
 std::vector<std::string> SoapyPlutoSDR::getStreamFormats(const int direction, const size_t channel) const
 {
 	std::vector<std::string> formats;
@@ -20,6 +209,10 @@ std::vector<std::string> SoapyPlutoSDR::getStreamFormats(const int direction, co
 	formats.push_back(SOAPY_SDR_CS16);
 	formats.push_back(SOAPY_SDR_CF32);
 
+	// averaged power spectra in dBFS, see the spectrum stream args
+	if (direction == SOAPY_SDR_RX)
+		formats.push_back(SOAPY_SDR_F32);
+
 	return formats;
 }
 
@@ -39,6 +232,168 @@ SoapySDR::ArgInfoList SoapyPlutoSDR::getStreamArgsInfo(const int direction, cons
 {
 	SoapySDR::ArgInfoList streamArgs;
 
+	if (direction == SOAPY_SDR_RX) {
+		SoapySDR::ArgInfo warmArg;
+		warmArg.key = "warm_restart";
+		warmArg.value = "true";
+		warmArg.name = "Warm Restart";
+		warmArg.description = "Keep the buffers allocated while the stream is deactivated, activation only drops stale samples.";
+		warmArg.type = SoapySDR::ArgInfo::BOOL;
+		streamArgs.push_back(warmArg);
+
+		SoapySDR::ArgInfo exactArg;
+		exactArg.key = "exact_length";
+		exactArg.value = "false";
+		exactArg.name = "Exact Length";
+		exactArg.description = "Fill readStream with exactly numElems (up to the MTU), refilling across buffer boundaries.";
+		exactArg.type = SoapySDR::ArgInfo::BOOL;
+		streamArgs.push_back(exactArg);
+
+		SoapySDR::ArgInfo threadsArg;
+		threadsArg.key = "convert_threads";
+		threadsArg.value = "0";
+		threadsArg.name = "Conversion Threads";
+		threadsArg.description = "Extra worker threads converting large RX blocks in parallel, 0 converts on the calling thread only.";
+		threadsArg.type = SoapySDR::ArgInfo::INT;
+		streamArgs.push_back(threadsArg);
+
+		SoapySDR::ArgInfo cpusArg;
+		cpusArg.key = "convert_cpus";
+		cpusArg.value = "";
+		cpusArg.name = "Conversion CPUs";
+		cpusArg.description = "Comma separated CPU list the conversion workers are pinned to (Linux only).";
+		cpusArg.type = SoapySDR::ArgInfo::STRING;
+		streamArgs.push_back(cpusArg);
+
+		SoapySDR::ArgInfo minItemsArg;
+		minItemsArg.key = "convert_min_items";
+		minItemsArg.value = "16384";
+		minItemsArg.name = "Parallel Conversion Threshold";
+		minItemsArg.description = "Smallest block in items worth splitting across the conversion workers.";
+		minItemsArg.type = SoapySDR::ArgInfo::INT;
+		streamArgs.push_back(minItemsArg);
+
+		SoapySDR::ArgInfo fftSizeArg;
+		fftSizeArg.key = "fft_size";
+		fftSizeArg.value = "1024";
+		fftSizeArg.name = "Spectrum FFT Size";
+		fftSizeArg.description = "Bins per spectrum frame with the F32 format, a power of two.";
+		fftSizeArg.type = SoapySDR::ArgInfo::INT;
+		streamArgs.push_back(fftSizeArg);
+
+		SoapySDR::ArgInfo fftAverageArg;
+		fftAverageArg.key = "fft_average";
+		fftAverageArg.value = "16";
+		fftAverageArg.name = "Spectrum Averaging";
+		fftAverageArg.description = "FFTs averaged into each spectrum frame.";
+		fftAverageArg.type = SoapySDR::ArgInfo::INT;
+		streamArgs.push_back(fftAverageArg);
+
+		SoapySDR::ArgInfo fftOverlapArg;
+		fftOverlapArg.key = "fft_overlap";
+		fftOverlapArg.value = "0.5";
+		fftOverlapArg.name = "Spectrum Overlap";
+		fftOverlapArg.description = "Overlap between consecutive FFTs, as a fraction of fft_size.";
+		fftOverlapArg.type = SoapySDR::ArgInfo::FLOAT;
+		fftOverlapArg.range = SoapySDR::Range(0.0, 0.95);
+		streamArgs.push_back(fftOverlapArg);
+
+		SoapySDR::ArgInfo shareArg;
+		shareArg.key = "share_blocks";
+		shareArg.value = "4";
+		shareArg.name = "Shared Blocks";
+		shareArg.description = "RX streams set up while another is open share its buffer: blocks kept for the slowest reader "
+			"before it overflows. Set on the second stream, shared streams get the hardware rate without DSP stages.";
+		shareArg.type = SoapySDR::ArgInfo::INT;
+		streamArgs.push_back(shareArg);
+
+		SoapySDR::ArgInfo gateArg;
+		gateArg.key = "gate_threshold";
+		gateArg.value = "";
+		gateArg.name = "Energy Gate Threshold";
+		gateArg.description = "Only deliver the chunks of raw items whose mean power reaches this level, quiet blocks are "
+			"dropped before conversion. Each readStream then returns items of a single burst with SOAPY_SDR_HAS_TIME, "
+			"the time counting the samples since the stream was set up, and SOAPY_SDR_END_BURST where the gate closed.";
+		gateArg.units = "dBFS";
+		gateArg.type = SoapySDR::ArgInfo::FLOAT;
+		streamArgs.push_back(gateArg);
+
+		SoapySDR::ArgInfo gatePreArg;
+		gatePreArg.key = "gate_pre";
+		gatePreArg.value = "0";
+		gatePreArg.name = "Energy Gate Pre Margin";
+		gatePreArg.description = "Items delivered ahead of a chunk opening the gate, up to a refill block back.";
+		gatePreArg.type = SoapySDR::ArgInfo::INT;
+		streamArgs.push_back(gatePreArg);
+
+		SoapySDR::ArgInfo gatePostArg;
+		gatePostArg.key = "gate_post";
+		gatePostArg.value = "0";
+		gatePostArg.name = "Energy Gate Post Margin";
+		gatePostArg.description = "Items delivered after the last chunk above the threshold.";
+		gatePostArg.type = SoapySDR::ArgInfo::INT;
+		streamArgs.push_back(gatePostArg);
+
+		SoapySDR::ArgInfo gateChunkArg;
+		gateChunkArg.key = "gate_chunk";
+		gateChunkArg.value = "1024";
+		gateChunkArg.name = "Energy Gate Chunk";
+		gateChunkArg.description = "Items the power is averaged over, the resolution of the gate.";
+		gateChunkArg.type = SoapySDR::ArgInfo::INT;
+		streamArgs.push_back(gateChunkArg);
+	}
+
+	if (direction == SOAPY_SDR_TX) {
+		SoapySDR::ArgInfo cyclicArg;
+		cyclicArg.key = "cyclic";
+		cyclicArg.value = "false";
+		cyclicArg.name = "Cyclic Waveform";
+		cyclicArg.description = "Stage writes until END_BURST and repeat that waveform from a cyclic DMA buffer, "
+			"a new waveform replaces it on its END_BURST. Host DSP stages are bypassed.";
+		cyclicArg.type = SoapySDR::ArgInfo::BOOL;
+		streamArgs.push_back(cyclicArg);
+
+		SoapySDR::ArgInfo carriersArg;
+		carriersArg.key = "carriers";
+		carriersArg.value = "0";
+		carriersArg.name = "Carriers";
+		carriersArg.description = "Number of carriers summed into TX channel 0, the stream then takes one buffer per carrier. "
+			"Carrier k is set by carrier<k>_offset in Hz, carrier<k>_gain in dB and carrier<k>_interp, its rate being the "
+			"stream rate divided by carrier<k>_interp. numElems counts items at the stream rate, rounded down to a multiple "
+			"of every interpolation, buffer k holds numElems / carrier<k>_interp items.";
+		carriersArg.type = SoapySDR::ArgInfo::INT;
+		streamArgs.push_back(carriersArg);
+	}
+
+	SoapySDR::ArgInfo dspArg;
+	dspArg.key = "dsp";
+	dspArg.value = "";
+	dspArg.name = "DSP Stages";
+	dspArg.description = "Comma separated, ordered list of host DSP stages run on each channel: "
+		"dc_block (dc_block_alpha), fir (fir_cutoff in cycles per sample, fir_length), "
+		"cfr on TX (cfr_method clip_filter or peak_window, cfr_papr target in dB, cfr_evm limit in %, "
+		"cfr_iterations, cfr_cutoff, cfr_length), dpd on TX (dpd_coeffs, see the dpd_coeffs setting), "
+		"pa_model, a software PA to test dpd against (pa_memory).";
+	dspArg.type = SoapySDR::ArgInfo::STRING;
+	streamArgs.push_back(dspArg);
+
+	SoapySDR::ArgInfo cpuArg;
+	cpuArg.key = (direction == SOAPY_SDR_RX) ? "rx_cpu" : "tx_cpu";
+	cpuArg.value = "";
+	cpuArg.name = "Thread CPUs";
+	cpuArg.description = "Comma separated CPU list the driver threads of this stream are pinned to (Linux only).";
+	cpuArg.type = SoapySDR::ArgInfo::STRING;
+	streamArgs.push_back(cpuArg);
+
+	SoapySDR::ArgInfo priorityArg;
+	priorityArg.key = "rt_priority";
+	priorityArg.value = "0";
+	priorityArg.name = "Real-time Priority";
+	priorityArg.description = "SCHED_FIFO priority of the driver threads of this stream, 0 keeps the default scheduler.";
+	priorityArg.type = SoapySDR::ArgInfo::INT;
+	priorityArg.range = SoapySDR::Range(0, 99);
+	streamArgs.push_back(priorityArg);
+
 	return streamArgs;
 }
 
@@ -79,6 +434,87 @@ bool SoapyPlutoSDR::IsValidTxStreamHandle(SoapySDR::Stream* handle) const
     return false;
 }
 
+// called with rx_device_mutex held
+SoapySDR::Stream *SoapyPlutoSDR::share_rx_stream(const plutosdrStreamFormat format, const std::vector<size_t> &channels, const SoapySDR::Kwargs &args)
+{
+	const size_t nb_channels = channels.empty() ? 1 : channels.size();
+
+	if (nb_channels != rx_stream->get_num_channels())
+		throw std::runtime_error("setupStream: a shared RX stream must use the channels of the open RX stream");
+	if (!rx_stream->can_share())
+		throw std::runtime_error("setupStream: the open RX stream runs host DSP, gating or spectrum processing and can't be shared");
+
+	// a shared handle reads the blocks of the open stream as they are, only
+	// the ring depth and the device wide thread settings apply to it
+	for (const auto &arg : args) {
+		if (arg.first != "share_blocks" && arg.first != "rx_cpu" && arg.first != "rt_priority")
+			throw std::runtime_error("setupStream: the stream arg '" + arg.first + "' can't apply to an RX stream sharing the buffer of the open one");
+	}
+
+	if (!rx_broadcast) {
+		size_t depth = 4;
+		try
+		{
+			if (args.count("share_blocks") != 0)
+				depth = std::stoul(args.at("share_blocks"));
+		}
+		catch (const std::invalid_argument &){}
+
+		rx_broadcast = std::make_shared<pluto_rx_broadcast>(depth, nb_channels, [this](pluto_rx_broadcast &broadcast) -> ssize_t {
+			std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
+			if (!rx_stream || rx_broadcast.get() != &broadcast)
+				return -1;
+			return rx_stream->refill_shared(broadcast);
+		});
+
+		// from now on the first stream reads through the ring as well
+		std::shared_ptr<rx_consumer> primary = std::make_shared<rx_consumer>(rx_broadcast, rx_stream->get_format());
+		if (rx_stream->is_active())
+			primary->start();
+
+		std::lock_guard<std::mutex> consumers_lock(rx_consumers_mutex);
+		rx_consumers[reinterpret_cast<SoapySDR::Stream*>(rx_stream.get())] = primary;
+	}
+
+	std::shared_ptr<rx_consumer> consumer = std::make_shared<rx_consumer>(rx_broadcast, format);
+
+	std::lock_guard<std::mutex> consumers_lock(rx_consumers_mutex);
+	SoapySDR::Stream *handle = reinterpret_cast<SoapySDR::Stream*>(consumer.get());
+	rx_consumers[handle] = consumer;
+
+	SoapySDR_logf(SOAPY_SDR_INFO, "RX stream %lu shares the buffer of the open RX stream", (unsigned long)rx_consumers.size());
+
+	return handle;
+}
+
+std::shared_ptr<rx_consumer> SoapyPlutoSDR::find_rx_consumer(SoapySDR::Stream *handle) const
+{
+	std::lock_guard<std::mutex> lock(rx_consumers_mutex);
+
+	auto it = rx_consumers.find(handle);
+	if (it == rx_consumers.end())
+		return nullptr;
+	return it->second;
+}
+
+// follow the readers of the shared buffer after one was stopped or closed,
+// called with rx_device_mutex held
+void SoapyPlutoSDR::update_rx_sharing()
+{
+	if (!rx_broadcast)
+		return;
+
+	if (rx_broadcast->active_count() == 0 && rx_stream->is_active())
+		rx_stream->stop(0);
+
+	// only the first stream is left, it reads the iio_buffer directly again
+	std::lock_guard<std::mutex> consumers_lock(rx_consumers_mutex);
+	if (rx_consumers.size() == 1) {
+		rx_consumers.clear();
+		rx_broadcast.reset();
+	}
+}
+
 SoapySDR::Stream *SoapyPlutoSDR::setupStream(
 		const int direction,
 		const std::string &format,
@@ -88,9 +524,10 @@ SoapySDR::Stream *SoapyPlutoSDR::setupStream(
 	
 	//check the format
 	plutosdrStreamFormat streamFormat;
+	const bool spectrum = (direction == SOAPY_SDR_RX && format == SOAPY_SDR_F32);
 	if(!UseExtendedTezukaFeatures)
 	{
-		if (format == SOAPY_SDR_CF32) {
+		if (format == SOAPY_SDR_CF32 || spectrum) {
 			SoapySDR_log(SOAPY_SDR_INFO, "Using format CF32.");
 			streamFormat = PLUTO_SDR_CF32;
 		}
@@ -112,12 +549,12 @@ SoapySDR::Stream *SoapyPlutoSDR::setupStream(
 
 		else {
 			throw std::runtime_error(
-				"setupStream invalid format '" + format + "' -- Only CS8, CS12, CS16 and CF32 are supported by SoapyPlutoSDR module.");
+				"setupStream invalid format '" + format + "' -- Only CS8, CS12, CS16, CF32 and F32 (RX spectrum) are supported by SoapyPlutoSDR module.");
 		}
 	}
 	else
 	{
-		if (format == SOAPY_SDR_CF32) {
+		if (format == SOAPY_SDR_CF32 || spectrum) {
 			SoapySDR_log(SOAPY_SDR_INFO, "Using format CF32 Tezuka.");
 			streamFormat = PLUTO_SDR_CF32_TEZUKA;
 		}
@@ -137,26 +574,60 @@ SoapySDR::Stream *SoapyPlutoSDR::setupStream(
 		}
 	}
 
+	//device wide thread settings, unless overridden in the stream args
+	SoapySDR::Kwargs streamArgs = args;
+	const pluto_thread_policy &policy = (direction == SOAPY_SDR_RX) ? rx_thread_policy : tx_thread_policy;
+	const std::string cpu_key = (direction == SOAPY_SDR_RX) ? "rx_cpu" : "tx_cpu";
+	if (streamArgs.count(cpu_key) == 0 && !policy.cpus.empty())
+		streamArgs[cpu_key] = pluto_format_cpu_list(policy.cpus);
+	if (streamArgs.count("rt_priority") == 0 && policy.rt_priority > 0)
+		streamArgs["rt_priority"] = std::to_string(policy.rt_priority);
+	if (spectrum)
+		streamArgs["spectrum"] = "true";
+
 	if(direction == SOAPY_SDR_RX){
 
         std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
 
+        if (this->rx_stream) {
+            if (spectrum)
+                throw std::runtime_error("setupStream: the F32 spectrum format can't share the RX buffer of an open stream");
+            return share_rx_stream(streamFormat, channels, streamArgs);
+        }
+
 		iio_channel_attr_write_bool(
 			iio_device_find_channel(dev, "altvoltage0", true), "powerdown", false); // Turn ON RX LO
 
-        this->rx_stream = std::unique_ptr<rx_streamer>(new rx_streamer (rx_dev, streamFormat, channels, args));
+        if (rx_channelizer_bands > 1 && streamArgs.count("channelizer") == 0)
+            streamArgs["channelizer"] = std::to_string(rx_channelizer_bands);
+
+        this->rx_stream = std::unique_ptr<rx_streamer>(new rx_streamer (rx_dev, streamFormat, channels, streamArgs, this));
+        this->rx_stream->set_correction(rx_dc_offset_mode, rx_iq_balance_mode);
+        this->rx_stream->set_resampling(rx_hw_rate, rx_app_rate);
+        update_rx_ddc();
 
         return reinterpret_cast<SoapySDR::Stream*>(this->rx_stream.get());
 	}
 
 	else if (direction == SOAPY_SDR_TX) {
 
-        std::lock_guard<pluto_spin_mutex> lock(tx_device_mutex);
+        if (streamArgs.count("dpd_coeffs") == 0) {
+            std::lock_guard<std::mutex> dpd_lock(dpd_mutex);
+            if (!dpd_coeffs.empty())
+                streamArgs["dpd_coeffs"] = dpd_coeffs;
+        }
+
+        std::lock_guard<std::mutex> playback_lock(tx_playback_mutex);
+        std::unique_lock<pluto_spin_mutex> lock(tx_device_mutex);
+        stop_tx_playback(lock);
 
 		iio_channel_attr_write_bool(
 			iio_device_find_channel(dev, "altvoltage1", true), "powerdown", false); // Turn ON TX LO
 
-        this->tx_stream = std::unique_ptr<tx_streamer>(new tx_streamer (tx_dev, streamFormat, channels, args));
+        this->tx_stream = std::unique_ptr<tx_streamer>(new tx_streamer (tx_dev, streamFormat, channels, streamArgs, this));
+        this->tx_stream->set_resampling(tx_hw_rate, tx_app_rate);
+        tx_meter->reset();
+        this->tx_stream->set_meter(tx_meter);
 
         return reinterpret_cast<SoapySDR::Stream*>(this->tx_stream.get());
 	}
@@ -165,13 +636,55 @@ SoapySDR::Stream *SoapyPlutoSDR::setupStream(
 
 }
 
+// the worker may sit in a push for a whole block, spinning writers must not wait on it
+void SoapyPlutoSDR::stop_tx_playback(std::unique_lock<pluto_spin_mutex> &lock)
+{
+	if (!tx_stream)
+		return;
+
+	std::thread worker = tx_stream->cancel_playback();
+	if (!worker.joinable())
+		return;
+
+	lock.unlock();
+	worker.join();
+	lock.lock();
+
+	tx_stream->end_playback();
+}
+
 void SoapyPlutoSDR::closeStream( SoapySDR::Stream *handle)
 {
+    if (IsValidRxStreamHandle(handle)) {
+        stop_recording();
+        stop_publishing();
+        stop_snapshots();
+    }
+
     //scope lock:
     {
         std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
 
+        std::shared_ptr<rx_consumer> consumer = find_rx_consumer(handle);
+        if (consumer && !IsValidRxStreamHandle(handle)) {
+            consumer->stop();
+            {
+                std::lock_guard<std::mutex> consumers_lock(rx_consumers_mutex);
+                rx_consumers.erase(handle);
+            }
+            update_rx_sharing();
+            return;
+        }
+
         if (IsValidRxStreamHandle(handle)) {
+            // the other handles lose the buffer they were sharing
+            if (rx_broadcast) {
+                rx_broadcast->detach();
+                rx_broadcast.reset();
+                std::lock_guard<std::mutex> consumers_lock(rx_consumers_mutex);
+                rx_consumers.clear();
+            }
+
             this->rx_stream.reset();
 
 			iio_channel_attr_write_bool(
@@ -181,9 +694,11 @@ void SoapyPlutoSDR::closeStream( SoapySDR::Stream *handle)
 
     //scope lock :
     {
-        std::lock_guard<pluto_spin_mutex> lock(tx_device_mutex);
+        std::lock_guard<std::mutex> playback_lock(tx_playback_mutex);
+        std::unique_lock<pluto_spin_mutex> lock(tx_device_mutex);
 
         if (IsValidTxStreamHandle(handle)) {
+            stop_tx_playback(lock);
             this->tx_stream.reset();
 
 			iio_channel_attr_write_bool(
@@ -196,13 +711,15 @@ size_t SoapyPlutoSDR::getStreamMTU( SoapySDR::Stream *handle) const
 {
     std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
 
-    if (IsValidRxStreamHandle(handle)) {
+    if (IsValidRxStreamHandle(handle) || (rx_stream && find_rx_consumer(handle))) {
 
         return this->rx_stream->get_mtu_size();
     }
 
 	if (IsValidTxStreamHandle(handle)) {
-		return 4096;
+		// multi-carrier writes are taken in whole frames
+		const size_t frame = tx_stream->get_carrier_frame();
+		return (4096 + frame - 1) / frame * frame;
 	}
 
     return 0;
@@ -219,6 +736,15 @@ int SoapyPlutoSDR::activateStream(
 
     std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
 
+    std::shared_ptr<rx_consumer> consumer = find_rx_consumer(handle);
+    if (consumer) {
+        // the shared buffer runs while any of its readers is active
+        if (!rx_stream->is_active())
+            rx_stream->start(flags, timeNs, numElems);
+        consumer->start();
+        return 0;
+    }
+
     if (IsValidRxStreamHandle(handle)) {
         return this->rx_stream->start(flags, timeNs, numElems);
     }
@@ -238,6 +764,13 @@ int SoapyPlutoSDR::deactivateStream(
     {
         std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
 
+        std::shared_ptr<rx_consumer> consumer = find_rx_consumer(handle);
+        if (consumer) {
+            consumer->stop();
+            update_rx_sharing();
+            return 0;
+        }
+
         if (IsValidRxStreamHandle(handle)) {
             return this->rx_stream->stop(flags, timeNs);
         }
@@ -245,10 +778,12 @@ int SoapyPlutoSDR::deactivateStream(
 
     //scope lock :
     {
-        std::lock_guard<pluto_spin_mutex> lock(tx_device_mutex);
+        std::lock_guard<std::mutex> playback_lock(tx_playback_mutex);
+        std::unique_lock<pluto_spin_mutex> lock(tx_device_mutex);
 
         if (IsValidTxStreamHandle(handle)) {
-            this->tx_stream->flush();
+            stop_tx_playback(lock);
+            this->tx_stream->stop();
             return 0;
         }
     }
@@ -264,6 +799,12 @@ int SoapyPlutoSDR::readStream(
 		long long &timeNs,
 		const long timeoutUs )
 {
+    // shared handles wait for their blocks without holding the device lock
+    std::shared_ptr<rx_consumer> consumer = find_rx_consumer(handle);
+    if (consumer) {
+        return consumer->recv(buffs, numElems, flags, timeNs, timeoutUs);
+    }
+
     //the spin_mutex is especially very useful here for minimum overhead !
     std::lock_guard<pluto_spin_mutex> lock(rx_device_mutex);
 
@@ -351,8 +892,13 @@ void rx_streamer::set_mtu_size(const size_t mtu_size) {
 }
 
 
-rx_streamer::rx_streamer(const iio_device *_dev, const plutosdrStreamFormat _format, const std::vector<size_t> &channels, const SoapySDR::Kwargs &args):
-	dev(_dev), buffer_size(DEFAULT_RX_BUFFER_SIZE), buf(nullptr), format(_format), mtu_size(DEFAULT_RX_BUFFER_SIZE)
+rx_streamer::rx_streamer(const iio_device *_dev, const plutosdrStreamFormat _format, const std::vector<size_t> &channels, const SoapySDR::Kwargs &args,
+	const SoapyPlutoSDR *device):
+	dev(_dev), buffer_size(DEFAULT_RX_BUFFER_SIZE), buf(nullptr), format(_format), convert_fn(nullptr), mtu_size(DEFAULT_RX_BUFFER_SIZE),
+	kernel_buffer_count(8), active(false), warm_restart(true), activation_us(0), exact_length(false),
+	parallel_min_items(16384), correcting(false),
+	to_float_fn(nullptr), from_float_fn(nullptr), dsp_out_pos(0),
+	spectrum(false), spectrum_quit(false), spectrum_frame_pos(0), spectrum_dropped(false), refilled_items(0)
 
 {
 	if (dev == nullptr) {
@@ -363,8 +909,32 @@ rx_streamer::rx_streamer(const iio_device *_dev, const plutosdrStreamFormat _for
 	for (i = 0; i < nb_channels; i++)
 		iio_channel_disable(iio_device_get_channel(dev, i));
 
-	//default to channel 0, if none were specified
-	const std::vector<size_t> &channelIDs = channels.empty() ? std::vector<size_t>{0} : channels;
+	if (args.count("channelizer") != 0) {
+		try
+		{
+			channelizer_bands = std::stoul(args.at("channelizer"));
+		}
+		catch (const std::invalid_argument &){}
+	}
+
+	if (channelizer_bands > 1) {
+		if ((channelizer_bands & (channelizer_bands - 1)) != 0 || channelizer_bands > 1024)
+			throw std::runtime_error("The channelizer needs a power of two number of sub-bands, up to 1024");
+		if (args.count("spectrum") != 0 && args.at("spectrum") == "true")
+			throw std::runtime_error("The F32 spectrum format doesn't support the channelizer");
+
+		channelizer_selected = channels.empty() ? std::vector<size_t>{0} : channels;
+		for (const auto c : channelizer_selected) {
+			if (c >= channelizer_bands)
+				throw std::runtime_error("setupStream: channel " + std::to_string(c) + " is beyond the channelizer sub-bands");
+		}
+	}
+
+	//default to channel 0, if none were specified, the sub-bands all come from channel 0
+	const std::vector<size_t> &channelIDs = (channels.empty() || channelizer_bands > 1) ? std::vector<size_t>{0} : channels;
+
+	if (is_tezuka_format(format) && channelIDs.size() > 1)
+		throw std::runtime_error("Tezuka CS8 transport only supports a single channel");
 
 	for (i = 0; i < channelIDs.size() * 2; i++) {
 		struct iio_channel *chn = iio_device_get_channel(dev, i);
@@ -372,13 +942,100 @@ rx_streamer::rx_streamer(const iio_device *_dev, const plutosdrStreamFormat _for
 		channel_list.push_back(chn);
 		if((i==1) && (format >= PLUTO_SDR_CF32_TEZUKA))
 		{
-			fprintf(stderr,"Tezuka CS8 input\n");
+			SoapySDR_log(SOAPY_SDR_DEBUG, "Tezuka CS8 input");
 			iio_channel_disable(chn);
 		}	
 
 	}
 
-	
+	correctors.resize(channelIDs.size());
+	coeffs.resize(channelIDs.size());
+	set_correction(false, false);
+
+	thread_policy = pluto_thread_policy::from_args(args, "rx_cpu");
+	thread_policy.device = device;
+
+	if (args.count("warm_restart") != 0)
+		warm_restart = (args.at("warm_restart") != "false");
+
+	if (args.count("exact_length") != 0)
+		exact_length = (args.at("exact_length") == "true");
+
+	if (args.count("convert_threads") != 0) {
+
+		try
+		{
+			const int nb_workers = std::stoi(args.at("convert_threads"));
+			std::vector<int> cpus;
+
+			if (args.count("convert_cpus") != 0)
+				cpus = pluto_parse_cpu_list(args.at("convert_cpus"));
+
+			if (args.count("convert_min_items") != 0)
+				parallel_min_items = std::stoul(args.at("convert_min_items"));
+
+			if (nb_workers > 0) {
+				convert_pool.reset(new pluto_worker_pool(nb_workers, "pluto-rx-cvt", thread_policy, cpus));
+				SoapySDR_logf(SOAPY_SDR_INFO, "Converting RX blocks of %lu+ items on %d threads",
+					(unsigned long)parallel_min_items, nb_workers + 1);
+			}
+		}
+		catch (const std::invalid_argument &){}
+	}
+
+	dsp_stage_names = parse_dsp_stages(args);
+	dsp_args = args;
+	set_resampling(0.0, 0.0);
+
+	if (args.count("gate_threshold") != 0) {
+		try
+		{
+			const double threshold = std::stod(args.at("gate_threshold"));
+			size_t pre = 0, post = 0, chunk = 1024;
+			if (args.count("gate_pre") != 0)
+				pre = std::stoul(args.at("gate_pre"));
+			if (args.count("gate_post") != 0)
+				post = std::stoul(args.at("gate_post"));
+			if (args.count("gate_chunk") != 0)
+				chunk = std::stoul(args.at("gate_chunk"));
+
+			// the raw items are interleaved int16 I/Q of 12 bit samples, int8 with Tezuka
+			const bool tezuka = is_tezuka_format(format);
+			const size_t item_bytes = tezuka ? 2 : 2 * sizeof(int16_t) * (channel_list.size() / 2);
+			gate.reset(new pluto_energy_gate(threshold, pre, post, chunk, tezuka ? 128.0f : 2048.0f, item_bytes, tezuka));
+			SoapySDR_logf(SOAPY_SDR_INFO, "RX energy gate at %.1f dBFS over %lu items", threshold, (unsigned long)chunk);
+		}
+		catch (const std::invalid_argument &){}
+	}
+
+	if (args.count("spectrum") != 0 && args.at("spectrum") == "true") {
+		size_t fft_size = 1024, fft_average = 16;
+		double fft_overlap = 0.5;
+
+		try
+		{
+			if (args.count("fft_size") != 0)
+				fft_size = std::stoul(args.at("fft_size"));
+			if (args.count("fft_average") != 0)
+				fft_average = std::stoul(args.at("fft_average"));
+			if (args.count("fft_overlap") != 0)
+				fft_overlap = std::stod(args.at("fft_overlap"));
+		}
+		catch (const std::invalid_argument &){}
+
+		if (fft_size < 16 || fft_size > (1 << 20) || (fft_size & (fft_size - 1)) != 0)
+			throw std::runtime_error("fft_size must be a power of two between 16 and 2^20");
+
+		for (size_t c = 0; c < channelIDs.size(); c++)
+			spectra.push_back(std::unique_ptr<pluto_spectrum>(new pluto_spectrum(fft_size, fft_average, fft_overlap,
+				is_tezuka_format(format) ? 128.0f : 2048.0f)));
+
+		to_float_fn = select_rx_to_float(format, channelIDs.size());
+		spectrum = true;
+
+		SoapySDR_logf(SOAPY_SDR_INFO, "RX spectrum mode: %lu bins, %lu averages, %.0f%% overlap",
+			(unsigned long)fft_size, (unsigned long)fft_average, fft_overlap * 100.0);
+	}
 
 	if ( args.count( "bufflen" ) != 0 ){
 
@@ -403,10 +1060,8 @@ rx_streamer::rx_streamer(const iio_device *_dev, const plutosdrStreamFormat _for
 
 rx_streamer::~rx_streamer()
 {
-	if (buf) {
-        iio_buffer_cancel(buf);
-        iio_buffer_destroy(buf);
-    }
+	stop_spectrum();
+	destroy_buffer();
 
     for (unsigned int i = 0; i < channel_list.size(); ++i) {
         iio_channel_disable(channel_list[i]);
@@ -422,222 +1077,521 @@ size_t rx_streamer::recv(void * const *buffs,
 		long long &timeNs,
 		const long timeoutUs)
 {
-    //
-	if (items_in_buffer <= 0) {
+	if (spectrum)
+		return recv_spectrum(buffs, numElems, flags, timeoutUs);
 
-       // auto before = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+	if (gate)
+		return recv_gated(buffs, numElems, flags, timeNs, timeoutUs);
 
-	    if (!buf) {
-		    return 0;
-	    }
+	// in exact length mode the request is filled across refills, up to the MTU
+	const size_t request = exact_length ? std::min(numElems, mtu_size) : numElems;
+	size_t produced = 0;
 
-		ssize_t ret = iio_buffer_refill(buf);
+	// the host DSP path may need more than one block before producing anything
+	while (produced < request && (exact_length || produced == 0)) {
 
-        // auto after = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+		if (dsp_pending() == 0 && items_in_buffer <= 0) {
 
-		if (ret < 0)
-			return SOAPY_SDR_TIMEOUT;
+		    if (!buf || !active) {
+			    return produced;
+		    }
 
-		items_in_buffer = (unsigned long)ret / iio_buffer_step(buf);
+			PLUTO_TRACE_BEGIN("rx_refill");
+			ssize_t ret = iio_buffer_refill(buf);
+			PLUTO_TRACE_END("rx_refill", ret);
 
-        // SoapySDR_logf(SOAPY_SDR_INFO, "iio_buffer_refill took %d ms to refill %d items", (int)(after - before), items_in_buffer);
+			if (ret < 0)
+				return produced ? produced : SOAPY_SDR_TIMEOUT;
 
-		byte_offset = 0;
-	}
+			notify_taps(ret);
 
-	size_t items = std::min(items_in_buffer,numElems);
+			items_in_buffer = (unsigned long)ret / iio_buffer_step(buf);
 
-	ptrdiff_t buf_step = iio_buffer_step(buf);
+			byte_offset = 0;
+		}
 
-	if (direct_copy) {
-		// optimize for single RX, 2 channel (I/Q), same endianess direct copy
-		// note that RX is 12 bits LSB aligned, i.e. fullscale 2048
-		uint8_t *src = (uint8_t *)iio_buffer_start(buf) + byte_offset;
-		int16_t const *src_ptr = (int16_t *)src;
-		
-		if (format == PLUTO_SDR_CS16) {
+		size_t items;
 
-			::memcpy(buffs[0], src_ptr, 2 * sizeof(int16_t) * items);
+		if (!dsp_chains.empty()) {
+			if (dsp_pending() == 0)
+				process_dsp_block();
 
+			items = std::min(dsp_pending(), request - produced);
+			for (size_t c = 0; c < dsp_out.size(); c++)
+				from_float_fn(dsp_out[c].data() + 2 * dsp_out_pos, buffs[c], produced, items);
+			dsp_out_pos += items;
 		}
-		else if (format == PLUTO_SDR_CF32) {
+		else {
+			items = std::min(items_in_buffer, request - produced);
 
-			float *dst_cf32 = (float *)buffs[0];
-			
-			for (size_t index = 0; index < items * 2; ++index) {
-				*dst_cf32 = float(*src_ptr) / 2048.0f;
-				src_ptr++;
-				dst_cf32++;
-			}
+			convert_items(buffs, produced, items);
 
+			items_in_buffer -= items;
+			byte_offset += items * iio_buffer_step(buf);
 		}
-		else if (format == PLUTO_SDR_CS12) {
-
-			int8_t *dst_cs12 = (int8_t *)buffs[0];
 
-			for (size_t index = 0; index < items; ++index) {
-				int16_t i = *src_ptr++;
-				int16_t q = *src_ptr++;
-				// produce 24 bit (iiqIQQ), note the input is LSB aligned, scale=2048
-				// note: byte0 = i[7:0]; byte1 = {q[3:0], i[11:8]}; byte2 = q[11:4];
-				*dst_cs12++ = uint8_t(i);
-				*dst_cs12++ = uint8_t((q << 4) | ((i >> 8) & 0x0f));
-				*dst_cs12++ = uint8_t(q >> 4);
-			}
-		}
-		else if (format == PLUTO_SDR_CS8) {
+		produced += items;
+	}
 
-			int8_t *dst_cs8 = (int8_t *)buffs[0];
-			
-				for (size_t index = 0; index < items * 2; index++) {
-					*dst_cs8 = int8_t(*src_ptr >> 4);
-					src_ptr++;
-					dst_cs8++;
-				}
-		}
-		else if (format == PLUTO_SDR_CS16_TEZUKA) {
+	return(produced);
 
-			//::memcpy(buffs[0], src_ptr, 2 * sizeof(int16_t) * items);
-			int16_t *dst_cs16 = (int16_t *)buffs[0];
-			int8_t const *src_ptr_i8 = (int8_t *)src;	
-			for (size_t index = 0; index < items * 2; ++index) {
-				//*dst_cf32 = float(*src_ptr) / 2048.0f;
-				*dst_cs16 = int16_t(*(src_ptr_i8)) << 8 ;
+}
 
-				src_ptr_i8++;
-				dst_cs16++;
+// hand out the bursts the gate keeps, refilling until one shows up or the
+// timeout expires; a call never spans two bursts
+size_t rx_streamer::recv_gated(void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs)
+{
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+
+	while (true) {
+		if (dsp_pending() > 0) {
+			const size_t items = std::min(dsp_pending(), numElems);
+			for (size_t c = 0; c < dsp_out.size(); c++)
+				from_float_fn(dsp_out[c].data() + 2 * dsp_out_pos, buffs[c], 0, items);
+			dsp_out_pos += items;
+
+			// after the DSP stages only the start of a burst has a known time
+			if (gate_time_valid) {
+				timeNs = gate_time_ns;
+				flags |= SOAPY_SDR_HAS_TIME;
+				gate_time_valid = false;
 			}
-
+			if (gate_end && dsp_pending() == 0)
+				flags |= SOAPY_SDR_END_BURST;
+			return items;
 		}
-		else if (format == PLUTO_SDR_CF32_TEZUKA) {
 
-			float *dst_cf32 = (float *)buffs[0];
-			int8_t const *src_ptr_i8 = (int8_t *)src;	
-			for (size_t index = 0; index < items * 2; ++index) {
-				//*dst_cf32 = float(*src_ptr) / 2048.0f;
-				*dst_cf32 = float(*(src_ptr_i8)) / 128.0f;
+		if (items_in_buffer > 0) {
+			const pluto_energy_gate::burst &current = gate->bursts()[gate_burst - 1];
+			const unsigned long long first_item = current.first_item + (current.items - items_in_buffer);
 
-				src_ptr_i8++;
-				dst_cf32++;
+			if (!dsp_chains.empty()) {
+				gate_time_ns = SoapySDR::ticksToTimeNs(first_item, time_rate);
+				gate_time_valid = true;
+				gate_end = current.closed;
+				process_dsp_block();
+				continue;
 			}
 
-		}
-		else if (format == PLUTO_SDR_CS12_TEZUKA) {
+			const size_t items = std::min(items_in_buffer, numElems);
+			convert_items(buffs, 0, items);
+			items_in_buffer -= items;
+			byte_offset += items * iio_buffer_step(buf);
 
-			int8_t *dst_cs12 = (int8_t *)buffs[0];
+			timeNs = SoapySDR::ticksToTimeNs(first_item, time_rate);
+			flags |= SOAPY_SDR_HAS_TIME;
+			if (items_in_buffer == 0 && current.closed)
+				flags |= SOAPY_SDR_END_BURST;
+			return items;
+		}
 
-			for (size_t index = 0; index < items; ++index) {
-				int16_t i = *src_ptr++;
-				int16_t q = *src_ptr++;
-				// produce 24 bit (iiqIQQ), note the input is LSB aligned, scale=2048
-				// note: byte0 = i[7:0]; byte1 = {q[3:0], i[11:8]}; byte2 = q[11:4];
-				*dst_cs12++ = uint8_t(i);
-				*dst_cs12++ = uint8_t((q << 4) | ((i >> 8) & 0x0f));
-				*dst_cs12++ = uint8_t(q >> 4);
-			}
+		if (gate_burst < gate->bursts().size()) {
+			const pluto_energy_gate::burst &next = gate->bursts()[gate_burst++];
+			byte_offset = next.offset;
+			items_in_buffer = next.items;
+			continue;
 		}
-		else if (format == PLUTO_SDR_CS8_TEZUKA) 
-		{
-			{
-				
-				::memcpy(buffs[0], src_ptr, 2* sizeof(int8_t) * items);
-			}
-		}	
-	}
-	else {
-		int16_t conv = 0, *conv_ptr = &conv;
 
-		for (unsigned int i = 0; i < channel_list.size(); i++) {
-			iio_channel *chn = channel_list[i];
-			unsigned int index = i / 2;
+		if (!buf || !active)
+			return 0;
+		if (std::chrono::steady_clock::now() >= deadline)
+			return SOAPY_SDR_TIMEOUT;
 
-			uint8_t *src = (uint8_t *)iio_buffer_first(buf, chn) + byte_offset;
+		PLUTO_TRACE_BEGIN("rx_refill");
+		ssize_t ret = iio_buffer_refill(buf);
+		PLUTO_TRACE_END("rx_refill", ret);
+		if (ret < 0)
+			return SOAPY_SDR_TIMEOUT;
 
-			if (format == PLUTO_SDR_CS16) {
+		notify_taps(ret);
 
-				int16_t *dst_cs16 = (int16_t *)buffs[index];
+		const size_t items = (size_t)ret / iio_buffer_step(buf);
+		PLUTO_TRACE_SCOPE("rx_gate", items);
+		gate->process((const uint8_t *)iio_buffer_start(buf), items, refilled_items - items);
+		gate_burst = 0;
+	}
+}
 
-				for (size_t j = 0; j < items; ++j) {
-					iio_channel_convert(chn, conv_ptr, src);
-					src += buf_step;
-					dst_cs16[j * 2 + i] = conv;
-				}
-			}
-			else if (format == PLUTO_SDR_CF32) {
+const uint8_t *rx_streamer::block_data() const
+{
+	return (gate ? gate->staging() : (const uint8_t *)iio_buffer_start(buf)) + byte_offset;
+}
 
-				float *dst_cf32 = (float *)buffs[index];
+// hand out the queued spectrum frames, a frame larger than numElems
+// is split over several calls flagged with SOAPY_SDR_MORE_FRAGMENTS
+size_t rx_streamer::recv_spectrum(void * const *buffs, const size_t numElems, int &flags, const long timeoutUs)
+{
+	if (!active)
+		return 0;
 
-				for (size_t j = 0; j < items; ++j) {
-					iio_channel_convert(chn, conv_ptr, src);
-					src += buf_step;
-					dst_cf32[j * 2 + i] = float(conv) / 2048.0f;
-				}
-			}
-			else if (format == PLUTO_SDR_CS8) {
-
-				int8_t *dst_cs8 = (int8_t *)buffs[index];
-		 
-					for (size_t j = 0; j < items; ++j) {
-						iio_channel_convert(chn, conv_ptr, src);
-						src += buf_step;
-						dst_cs8[j * 2 + i] = int8_t(conv >> 4);
-					}
-			}
-			else if (format == PLUTO_SDR_CS8_TEZUKA )
-			{
-					int8_t *dst_cs8 = (int8_t *)buffs[index];
-		 
-					for (size_t j = 0; j < items; ++j) {
-						iio_channel_convert(chn, conv_ptr, src);
-						src += buf_step;
-						dst_cs8[j + i] = int8_t(conv);
-					}
-			}
+	std::unique_lock<std::mutex> lock(spectrum_mutex);
 
-		}
+	if (spectrum_dropped) {
+		spectrum_dropped = false;
+		return SOAPY_SDR_OVERFLOW;
 	}
 
-	items_in_buffer -= items;
-	byte_offset += items * iio_buffer_step(buf);
+	if (!spectrum_cond.wait_for(lock, std::chrono::microseconds(timeoutUs), [this]{ return !spectrum_frames.empty(); }))
+		return SOAPY_SDR_TIMEOUT;
+
+	const std::vector<std::vector<float>> &frame = spectrum_frames.front();
+	const size_t items = std::min(numElems, frame[0].size() - spectrum_frame_pos);
+
+	for (size_t c = 0; c < frame.size(); c++)
+		std::memcpy(buffs[c], frame[c].data() + spectrum_frame_pos, items * sizeof(float));
 
-	return(items);
+	spectrum_frame_pos += items;
+	if (spectrum_frame_pos == frame[0].size()) {
+		spectrum_frames.pop_front();
+		spectrum_frame_pos = 0;
+	}
+	else {
+		flags |= SOAPY_SDR_MORE_FRAGMENTS;
+	}
 
+	return items;
 }
 
-int rx_streamer::start(const int flags,
-		const long long timeNs,
-		const size_t numElems)
+// refill and FFT loop of the spectrum mode, runs between start() and stop()
+void rx_streamer::spectrum_worker()
 {
-    //force proper stop before
-    stop(flags, timeNs);
+	// frames kept for a reader falling behind, older ones are dropped
+	const size_t queue_depth = 16;
 
-    // re-create buffer
-	buf = iio_device_create_buffer(dev, buffer_size, false);
+	pluto_thread_setup("pluto-rx-fft", thread_policy);
 
-	if (!buf) {
-		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to create buffer!");
-		throw std::runtime_error("Unable to create buffer!\n");
-	}
+	const ptrdiff_t buf_step = iio_buffer_step(buf);
+	const size_t fft_size = spectra[0]->size();
+	std::vector<std::vector<float>> frames(spectra.size());
+	std::vector<float> filtered;
 
-	direct_copy = has_direct_copy();
+	while (true) {
+		PLUTO_TRACE_BEGIN("rx_refill");
+		ssize_t ret = iio_buffer_refill(buf);
+		PLUTO_TRACE_END("rx_refill", ret);
 
-	SoapySDR_logf(SOAPY_SDR_INFO, "Has direct RX copy: %d", (int)direct_copy);
+		if (ret >= 0)
+			notify_taps(ret);
 
-	return 0;
+		std::unique_lock<std::mutex> lock(spectrum_mutex);
 
-}
+		if (spectrum_quit)
+			break;
+		if (ret < 0) {
+			// a persistent refill error would otherwise spin a core
+			if (ret != -ETIMEDOUT)
+				spectrum_cond.wait_for(lock, std::chrono::milliseconds(10), [this]{ return spectrum_quit; });
+			continue;
+		}
 
-int rx_streamer::stop(const int flags,
-		const long long timeNs)
-{
-    //cancel first
-    if (buf) {
-        iio_buffer_cancel(buf);
-    }
-    //then destroy
-	if (buf) {
-		iio_buffer_destroy(buf);
-		buf = nullptr;
+		const uint8_t *src = (uint8_t *)iio_buffer_start(buf);
+		const size_t items = (size_t)ret / buf_step;
+
+		if (correcting) {
+			update_correction(src, items);
+		}
+
+		dsp_scratch.resize(2 * pluto_dsp_block_items);
+
+		for (size_t done = 0; done < items; done += pluto_dsp_block_items) {
+			const size_t count = std::min(pluto_dsp_block_items, items - done);
+
+			for (size_t c = 0; c < spectra.size(); c++) {
+				to_float_fn(src + done * buf_step, c, dsp_scratch.data(), count, coeffs[c]);
+
+				if (dsp_chains.empty()) {
+					spectra[c]->process(dsp_scratch.data(), count, frames[c]);
+				}
+				else {
+					filtered.clear();
+					dsp_chains[c].process(dsp_scratch.data(), count, filtered);
+					spectra[c]->process(filtered.data(), filtered.size() / 2, frames[c]);
+				}
+			}
+		}
+
+		// all channels complete their frames on the same block
+		for (size_t f = 0; f < frames[0].size() / fft_size; f++) {
+			std::vector<std::vector<float>> frame(frames.size());
+			for (size_t c = 0; c < frames.size(); c++)
+				frame[c].assign(frames[c].begin() + f * fft_size, frames[c].begin() + (f + 1) * fft_size);
+			spectrum_frames.push_back(std::move(frame));
+
+			if (spectrum_frames.size() > queue_depth) {
+				PLUTO_TRACE_INSTANT("rx_spectrum_overflow", spectrum_frames.size());
+				spectrum_frames.pop_front();
+				spectrum_frame_pos = 0;
+				spectrum_dropped = true;
+			}
+		}
+
+		for (auto &channel_frames : frames)
+			channel_frames.clear();
+
+		spectrum_cond.notify_all();
+	}
+
+	pluto_thread_release("pluto-rx-fft", thread_policy);
+}
+
+void rx_streamer::start_spectrum()
+{
+	for (auto &channel_spectrum : spectra)
+		channel_spectrum->reset();
+	spectrum_frames.clear();
+	spectrum_frame_pos = 0;
+	spectrum_dropped = false;
+	spectrum_quit = false;
+	spectrum_thread = std::thread(&rx_streamer::spectrum_worker, this);
+}
+
+// a cancelled iio_buffer can't be refilled again, so it is released as well
+void rx_streamer::stop_spectrum()
+{
+	if (!spectrum_thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(spectrum_mutex);
+		spectrum_quit = true;
+	}
+	spectrum_cond.notify_all();
+
+	iio_buffer_cancel(buf);
+	spectrum_thread.join();
+	destroy_buffer();
+}
+
+void rx_streamer::add_tap(const std::shared_ptr<pluto_rx_tap> &tap)
+{
+	std::lock_guard<std::mutex> lock(tap_mutex);
+	taps.push_back(tap);
+}
+
+void rx_streamer::remove_tap(const pluto_rx_tap *tap)
+{
+	std::lock_guard<std::mutex> lock(tap_mutex);
+	taps.erase(std::remove_if(taps.begin(), taps.end(),
+		[tap](const std::shared_ptr<pluto_rx_tap> &t) { return t.get() == tap; }), taps.end());
+}
+
+// hand the block just refilled to the taps, before any conversion
+void rx_streamer::notify_taps(const size_t bytes)
+{
+	const size_t items = bytes / iio_buffer_step(buf);
+
+	std::lock_guard<std::mutex> lock(tap_mutex);
+	for (const auto &tap : taps)
+		tap->on_block((const uint8_t *)iio_buffer_start(buf), bytes, items, refilled_items);
+	refilled_items += items;
+}
+
+pluto_raw_info rx_streamer::get_raw_info() const
+{
+	pluto_raw_info info;
+	info.datatype = is_tezuka_format(format) ? "ci8" : "ci16_le";
+	info.num_channels = channel_list.size() / 2;
+	return info;
+}
+
+// convert items from the current iio_buffer position into buffs, starting at element offset
+void rx_streamer::convert_items(void * const *buffs, const size_t offset, const size_t items)
+{
+	PLUTO_TRACE_SCOPE("rx_convert", items);
+
+	if (!convert_fn) {
+		convert_generic(buffs, offset, items);
+		return;
+	}
+
+	const uint8_t *src = block_data();
+
+	if (correcting) {
+		update_correction(src, items);
+	}
+
+	if (convert_pool && items >= parallel_min_items) {
+		const ptrdiff_t buf_step = iio_buffer_step(buf);
+
+		convert_pool->run([&](size_t slice, size_t nb_slices) {
+			const size_t first = items * slice / nb_slices;
+			const size_t last = items * (slice + 1) / nb_slices;
+			convert_fn(src + first * buf_step, buffs, offset + first, last - first, coeffs.data());
+		});
+	} else {
+		convert_fn(src, buffs, offset, items, coeffs.data());
+	}
+}
+
+size_t rx_streamer::dsp_pending() const
+{
+	if (dsp_out.empty())
+		return 0;
+	return dsp_out[0].size() / 2 - dsp_out_pos;
+}
+
+// run the whole remaining iio_buffer block through the host DSP stages
+void rx_streamer::process_dsp_block()
+{
+	const uint8_t *src = block_data();
+	const size_t items = items_in_buffer;
+	PLUTO_TRACE_SCOPE("rx_dsp", items);
+	const ptrdiff_t buf_step = iio_buffer_step(buf);
+
+	if (correcting) {
+		update_correction(src, items);
+	}
+
+	dsp_scratch.resize(2 * pluto_dsp_block_items);
+	dsp_out_pos = 0;
+	for (auto &out : dsp_out)
+		out.clear();
+
+	for (size_t done = 0; done < items; done += pluto_dsp_block_items) {
+		const size_t count = std::min(pluto_dsp_block_items, items - done);
+
+		for (size_t c = 0; c < dsp_chains.size(); c++) {
+			to_float_fn(src + done * buf_step, c, dsp_scratch.data(), count, coeffs[c]);
+
+			if (!channelizer) {
+				dsp_chains[c].process(dsp_scratch.data(), count, dsp_out[c]);
+				continue;
+			}
+
+			// the sub-bands are split from the output of the chain
+			if (dsp_chains[c].empty()) {
+				channelizer->process(dsp_scratch.data(), count, dsp_out, convert_pool.get(), parallel_min_items);
+			}
+			else {
+				channelizer_in.clear();
+				dsp_chains[c].process(dsp_scratch.data(), count, channelizer_in);
+				channelizer->process(channelizer_in.data(), channelizer_in.size() / 2, dsp_out, convert_pool.get(), parallel_min_items);
+			}
+		}
+	}
+
+	items_in_buffer = 0;
+	byte_offset += items * iio_buffer_step(buf);
+}
+
+// convert items from the current iio_buffer position into buffs, starting at element offset,
+// for buffers which can't be handled by the specialized converters
+void rx_streamer::convert_generic(void * const *buffs, const size_t offset, const size_t items)
+{
+	ptrdiff_t buf_step = iio_buffer_step(buf);
+
+	int16_t conv = 0, *conv_ptr = &conv;
+
+	for (unsigned int i = 0; i < channel_list.size(); i++) {
+		iio_channel *chn = channel_list[i];
+		unsigned int index = i / 2;
+
+		const uint8_t *src = block_data() + ((uint8_t *)iio_buffer_first(buf, chn) - (uint8_t *)iio_buffer_start(buf));
+
+		if (format == PLUTO_SDR_CS16) {
+
+			int16_t *dst_cs16 = (int16_t *)buffs[index] + offset * 2;
+
+			for (size_t j = 0; j < items; ++j) {
+				iio_channel_convert(chn, conv_ptr, src);
+				src += buf_step;
+				dst_cs16[j * 2 + i] = conv;
+			}
+		}
+		else if (format == PLUTO_SDR_CF32) {
+
+			float *dst_cf32 = (float *)buffs[index] + offset * 2;
+
+			for (size_t j = 0; j < items; ++j) {
+				iio_channel_convert(chn, conv_ptr, src);
+				src += buf_step;
+				dst_cf32[j * 2 + i] = float(conv) / 2048.0f;
+			}
+		}
+		else if (format == PLUTO_SDR_CS8) {
+
+			int8_t *dst_cs8 = (int8_t *)buffs[index] + offset * 2;
+	 
+				for (size_t j = 0; j < items; ++j) {
+					iio_channel_convert(chn, conv_ptr, src);
+					src += buf_step;
+					dst_cs8[j * 2 + i] = int8_t(conv >> 4);
+				}
+		}
+		else if (format == PLUTO_SDR_CS8_TEZUKA )
+		{
+				int8_t *dst_cs8 = (int8_t *)buffs[index] + offset * 2;
+	 
+				for (size_t j = 0; j < items; ++j) {
+					iio_channel_convert(chn, conv_ptr, src);
+					src += buf_step;
+					dst_cs8[j + i] = int8_t(conv);
+				}
+		}
+
+	}
+}
+
+int rx_streamer::start(const int flags,
+		const long long timeNs,
+		const size_t numElems)
+{
+	auto before = std::chrono::steady_clock::now();
+
+	// a paused buffer is reused as is, only the blocks queued while
+	// paused are dropped. Fall back to a full re-create otherwise.
+	if (buf && !(warm_restart && flush_stale_blocks())) {
+		destroy_buffer();
+	}
+
+	if (!buf) {
+		iio_device_set_kernel_buffers_count(dev, kernel_buffer_count);
+		buf = iio_device_create_buffer(dev, buffer_size, false);
+	}
+
+	if (!buf) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to create buffer!");
+		throw std::runtime_error("Unable to create buffer!\n");
+	}
+
+	items_in_buffer = 0;
+	byte_offset = 0;
+
+	if (gate) {
+		gate->reset();
+		gate_burst = 0;
+		gate_time_valid = false;
+		dsp_out_pos = 0;
+		for (auto &out : dsp_out)
+			out.clear();
+	}
+
+	direct_copy = has_direct_copy();
+	convert_fn = direct_copy ? select_rx_converter(format, channel_list.size() / 2, correcting) : nullptr;
+	active = true;
+
+	if (spectrum)
+		start_spectrum();
+
+	activation_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - before).count();
+
+	SoapySDR_logf(SOAPY_SDR_INFO, "Has direct RX copy: %d", (int)direct_copy);
+	SoapySDR_logf(SOAPY_SDR_DEBUG, "RX activation took %lld us", activation_us);
+
+	return 0;
+
+}
+
+int rx_streamer::stop(const int flags,
+		const long long timeNs)
+{
+	active = false;
+
+	stop_spectrum();
+
+	// cold mode releases the kernel queue, as done before warm restarts existed
+	if (!warm_restart) {
+		destroy_buffer();
 	}
 
     items_in_buffer = 0;
@@ -647,22 +1601,54 @@ int rx_streamer::stop(const int flags,
 
 }
 
-void rx_streamer::set_buffer_size(const size_t _buffer_size,const size_t num_kernel){
+void rx_streamer::destroy_buffer()
+{
+    //cancel first
+    if (buf) {
+        iio_buffer_cancel(buf);
+    }
+    //then destroy
+	if (buf) {
+		iio_buffer_destroy(buf);
+		buf = nullptr;
+	}
 
-	if (!buf || this->buffer_size != _buffer_size) {
-        //cancel first
-        if (buf) {
-            iio_buffer_cancel(buf);
-        }
-        //then destroy
-        if (buf) {
-            iio_buffer_destroy(buf);
-        }
+    items_in_buffer = 0;
+    byte_offset = 0;
+}
 
-		items_in_buffer = 0;
-        byte_offset = 0;
+// drop the blocks the DMA queued while the stream was paused,
+// returns false if the backend can't do non-blocking refills
+bool rx_streamer::flush_stale_blocks()
+{
+	if (iio_buffer_set_blocking_mode(buf, false) < 0)
+		return false;
+
+	// the kernel queue can't hold more than kernel_buffer_count blocks,
+	// plus the one the DMA may complete while we are draining
+	for (size_t i = 0; i <= kernel_buffer_count; i++) {
+		const ssize_t ret = iio_buffer_refill(buf);
+		if (ret < 0)
+			break;
+		// dropped, but the sample clock behind the timestamps and the taps kept running
+		refilled_items += (size_t)ret / iio_buffer_step(buf);
+	}
 
+	iio_buffer_set_blocking_mode(buf, true);
 
+	return true;
+}
+
+void rx_streamer::set_buffer_size(const size_t _buffer_size,const size_t num_kernel){
+
+	if (!buf || this->buffer_size != _buffer_size || this->kernel_buffer_count != num_kernel) {
+		// the spectrum worker refills the buffer outside of the device lock,
+		// it is stopped across the resize and restarted on the new buffer
+		const bool restart_spectrum = spectrum_thread.joinable();
+		stop_spectrum();
+		destroy_buffer();
+
+		kernel_buffer_count = num_kernel;
 		iio_device_set_kernel_buffers_count(dev, num_kernel);
 		buf = iio_device_create_buffer(dev, _buffer_size, false);
 		if (!buf) {
@@ -670,15 +1656,139 @@ void rx_streamer::set_buffer_size(const size_t _buffer_size,const size_t num_ker
 			throw std::runtime_error("Unable to create buffer!\n");
 		}
 
+		if (restart_spectrum)
+			start_spectrum();
 	}
 
 	this->buffer_size=_buffer_size;
 }
 
 size_t rx_streamer::get_mtu_size() {
+    // one spectrum frame per readStream
+    if (spectrum)
+        return spectra[0]->size();
     return this->mtu_size;
 }
 
+void rx_streamer::set_correction(const bool dc_offset, const bool iq_balance)
+{
+	// the spectrum worker uses the coefficients outside of the device lock
+	std::lock_guard<std::mutex> lock(spectrum_mutex);
+
+	for (size_t c = 0; c < correctors.size(); c++) {
+		correctors[c].set_dc_mode(dc_offset);
+		correctors[c].set_iq_mode(iq_balance);
+		coeffs[c] = correctors[c].coeffs();
+	}
+
+	correcting = dc_offset || iq_balance;
+
+	if (convert_fn)
+		convert_fn = select_rx_converter(format, channel_list.size() / 2, correcting);
+}
+
+void rx_streamer::set_resampling(const double hw_rate, const double app_rate)
+{
+	std::lock_guard<std::mutex> lock(spectrum_mutex);
+
+	dsp_chains.clear();
+	dsp_out.clear();
+	dsp_out_pos = 0;
+	channelizer.reset();
+
+	// timestamps count the items at the hardware rate
+	time_rate = hw_rate;
+	if (time_rate <= 0.0) {
+		long long samplerate = 0;
+		iio_channel_attr_read_longlong(iio_device_find_channel(dev, "voltage0", false), "sampling_frequency", &samplerate);
+		time_rate = double(samplerate);
+	}
+
+	const bool resampling = (app_rate > 0.0 && hw_rate > 0.0);
+	const bool ddc = (ddc_frequency != 0.0);
+	if (!resampling && dsp_stage_names.empty() && !ddc && channelizer_bands < 2)
+		return;
+
+	// the DDC takes the integer part of the rate change, the resampler
+	// only what remains of it
+	double ddc_rate = hw_rate;
+	size_t decimation = 1;
+	if (ddc) {
+		if (ddc_rate <= 0.0) {
+			long long samplerate = 0;
+			iio_channel_attr_read_longlong(iio_device_find_channel(dev, "voltage0", false), "sampling_frequency", &samplerate);
+			ddc_rate = double(samplerate);
+		}
+		if (resampling)
+			decimation = size_t(std::max(std::floor(hw_rate / app_rate + 1e-9), 1.0));
+		SoapySDR_logf(SOAPY_SDR_INFO, "RX DDC shifting by %.1f Hz, decimation %lu", ddc_frequency, (unsigned long)decimation);
+	}
+	const bool fractional = resampling && std::fabs(hw_rate / decimation - app_rate) >= 1.0;
+
+	dsp_chains.resize(channel_list.size() / 2);
+	for (auto &chain : dsp_chains) {
+		if (ddc && ddc_rate > 0.0)
+			chain.push_back(std::unique_ptr<pluto_dsp_stage>(new pluto_ddc(ddc_frequency / ddc_rate, decimation, 16)));
+		if (fractional)
+			chain.push_back(std::unique_ptr<pluto_dsp_stage>(new pluto_resampler(hw_rate / decimation, app_rate)));
+		for (const auto &name : dsp_stage_names)
+			chain.push_back(pluto_make_dsp_stage(name, dsp_args));
+	}
+	dsp_out.resize(dsp_chains.size());
+
+	if (channelizer_bands > 1) {
+		channelizer.reset(new pluto_channelizer(channelizer_bands, 16, channelizer_selected));
+		dsp_out.resize(channelizer_selected.size());
+	}
+
+	to_float_fn = select_rx_to_float(format, channel_list.size() / 2);
+	from_float_fn = select_rx_from_float(format);
+
+	if (resampling)
+		SoapySDR_logf(SOAPY_SDR_INFO, "RX resampling from %.1f to %.1f S/s", hw_rate, app_rate);
+}
+
+void rx_streamer::set_ddc(const double frequency)
+{
+	ddc_frequency = frequency;
+}
+
+double rx_streamer::get_ddc() const
+{
+	return ddc_frequency;
+}
+
+std::string rx_streamer::get_stats() const
+{
+	std::string stats = format_dsp_stats(dsp_chains);
+
+	if (channelizer)
+		stats += (stats.empty() ? "" : ",") + std::string("channelizer_bands=") + std::to_string(channelizer_bands);
+
+	if (gate)
+		stats += (stats.empty() ? "" : ",") + gate->status();
+
+	return stats;
+}
+
+// feed the raw items about to be converted to the per channel estimators
+void rx_streamer::update_correction(const uint8_t *src, const size_t items)
+{
+	const size_t stride = 2 * correctors.size();
+
+	for (size_t c = 0; c < correctors.size(); c++) {
+		if (is_tezuka_format(format))
+			correctors[c].estimate((const int8_t *)src + 2 * c, stride, items);
+		else
+			correctors[c].estimate((const int16_t *)src + 2 * c, stride, items);
+		coeffs[c] = correctors[c].coeffs();
+	}
+}
+
+long long rx_streamer::get_activation_us() const {
+    return this->activation_us;
+}
+
 // return wether can we optimize for single RX, 2 channel (I/Q), same endianess direct copy
 bool rx_streamer::has_direct_copy()
 {
@@ -702,7 +1812,274 @@ bool rx_streamer::has_direct_copy()
 }
 
 
-tx_streamer::tx_streamer(const iio_device *_dev, const plutosdrStreamFormat _format, const std::vector<size_t> &channels, const SoapySDR::Kwargs &args) :
+bool rx_streamer::can_share() const
+{
+	// the readers of a shared buffer get the hardware rate, unprocessed and ungated
+	return !spectrum && dsp_chains.empty() && !channelizer && !gate;
+}
+
+bool rx_streamer::is_active() const
+{
+	return active;
+}
+
+plutosdrStreamFormat rx_streamer::get_format() const
+{
+	return format;
+}
+
+size_t rx_streamer::get_num_channels() const
+{
+	return channel_list.size() / 2;
+}
+
+// refill for the readers of a shared buffer, the whole block is handed to the
+// broadcast ring so nothing is left pending in the iio_buffer
+ssize_t rx_streamer::refill_shared(pluto_rx_broadcast &broadcast)
+{
+	if (!buf || !active)
+		return -1;
+
+	PLUTO_TRACE_BEGIN("rx_refill");
+	ssize_t ret = iio_buffer_refill(buf);
+	PLUTO_TRACE_END("rx_refill", ret);
+
+	if (ret < 0)
+		return ret;
+
+	notify_taps(ret);
+
+	const uint8_t *src = (uint8_t *)iio_buffer_start(buf);
+	const size_t items = (size_t)ret / iio_buffer_step(buf);
+
+	if (correcting) {
+		update_correction(src, items);
+	}
+
+	broadcast.publish(src, ret, items, coeffs, correcting, refilled_items - items, time_rate);
+
+	items_in_buffer = 0;
+	byte_offset = 0;
+
+	return ret;
+}
+
+pluto_rx_broadcast::pluto_rx_broadcast(const size_t depth, const size_t _nb_channels, const pump_fn &_pump):
+	nb_channels(_nb_channels), pump(_pump), blocks(std::max<size_t>(depth, 2)), next_seq(0), raw_step(0),
+	pumping(false), detached(false)
+{
+}
+
+void pluto_rx_broadcast::publish(const uint8_t *data, const size_t bytes, const size_t items,
+	const std::vector<pluto_iq_coeffs> &coeffs, const bool corrected,
+	const unsigned long long first_item, const double rate)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	block &b = blocks[next_seq % blocks.size()];
+	b.raw.assign(data, data + bytes);
+	b.items = items;
+	b.coeffs = coeffs;
+	b.corrected = corrected;
+	b.first_item = first_item;
+	b.rate = rate;
+	for (auto &conv : b.converted)
+		conv.second.valid = false;
+
+	raw_step = items ? bytes / items : raw_step;
+	next_seq++;
+
+	cond.notify_all();
+}
+
+void pluto_rx_broadcast::detach()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	detached = true;
+	cond.notify_all();
+}
+
+void pluto_rx_broadcast::attach(rx_consumer *consumer)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	consumers.push_back(consumer);
+	format_readers[consumer->format]++;
+}
+
+void pluto_rx_broadcast::release(rx_consumer *consumer)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	consumers.erase(std::remove(consumers.begin(), consumers.end(), consumer), consumers.end());
+	format_readers[consumer->format]--;
+}
+
+void pluto_rx_broadcast::start(rx_consumer *consumer)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	// reading starts with the next refilled block
+	consumer->seq = next_seq;
+	consumer->offset = 0;
+	consumer->active = true;
+}
+
+void pluto_rx_broadcast::stop(rx_consumer *consumer)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	consumer->active = false;
+	cond.notify_all();
+}
+
+size_t pluto_rx_broadcast::active_count() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return std::count_if(consumers.begin(), consumers.end(), [](const rx_consumer *c) { return c->active; });
+}
+
+int pluto_rx_broadcast::read(rx_consumer *consumer, void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs)
+{
+	flags = 0;
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+
+	while (consumer->active && consumer->seq == next_seq) {
+		if (detached)
+			return SOAPY_SDR_STREAM_ERROR;
+
+		if (pumping) {
+			if (cond.wait_until(lock, deadline) == std::cv_status::timeout)
+				return SOAPY_SDR_TIMEOUT;
+			continue;
+		}
+
+		// nobody is refilling, this reader does it for everyone
+		pumping = true;
+		lock.unlock();
+		const ssize_t ret = pump(*this);
+		lock.lock();
+		pumping = false;
+		cond.notify_all();
+
+		if (ret < 0)
+			return SOAPY_SDR_TIMEOUT;
+	}
+
+	if (!consumer->active)
+		return 0;
+
+	if (next_seq - consumer->seq > blocks.size()) {
+		// resume with the oldest block still kept
+		consumer->seq = next_seq - blocks.size();
+		consumer->offset = 0;
+		consumer->overflows++;
+		PLUTO_TRACE_INSTANT("rx_consumer_overflow", next_seq - consumer->seq);
+		return SOAPY_SDR_OVERFLOW;
+	}
+
+	block &b = blocks[consumer->seq % blocks.size()];
+	const size_t items = std::min(numElems, b.items - consumer->offset);
+
+	// every handle sees the same sample clock as the gated primary stream
+	if (b.rate > 0.0) {
+		timeNs = SoapySDR::ticksToTimeNs(b.first_item + consumer->offset, b.rate);
+		flags |= SOAPY_SDR_HAS_TIME;
+	}
+
+	if (format_readers[consumer->format] > 1) {
+		const size_t item_bytes = stream_item_bytes(consumer->format);
+		for (size_t c = 0; c < nb_channels; c++)
+			std::memcpy(buffs[c], converted(b, consumer->format, c) + consumer->offset * item_bytes, items * item_bytes);
+	}
+	else {
+		const pluto_rx_convert_fn convert_fn = select_rx_converter(consumer->format, nb_channels, b.corrected);
+		convert_fn(b.raw.data() + consumer->offset * raw_step, buffs, 0, items, b.coeffs.data());
+	}
+
+	consumer->offset += items;
+	consumer->delivered += items;
+	if (consumer->offset == b.items) {
+		consumer->seq++;
+		consumer->offset = 0;
+	}
+
+	return int(items);
+}
+
+// the block in the given stream format, converted by the first reader needing it
+const uint8_t *pluto_rx_broadcast::converted(block &b, const plutosdrStreamFormat format, const size_t channel)
+{
+	converted_block &conv = b.converted[format];
+
+	if (!conv.valid) {
+		const size_t item_bytes = stream_item_bytes(format);
+		std::vector<void *> outs(nb_channels);
+
+		conv.channels.resize(nb_channels);
+		for (size_t c = 0; c < nb_channels; c++) {
+			conv.channels[c].resize(b.items * item_bytes);
+			outs[c] = conv.channels[c].data();
+		}
+
+		select_rx_converter(format, nb_channels, b.corrected)(b.raw.data(), outs.data(), 0, b.items, b.coeffs.data());
+		conv.valid = true;
+	}
+
+	return conv.channels[channel].data();
+}
+
+// "readers=..,reader<n>_format=..,reader<n>_lag_blocks=..,reader<n>_overflows=.."
+std::string pluto_rx_broadcast::status() const
+{
+	static const char *format_names[] = { "CF32", "CS16", "CS12", "CS8", "CF32", "CS16", "CS12", "CS8" };
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::ostringstream stats;
+	stats.imbue(std::locale::classic());
+	stats << "readers=" << consumers.size();
+	stats << ",blocks=" << next_seq;
+
+	for (size_t k = 0; k < consumers.size(); k++) {
+		const rx_consumer *c = consumers[k];
+		stats << ",reader" << k << "_format=" << format_names[c->format];
+		stats << ",reader" << k << "_active=" << (c->active ? "true" : "false");
+		stats << ",reader" << k << "_lag_blocks=" << (c->active ? next_seq - c->seq : 0);
+		stats << ",reader" << k << "_items=" << c->delivered;
+		stats << ",reader" << k << "_overflows=" << c->overflows;
+	}
+
+	return stats.str();
+}
+
+rx_consumer::rx_consumer(const std::shared_ptr<pluto_rx_broadcast> &_broadcast, const plutosdrStreamFormat _format):
+	broadcast(_broadcast), format(_format), active(false), seq(0), offset(0), delivered(0), overflows(0)
+{
+	broadcast->attach(this);
+}
+
+rx_consumer::~rx_consumer()
+{
+	broadcast->release(this);
+}
+
+int rx_consumer::recv(void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs)
+{
+	return broadcast->read(this, buffs, numElems, flags, timeNs, timeoutUs);
+}
+
+void rx_consumer::start()
+{
+	broadcast->start(this);
+}
+
+void rx_consumer::stop()
+{
+	broadcast->stop(this);
+}
+
+tx_streamer::tx_streamer(const iio_device *_dev, const plutosdrStreamFormat _format, const std::vector<size_t> &channels, const SoapySDR::Kwargs &args,
+	const SoapyPlutoSDR *device) :
 	dev(_dev), format(_format), buf(nullptr)
 {
 
@@ -715,21 +2092,38 @@ tx_streamer::tx_streamer(const iio_device *_dev, const plutosdrStreamFormat _for
 	for (i = 0; i < nb_channels; i++)
 		iio_channel_disable(iio_device_get_channel(dev, i));
 
-	//default to channel 0, if none were specified
-	const std::vector<size_t> &channelIDs = channels.empty() ? std::vector<size_t>{0} : channels;
+	if (args.count("cyclic") != 0)
+		cyclic = (args.at("cyclic") == "true");
+
+	carriers = parse_carriers(args);
+	if (!carriers.empty()) {
+		if (cyclic)
+			throw std::runtime_error("Cyclic TX doesn't support multiple carriers");
+		if (!channels.empty() && channels.size() != carriers.size())
+			throw std::runtime_error("A multi-carrier TX stream takes one channel per carrier");
+	}
+
+	//default to channel 0, if none were specified, carriers all go to channel 0
+	const std::vector<size_t> &channelIDs = (channels.empty() || !carriers.empty()) ? std::vector<size_t>{0} : channels;
+
+	if (is_tezuka_format(format) && channelIDs.size() > 1)
+		throw std::runtime_error("Tezuka CS8 transport only supports a single channel");
 
 	for (i = 0; i < channelIDs.size() * 2; i++) {
 		iio_channel *chn = iio_device_get_channel(dev, i);
 		iio_channel_enable(chn);
 		if((i==1) && (format >= PLUTO_SDR_CF32_TEZUKA))
 		{
-			fprintf(stderr,"Tezuka TX CS8 output\n");
+			SoapySDR_log(SOAPY_SDR_DEBUG, "Tezuka TX CS8 output");
 			iio_channel_disable(chn);
 		}
 		
 		
 		channel_list.push_back(chn);
 	}
+
+	thread_policy = pluto_thread_policy::from_args(args, "tx_cpu");
+	thread_policy.device = device;
 	
 	if ( args.count( "bufflen" ) != 0 ){
 
@@ -737,7 +2131,7 @@ tx_streamer::tx_streamer(const iio_device *_dev, const plutosdrStreamFormat _for
 		{
 			
 			size_t bufferLength = std::stoi(args.at("bufflen"));
-			fprintf(stderr,"Tx buflen %d\n",bufferLength);
+			SoapySDR_logf(SOAPY_SDR_DEBUG, "Tx buflen %lu", (unsigned long)bufferLength);
 			if (bufferLength > 0)
 				this->set_buffer_size(bufferLength,8);
 		}
@@ -748,7 +2142,7 @@ tx_streamer::tx_streamer(const iio_device *_dev, const plutosdrStreamFormat _for
 		long long samplerate;
 		
 		iio_channel_attr_read_longlong(iio_device_find_channel(dev, "voltage0", true),"sampling_frequency",&samplerate);
-		fprintf(stderr,"Tx SampleRate %d\n",samplerate);
+		SoapySDR_logf(SOAPY_SDR_DEBUG, "Tx SampleRate %lld", samplerate);
 		this->set_buffer_size_by_samplerate(samplerate);
 
 	}
@@ -764,6 +2158,17 @@ tx_streamer::tx_streamer(const iio_device *_dev, const plutosdrStreamFormat _for
 	}
 	*/
 	direct_copy = has_direct_copy();
+	convert_fn = select_tx_converter(format, channelIDs.size());
+
+	dsp_stage_names = parse_dsp_stages(args);
+	dsp_args = args;
+	// the DSP path works on the raw DAC scale
+	if (dsp_args.count("dsp_full_scale") == 0)
+		dsp_args["dsp_full_scale"] = is_tezuka_format(format) ? "128" : "32768";
+	set_resampling(0.0, 0.0);
+
+	if (cyclic)
+		SoapySDR_logf(SOAPY_SDR_INFO, "TX cyclic mode, waveforms are loaded on END_BURST");
 
 	SoapySDR_logf(SOAPY_SDR_INFO, "Has direct TX copy: %d", (int)direct_copy);
 
@@ -771,7 +2176,8 @@ tx_streamer::tx_streamer(const iio_device *_dev, const plutosdrStreamFormat _for
 
 tx_streamer::~tx_streamer(){
 
-	if (buf) { iio_buffer_destroy(buf); }
+	stop_playback();
+	destroy_buffer();
 
 	for(unsigned int i=0;i<channel_list.size(); ++i)
 		iio_channel_disable(channel_list[i]);
@@ -785,69 +2191,45 @@ int tx_streamer::send(	const void * const *buffs,
 		const long timeoutUs )
 
 {
+	if (cyclic)
+		return send_cyclic(buffs, numElems, flags);
+
+	if (playing)
+		return SOAPY_SDR_STREAM_ERROR;
+
     if (!buf) {
-		fprintf(stderr,"erro buf\n");
+		PLUTO_TRACE_INSTANT("tx_no_buffer", numElems);
         return 0;
     }
-	//fprintf(stderr,"Num elets cs16 tezuka %d\n",numElems);
-	size_t items = std::min(buffer_size - items_in_buffer, numElems);
-	//size_t items = numElems;
-	int16_t src = 0;
-	int16_t const *src_ptr = &src;
-	
-	
-	if (format == PLUTO_SDR_CS16) {
-			int16_t *dst_ptr = (int16_t *)iio_buffer_start(buf)+items_in_buffer*2 ;
-			
-			int16_t *samples_cs16 = (int16_t *)buffs[0];
 
-			for (size_t j = 0; j < items; j++)
-			{
-				 
-				dst_ptr[j]=(samples_cs16[j*2]);
-				dst_ptr[j+1]=(samples_cs16[j*2+1]);
-				//dst_ptr[j]=((samples_cs16[j*2])>>8)|((samples_cs16[j*2])&0xFF)<<8;
-				//dst_ptr[j+1]=((samples_cs16[j*2+1])>>8)|((samples_cs16[j*2+1])&0xFF)<<8;	
+	if (combiner)
+		return send_carriers(buffs, numElems);
 
-			}
-			
-			
-		}
+	if (!dsp_chains.empty())
+		return send_dsp(buffs, numElems);
 
-	 if (format == PLUTO_SDR_CS16_TEZUKA) {
-			//fprintf(stderr,"Num elets cs16 tezuka %d\n",numElems);
-			
-			int8_t *dst_ptr = (int8_t *)iio_buffer_start(buf)+items_in_buffer*2 ;
-			//dst_ptr+=numElems*2;
-			int16_t *samples_cs16 = (int16_t *)buffs[0];
-
-			for (size_t j = 0; j < items; j++)
-			{
-				
-				
-				//dst_ptr[j]=(samples_cs16[j*2])>>8;
-				//dst_ptr[j+1]=(samples_cs16[j*2+1])>>8;
+	size_t items = std::min(buffer_size - items_in_buffer, numElems);
 
-				dst_ptr[j]=(samples_cs16[j*2])>>8;
-				dst_ptr[j+1]=(samples_cs16[j*2+1])>>8;
+	uint8_t *dst_ptr = (uint8_t *)iio_buffer_start(buf) + items_in_buffer * iio_buffer_step(buf);
 
-			}
-			
-			
-		}
+	PLUTO_TRACE_BEGIN("tx_convert");
+	convert_fn(buffs, dst_ptr, items);
+	PLUTO_TRACE_END("tx_convert", items);
 
 	items_in_buffer+=items;
 	
 	if(items_in_buffer==buffer_size)
 	{
+		measure((const uint8_t *)iio_buffer_start(buf), buffer_size);
+
 		//int nbbyte= iio_buffer_push_partial(buf,items_in_buffer);
-		//fprintf(stderr,"Push Num numelement %d/%d\n",items_in_buffer,buffer_size);
 		
+		PLUTO_TRACE_BEGIN("tx_push");
 		int nbbyte= iio_buffer_push(buf);
-		//fprintf(stderr,"Num writtend %d\n",nbbyte);
+		PLUTO_TRACE_END("tx_push", nbbyte);
 
 		items_in_buffer=0;
-		if(items!=numElems) fprintf(stderr,"Buffer is not aligned\n");
+		if(items!=numElems) PLUTO_TRACE_INSTANT("tx_unaligned", numElems - items);
 	}	
 	
 
@@ -857,9 +2239,469 @@ int tx_streamer::send(	const void * const *buffs,
 
 int tx_streamer::flush()
 {
+	if (cyclic)
+		return load_cyclic();
+
+	drain_dsp(true);
 	return send_buf();
 }
 
+// deactivation ends a cyclic transmission or a playback, a streamed one is flushed
+int tx_streamer::stop()
+{
+	stop_playback();
+
+	if (!cyclic)
+		return flush();
+
+	destroy_buffer();
+	cyclic_staging.clear();
+	cyclic_items = 0;
+	return 0;
+}
+
+void tx_streamer::destroy_buffer()
+{
+	if (buf) {
+		iio_buffer_cancel(buf);
+		iio_buffer_destroy(buf);
+		buf = nullptr;
+	}
+
+	items_in_buffer = 0;
+}
+
+void tx_streamer::start_playback(const std::string &path, const bool loop, const double sample_rate)
+{
+	stop_playback();
+
+	if (cyclic) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "File playback is not available on a cyclic stream");
+		return;
+	}
+
+	// the pacing of the pushes derives from the rate
+	if (!(sample_rate > 0.0)) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "File playback needs a known TX sample rate");
+		return;
+	}
+
+	const int fd = open(path.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to open %s for playback", path.c_str());
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	// a looped file without a whole sample would never fill a block
+	if (size_t(st.st_size) < stream_item_bytes(format)) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "%s holds less than one sample", path.c_str());
+		close(fd);
+		return;
+	}
+
+	void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to map %s: %s", path.c_str(), strerror(errno));
+		return;
+	}
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	// stop() cancels the streaming buffer, start over from a fresh one
+	destroy_buffer();
+	set_buffer_size(buffer_size, 8);
+
+	playback_path = path;
+	playback_data = (const uint8_t *)data;
+	playback_bytes = st.st_size;
+	playback_items = st.st_size / stream_item_bytes(format);
+	playback_loop = loop;
+	playback_rate = sample_rate;
+	playback_pos = 0;
+	playback_loops = 0;
+	playback_underflows = 0;
+	playback_underflow_pos = 0;
+	playback_quit = false;
+	playing = true;
+
+	playback_thread = std::thread(&tx_streamer::playback_worker, this);
+
+	SoapySDR_logf(SOAPY_SDR_INFO, "Playing %s, %lu samples%s", path.c_str(), (unsigned long)playback_items, loop ? " in a loop" : "");
+}
+
+void tx_streamer::stop_playback()
+{
+	std::thread worker = cancel_playback();
+	if (!worker.joinable())
+		return;
+
+	worker.join();
+	end_playback();
+}
+
+std::thread tx_streamer::cancel_playback()
+{
+	if (!playback_thread.joinable())
+		return std::thread();
+
+	// unblock a push waiting for a free kernel buffer
+	playback_quit = true;
+	if (buf)
+		iio_buffer_cancel(buf);
+	return std::move(playback_thread);
+}
+
+void tx_streamer::end_playback()
+{
+	munmap((void *)playback_data, playback_bytes);
+	playback_data = nullptr;
+
+	// a cancelled buffer can't be pushed anymore
+	destroy_buffer();
+	set_buffer_size(buffer_size, 8);
+}
+
+std::string tx_streamer::get_playback_status() const
+{
+	if (playback_path.empty())
+		return "";
+
+	std::ostringstream status;
+	status.imbue(std::locale::classic());
+	status << "path=" << playback_path;
+	status << ",playing=" << (playing ? "true" : "false");
+	status << ",position=" << playback_pos;
+	status << ",samples=" << playback_items;
+	status << ",loops=" << playback_loops;
+	status << ",underflows=" << playback_underflows;
+	status << ",last_underflow_position=" << playback_underflow_pos;
+	return status.str();
+}
+
+// Converts the file into the iio_buffer and pushes it. The push blocks while
+// the kernel queue is full, so the DMA paces the loop at the sample rate.
+// An underflow is counted when the queue ran dry before the next push, the
+// file position of the late block is kept.
+void tx_streamer::playback_worker()
+{
+	// the buffer set up by start_playback may have failed
+	if (!buf) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "No TX buffer to play %s into", playback_path.c_str());
+		playing = false;
+		return;
+	}
+
+	pluto_thread_setup("pluto-tx-play", thread_policy);
+
+	const size_t item_bytes = stream_item_bytes(format);
+	const ptrdiff_t buf_step = iio_buffer_step(buf);
+	const long page = sysconf(_SC_PAGESIZE);
+	const std::chrono::nanoseconds block_duration((long long)(1e9 * buffer_size / playback_rate));
+	std::chrono::steady_clock::time_point drained_at;
+	bool pushed = false;
+	size_t pos = 0;
+	// page offset up to which the pages of the current pass were dropped
+	size_t released = 0;
+
+	std::vector<const void *> srcs(channel_list.size() / 2);
+
+	while (!playback_quit) {
+		const size_t block_pos = pos;
+		size_t filled = 0;
+		bool wrapped = false;
+
+		while (filled < buffer_size) {
+			if (pos == playback_items) {
+				if (!playback_loop)
+					break;
+				pos = 0;
+				wrapped = true;
+				playback_loops++;
+			}
+
+			const size_t items = std::min(buffer_size - filled, playback_items - pos);
+			for (auto &src : srcs)
+				src = playback_data + pos * item_bytes;
+			convert_fn(srcs.data(), (uint8_t *)iio_buffer_start(buf) + filled * buf_step, items);
+
+			filled += items;
+			pos += items;
+		}
+
+		if (filled == 0)
+			break;
+
+		measure((const uint8_t *)iio_buffer_start(buf), filled);
+
+		if (filled < buffer_size)
+			memset((uint8_t *)iio_buffer_start(buf) + filled * buf_step, 0, (buffer_size - filled) * buf_step);
+
+		// read ahead the next blocks and drop the pages already played
+		const size_t ahead = (pos * item_bytes) & ~size_t(page - 1);
+		madvise((void *)(playback_data + ahead), std::min(4 * buffer_size * item_bytes, playback_bytes - ahead), MADV_WILLNEED);
+		// block_pos is still in the pass that ended when the block wrapped, the
+		// pages read since the wrap belong to the next pass and are kept
+		const size_t behind = (block_pos * item_bytes) & ~size_t(page - 1);
+		if (behind > released)
+			madvise((void *)(playback_data + released), behind - released, MADV_DONTNEED);
+		released = wrapped ? 0 : std::max(released, behind);
+
+		const auto now = std::chrono::steady_clock::now();
+		if (pushed && now > drained_at) {
+			playback_underflows++;
+			playback_underflow_pos = block_pos;
+			PLUTO_TRACE_INSTANT("tx_underflow", block_pos);
+		}
+
+		PLUTO_TRACE_BEGIN("tx_push");
+		const ssize_t ret = iio_buffer_push(buf);
+		PLUTO_TRACE_END("tx_push", ret);
+		if (ret < 0)
+			break;
+
+		drained_at = std::max(drained_at, now) + block_duration;
+		pushed = true;
+		playback_pos = pos;
+	}
+
+	playing = false;
+	pluto_thread_release("pluto-tx-play", thread_policy);
+}
+
+// stage the converted samples, END_BURST completes the waveform and loads it
+int tx_streamer::send_cyclic(const void * const *buffs, const size_t numElems, const int flags)
+{
+	const ssize_t sample_size = iio_device_get_sample_size(dev);
+	if (sample_size <= 0)
+		return SOAPY_SDR_STREAM_ERROR;
+
+	// the waveform is loaded as a single DMA block, a longer one is dropped
+	// whole rather than cut, the next write starts a new waveform
+	const size_t staged = cyclic_staging.size();
+	if (staged + numElems * sample_size > size_t(MAX_BUFF_SIZE)) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "TX cyclic waveform longer than the %lld bytes of a buffer, dropped", MAX_BUFF_SIZE);
+		cyclic_staging.clear();
+		return SOAPY_SDR_OVERFLOW;
+	}
+	cyclic_staging.resize(staged + numElems * sample_size);
+	convert_fn(buffs, cyclic_staging.data() + staged, numElems);
+
+	if (flags & SOAPY_SDR_END_BURST) {
+		const int ret = load_cyclic();
+		if (ret < 0)
+			return ret;
+	}
+
+	return int(numElems);
+}
+
+// Swap the transmitted waveform for the staged one. The old cyclic buffer
+// keeps repeating until the new waveform is complete, then the DMA is
+// restarted on the new buffer, so a partial waveform never goes out.
+int tx_streamer::load_cyclic()
+{
+	const ssize_t sample_size = iio_device_get_sample_size(dev);
+	if (cyclic_staging.empty() || sample_size <= 0)
+		return 0;
+
+	const size_t items = cyclic_staging.size() / sample_size;
+
+	destroy_buffer();
+
+	buf = iio_device_create_buffer(dev, items, true);
+	if (!buf) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to create a cyclic buffer of %lu samples", (unsigned long)items);
+		cyclic_staging.clear();
+		cyclic_items = 0;
+		return SOAPY_SDR_STREAM_ERROR;
+	}
+
+	std::memcpy(iio_buffer_start(buf), cyclic_staging.data(), items * sample_size);
+	cyclic_staging.clear();
+
+	// the DMA repeats this block, measuring it once describes the whole signal
+	measure((const uint8_t *)iio_buffer_start(buf), items);
+
+	const ssize_t ret = iio_buffer_push(buf);
+	if (ret < 0) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to push the cyclic buffer (%d)", (int)ret);
+		destroy_buffer();
+		cyclic_items = 0;
+		return SOAPY_SDR_STREAM_ERROR;
+	}
+
+	cyclic_items = items;
+	SoapySDR_logf(SOAPY_SDR_INFO, "TX cyclic waveform of %lu samples loaded", (unsigned long)items);
+
+	return 0;
+}
+
+// the whole call goes through the DSP stages, the output is queued and
+// packed into the iio_buffer which is pushed each time it gets full
+int tx_streamer::send_dsp(const void * const *buffs, const size_t numElems)
+{
+	dsp_scratch.resize(2 * pluto_dsp_block_items);
+
+	for (size_t done = 0; done < numElems; done += pluto_dsp_block_items) {
+		const size_t count = std::min(pluto_dsp_block_items, numElems - done);
+
+		for (size_t c = 0; c < dsp_chains.size(); c++) {
+			to_float_fn(buffs[c], done, dsp_scratch.data(), count);
+			dsp_chains[c].process(dsp_scratch.data(), count, dsp_out[c]);
+		}
+	}
+
+	drain_dsp(false);
+
+	return int(numElems);
+}
+
+int tx_streamer::send_carriers(const void * const *buffs, const size_t numElems)
+{
+	// whole frames only, every carrier then consumes whole items
+	const size_t block = std::max<size_t>(pluto_dsp_block_items / carrier_frame, 1) * carrier_frame;
+	const size_t items = numElems - numElems % carrier_frame;
+
+	carrier_in.resize(combiner->size());
+	carrier_ptrs.resize(combiner->size());
+	carrier_mix.resize(2 * block);
+
+	for (size_t done = 0; done < items; done += block) {
+		const size_t count = std::min(block, items - done);
+
+		for (size_t k = 0; k < combiner->size(); k++) {
+			const size_t interpolation = combiner->interpolation(k);
+			carrier_in[k].resize(2 * (count / interpolation));
+			to_float_fn(buffs[k], done / interpolation, carrier_in[k].data(), count / interpolation);
+			carrier_ptrs[k] = carrier_in[k].data();
+		}
+
+		combiner->process(carrier_ptrs.data(), count, carrier_mix.data());
+
+		if (dsp_chains[0].empty())
+			dsp_out[0].insert(dsp_out[0].end(), carrier_mix.begin(), carrier_mix.begin() + 2 * count);
+		else
+			dsp_chains[0].process(carrier_mix.data(), count, dsp_out[0]);
+	}
+
+	drain_dsp(false);
+
+	return int(items);
+}
+
+// move the queued DSP output into the iio_buffer, pushing full buffers,
+// a partial buffer is only filled on flush
+void tx_streamer::drain_dsp(const bool partial)
+{
+	if (dsp_out.empty() || !buf)
+		return;
+
+	size_t done = 0;
+	const size_t queued = dsp_out[0].size() / 2;
+
+	while (done < queued) {
+		const size_t items = std::min(buffer_size - items_in_buffer, queued - done);
+		if (!partial && items_in_buffer + (queued - done) < buffer_size)
+			break;
+
+		uint8_t *dst_ptr = (uint8_t *)iio_buffer_start(buf) + items_in_buffer * iio_buffer_step(buf);
+		for (size_t c = 0; c < dsp_out.size(); c++)
+			from_float_fn(dsp_out[c].data() + 2 * done, c, dst_ptr, items);
+
+		items_in_buffer += items;
+		done += items;
+
+		if (items_in_buffer == buffer_size) {
+			measure((const uint8_t *)iio_buffer_start(buf), buffer_size);
+			PLUTO_TRACE_BEGIN("tx_push");
+			iio_buffer_push(buf);
+			PLUTO_TRACE_END("tx_push", buffer_size);
+			items_in_buffer = 0;
+		}
+	}
+
+	for (size_t c = 0; c < dsp_out.size(); c++)
+		dsp_out[c].erase(dsp_out[c].begin(), dsp_out[c].begin() + 2 * done);
+}
+
+void tx_streamer::set_resampling(const double hw_rate, const double app_rate)
+{
+	dsp_chains.clear();
+	dsp_out.clear();
+	combiner.reset();
+
+	const bool resampling = (app_rate > 0.0 && hw_rate > 0.0);
+	if (!resampling && dsp_stage_names.empty() && carriers.empty())
+		return;
+
+	if (!carriers.empty()) {
+		// the carriers are summed at the stream rate, ahead of the stages
+		double rate = resampling ? app_rate : hw_rate;
+		if (rate <= 0.0) {
+			long long samplerate = 0;
+			iio_channel_attr_read_longlong(iio_device_find_channel(dev, "voltage0", true), "sampling_frequency", &samplerate);
+			rate = double(samplerate);
+		}
+		combiner.reset(new pluto_carrier_combiner(carriers, rate));
+		carrier_frame = combiner->frame();
+	}
+
+	dsp_chains.resize(channel_list.size() / 2);
+	for (auto &chain : dsp_chains)
+		pluto_build_tx_chain(chain, dsp_stage_names, dsp_args, app_rate, hw_rate);
+	dsp_out.resize(dsp_chains.size());
+
+	to_float_fn = select_tx_to_float(format);
+	from_float_fn = select_tx_from_float(format, channel_list.size() / 2);
+
+	if (resampling)
+		SoapySDR_logf(SOAPY_SDR_INFO, "TX resampling from %.1f to %.1f S/s", app_rate, hw_rate);
+}
+
+void tx_streamer::set_meter(const std::shared_ptr<pluto_tx_meter> &_meter)
+{
+	meter = _meter;
+}
+
+void tx_streamer::set_dsp_arg(const std::string &key, const std::string &value)
+{
+	dsp_args[key] = value;
+}
+
+size_t tx_streamer::get_carrier_frame() const
+{
+	return carrier_frame;
+}
+
+// measure items of the iio_buffer layout, the Tezuka transport carries int8 I/Q
+void tx_streamer::measure(const uint8_t *data, const size_t items)
+{
+	if (!meter)
+		return;
+
+	if (is_tezuka_format(format))
+		meter->measure((const int8_t *)data, items);
+	else
+		meter->measure((const int16_t *)data, items * (channel_list.size() / 2));
+}
+
+std::string tx_streamer::get_stats() const
+{
+	std::string stats = format_dsp_stats(dsp_chains);
+
+	if (combiner)
+		stats += (stats.empty() ? "" : ",") + combiner->status();
+
+	if (cyclic)
+		stats += (stats.empty() ? "" : ",") + std::string("cyclic_items=") + std::to_string(cyclic_items);
+
+	return stats;
+}
+
 int tx_streamer::send_buf()
 {
     if (!buf) {
@@ -867,7 +2709,8 @@ int tx_streamer::send_buf()
     }
 
 	if (items_in_buffer > 0) {
-		fprintf(stderr,"items_in_buffer %d\n",items_in_buffer);
+		PLUTO_TRACE_INSTANT("tx_partial_push", items_in_buffer);
+		measure((const uint8_t *)iio_buffer_start(buf), items_in_buffer);
 		if (items_in_buffer < buffer_size) {
 			ptrdiff_t buf_step = iio_buffer_step(buf);
 			uint8_t *buf_ptr = (uint8_t *)iio_buffer_start(buf) + items_in_buffer * buf_step;
@@ -876,7 +2719,9 @@ int tx_streamer::send_buf()
 			memset(buf_ptr, 0, buf_end - buf_ptr);
 		}
 
+		PLUTO_TRACE_BEGIN("tx_push");
 		ssize_t ret = iio_buffer_push(buf);
+		PLUTO_TRACE_END("tx_push", ret);
 		items_in_buffer = 0;
 
 		if (ret < 0) {
@@ -917,6 +2762,12 @@ bool tx_streamer::has_direct_copy()
 
 void tx_streamer::set_buffer_size(const size_t _buffer_size,const size_t num_kernel){
 
+	// cyclic buffers are sized by the waveform when it is loaded
+	if (cyclic) {
+		this->buffer_size = _buffer_size;
+		return;
+	}
+
 	if (!buf || this->buffer_size != _buffer_size) {
         //cancel first
         if (buf) {
@@ -0,0 +1,196 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+struct pluto_thread_policy;
+struct pluto_shm_ring_header;
+
+// Observer of the raw RX blocks, called on the thread that refilled the
+// iio_buffer right after the refill. Implementations must return quickly
+// and never wait on I/O. first_item counts the items refilled since the
+// stream was set up.
+class pluto_rx_tap {
+
+	public:
+		virtual ~pluto_rx_tap() {}
+
+		virtual void on_block(const uint8_t *data, const size_t bytes, const size_t items, const unsigned long long first_item) = 0;
+};
+
+// Layout of the raw RX blocks, as described in the SigMF global object.
+struct pluto_raw_info {
+	std::string datatype; // SigMF datatype, "ci16_le" or "ci8"
+	size_t num_channels;
+};
+
+// Records the raw blocks to <base>.sigmf-data with <base>.sigmf-meta.
+// Blocks are copied into a fixed pool of aligned chunks and written by a
+// dedicated thread with large writes, bypassing the page cache where the
+// OS allows it. When the writer falls behind, blocks are dropped instead
+// of stalling the RX path and the gap is annotated in the metadata.
+class pluto_recorder : public pluto_rx_tap {
+
+	public:
+		pluto_recorder(const std::string &base_path, const pluto_raw_info &raw, const double sample_rate,
+			const double frequency, const double gain, const pluto_thread_policy &policy);
+		~pluto_recorder();
+
+		void on_block(const uint8_t *data, const size_t bytes, const size_t items, const unsigned long long first_item) override;
+
+		// start a new SigMF capture segment at the current sample
+		void set_frequency(const double frequency);
+		void set_gain(const double gain);
+
+		// flush the pending chunks, close the data file and write the metadata
+		void finish();
+
+		std::string status() const;
+
+	private:
+		struct chunk {
+			uint8_t *data;
+			size_t used;
+		};
+
+		struct capture {
+			unsigned long long sample_start;
+			double frequency;
+			double gain;
+			std::string datetime;
+		};
+
+		struct annotation {
+			unsigned long long sample_start;
+			unsigned long long dropped;
+		};
+
+		void writer();
+		bool write_chunk(const chunk *c, const size_t bytes);
+		void write_meta();
+
+		std::string base_path;
+		pluto_raw_info raw;
+		double sample_rate;
+		size_t item_bytes;
+
+		int fd;
+		bool direct_io;
+		unsigned long long written_bytes;
+		unsigned long long allocated_bytes;
+		// a write failed, the recording stopped at written_bytes
+		bool failed;
+
+		std::vector<chunk> chunks;
+		std::vector<chunk *> free_chunks;
+		std::deque<chunk *> full_chunks;
+		chunk *filling;
+
+		mutable std::mutex mutex;
+		std::condition_variable cond;
+		std::thread thread;
+		bool quit;
+		bool finished;
+
+		unsigned long long recorded_items;
+		unsigned long long dropped_items;
+		std::vector<capture> captures;
+		std::vector<annotation> annotations;
+};
+
+// Keeps the last pre_ms of raw blocks in a preallocated ring. A trigger,
+// manual or the first chunk whose mean power reaches the threshold, freezes
+// the window from pre_ms before to post_ms after the event once it has been
+// received, a writer thread then exports it to <base>_<n>.sigmf-data with its
+// metadata and rearms. Triggers arriving while an export is pending are
+// counted as missed.
+class pluto_snapshot : public pluto_rx_tap {
+
+	public:
+		pluto_snapshot(const std::string &base_path, const pluto_raw_info &raw, const double sample_rate,
+			const double frequency, const double gain, const double pre_ms, const double post_ms,
+			const double threshold_dbfs, const bool energy_trigger, const pluto_thread_policy &policy);
+		~pluto_snapshot();
+
+		void on_block(const uint8_t *data, const size_t bytes, const size_t items, const unsigned long long first_item) override;
+
+		// trigger at the next item received
+		void trigger();
+
+		void set_frequency(const double frequency);
+		void set_gain(const double gain);
+		void set_sample_rate(const double sample_rate);
+
+		std::string status() const;
+
+	private:
+		void writer();
+		void freeze(const uint8_t *data, const unsigned long long first_item);
+		void write_snapshot();
+
+		std::string base_path;
+		pluto_raw_info raw;
+		size_t item_bytes;
+		size_t pre_items, post_items;
+
+		// ring of the last pre_items + post_items items, item p at p % ring_items
+		std::vector<uint8_t> ring;
+		size_t ring_items;
+		unsigned long long ring_first, ring_end;
+
+		// threshold on the sum of the squared values per item and channel
+		bool energy_trigger;
+		float threshold;
+		size_t chunk;
+
+		bool armed;
+		bool triggered;
+		unsigned long long trigger_item;
+		std::string trigger_label;
+
+		// frozen window, owned by the writer until exported is set back
+		std::vector<uint8_t> frozen;
+		size_t frozen_items;
+		unsigned long long frozen_first;
+		unsigned long long frozen_trigger;
+		std::string frozen_label;
+		double frozen_rate, frozen_frequency, frozen_gain;
+		bool exporting;
+
+		double sample_rate, frequency, gain;
+
+		mutable std::mutex mutex;
+		std::condition_variable cond;
+		std::thread thread;
+		bool quit;
+
+		size_t nb_snapshots;
+		size_t nb_missed;
+};
+
+// Publishes the raw blocks into a POSIX shared memory ring other processes
+// attach to with pluto_shm_reader (PlutoSDR_SharedRing.hpp). The publisher
+// never waits for the readers, a reader falling behind detects the overrun.
+class pluto_shm_publisher : public pluto_rx_tap {
+
+	public:
+		pluto_shm_publisher(const std::string &name, const pluto_raw_info &raw, const double sample_rate, const size_t capacity);
+		~pluto_shm_publisher();
+
+		void on_block(const uint8_t *data, const size_t bytes, const size_t items, const unsigned long long first_item) override;
+
+		void set_sample_rate(const double sample_rate);
+
+		std::string status() const;
+
+	private:
+		std::string name;
+		pluto_shm_ring_header *header;
+		uint8_t *data;
+		size_t mapped;
+};
@@ -0,0 +1,227 @@
+#include "SoapyPlutoSDR.hpp"
+#include <map>
+#include <sstream>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+
+// what was applied to the running threads, by device then thread name
+static std::mutex thread_report_mutex;
+static std::map<const SoapyPlutoSDR *, std::map<std::string, std::string>> thread_reports;
+
+std::vector<int> pluto_parse_cpu_list(const std::string &list)
+{
+	std::vector<int> cpus;
+	std::stringstream cpu_list(list);
+	std::string cpu;
+
+	while (std::getline(cpu_list, cpu, ',')) {
+		try
+		{
+			cpus.push_back(std::stoi(cpu));
+		}
+		catch (const std::invalid_argument &){}
+	}
+
+	return cpus;
+}
+
+std::string pluto_format_cpu_list(const std::vector<int> &cpus)
+{
+	std::string list;
+
+	for (size_t i = 0; i < cpus.size(); i++) {
+		if (i)
+			list += ",";
+		list += std::to_string(cpus[i]);
+	}
+
+	return list;
+}
+
+pluto_thread_policy pluto_thread_policy::from_args(const SoapySDR::Kwargs &args, const std::string &cpu_key)
+{
+	pluto_thread_policy policy;
+
+	if (args.count(cpu_key) != 0)
+		policy.cpus = pluto_parse_cpu_list(args.at(cpu_key));
+
+	if (args.count("rt_priority") != 0) {
+		try
+		{
+			policy.rt_priority = std::stoi(args.at("rt_priority"));
+		}
+		catch (const std::invalid_argument &){}
+	}
+
+	return policy;
+}
+
+void pluto_thread_setup(const std::string &name, const pluto_thread_policy &policy)
+{
+	std::string applied = "cpus=";
+
+	// thread names are limited to 15 characters on Linux
+#if defined(__APPLE__)
+	pthread_setname_np(name.substr(0, 15).c_str());
+#elif defined(__linux__)
+	pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#endif
+
+#ifdef __linux__
+	if (!policy.cpus.empty()) {
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		for (int cpu : policy.cpus) {
+			if (cpu >= 0 && cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &cpuset);
+		}
+
+		int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+		if (ret != 0) {
+			SoapySDR_logf(SOAPY_SDR_WARNING, "Unable to pin thread %s to cpus %s: %s",
+				name.c_str(), pluto_format_cpu_list(policy.cpus).c_str(), strerror(ret));
+			applied += "any";
+		} else {
+			applied += pluto_format_cpu_list(policy.cpus);
+		}
+	} else {
+		applied += "any";
+	}
+#else
+	applied += "any";
+#endif
+
+	applied += " rt_priority=";
+
+	if (policy.rt_priority > 0) {
+		sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = policy.rt_priority;
+
+		int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (ret != 0) {
+			SoapySDR_logf(SOAPY_SDR_WARNING, "Unable to set SCHED_FIFO priority %d on thread %s: %s",
+				policy.rt_priority, name.c_str(), strerror(ret));
+			applied += "0";
+		} else {
+			applied += std::to_string(policy.rt_priority);
+		}
+	} else {
+		applied += "0";
+	}
+
+	std::lock_guard<std::mutex> lock(thread_report_mutex);
+	thread_reports[policy.device][name] = applied;
+}
+
+void pluto_thread_release(const std::string &name, const pluto_thread_policy &policy)
+{
+	std::lock_guard<std::mutex> lock(thread_report_mutex);
+	auto threads = thread_reports.find(policy.device);
+	if (threads == thread_reports.end())
+		return;
+
+	threads->second.erase(name);
+	if (threads->second.empty())
+		thread_reports.erase(threads);
+}
+
+std::string pluto_thread_report(const SoapyPlutoSDR *device)
+{
+	std::lock_guard<std::mutex> lock(thread_report_mutex);
+	std::string report;
+
+	auto threads = thread_reports.find(device);
+	if (threads == thread_reports.end())
+		return report;
+
+	for (auto &it : threads->second) {
+		if (!report.empty())
+			report += "; ";
+		report += it.first + ": " + it.second;
+	}
+
+	return report;
+}
+
+pluto_worker_pool::pluto_worker_pool(const size_t nb_workers, const std::string &_name, const pluto_thread_policy &policy, const std::vector<int> &cpus):
+	name(_name), job(nullptr), generation(0), pending(0), quit(false)
+{
+	for (size_t i = 0; i < nb_workers; i++) {
+		// an explicit per worker cpu overrides the stream cpu set
+		pluto_thread_policy worker_policy = policy;
+		if (i < cpus.size() && cpus[i] >= 0)
+			worker_policy.cpus = std::vector<int>{cpus[i]};
+
+		threads.push_back(std::thread(&pluto_worker_pool::worker, this, i + 1, worker_policy));
+	}
+}
+
+pluto_worker_pool::~pluto_worker_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	start_cond.notify_all();
+
+	for (auto &t : threads)
+		t.join();
+}
+
+size_t pluto_worker_pool::slices() const
+{
+	return threads.size() + 1;
+}
+
+void pluto_worker_pool::run(const std::function<void(size_t slice, size_t nb_slices)> &new_job)
+{
+	const size_t nb_slices = slices();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &new_job;
+		pending = threads.size();
+		generation++;
+	}
+	start_cond.notify_all();
+
+	new_job(0, nb_slices);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done_cond.wait(lock, [this]{ return pending == 0; });
+	job = nullptr;
+}
+
+void pluto_worker_pool::worker(const size_t slice, const pluto_thread_policy policy)
+{
+	const std::string thread_name = name + std::to_string(slice);
+	unsigned long long seen = 0;
+
+	pluto_thread_setup(thread_name, policy);
+
+	while (true) {
+		const std::function<void(size_t, size_t)> *current;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			start_cond.wait(lock, [&]{ return quit || generation != seen; });
+			if (quit)
+				break;
+			seen = generation;
+			current = job;
+		}
+
+		(*current)(slice, slices());
+
+		bool last;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			last = (--pending == 0);
+		}
+		if (last)
+			done_cond.notify_one();
+	}
+
+	pluto_thread_release(thread_name, policy);
+}
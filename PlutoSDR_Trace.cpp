@@ -0,0 +1,193 @@
+#include "SoapyPlutoSDR.hpp"
+
+#ifdef PLUTO_TRACE
+
+#include <cstring>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <unistd.h>
+#include <pthread.h>
+
+struct pluto_trace_event {
+	long long ts_ns;
+	long long dur_ns;
+	const char *name;
+	long long arg;
+	char phase;
+};
+
+// seq is the event count + 1 once the event is complete, 0 while it is written
+struct pluto_trace_slot {
+	std::atomic<unsigned long long> seq;
+	pluto_trace_event event;
+};
+
+// written by its thread only, head counts the events ever recorded
+struct pluto_trace_ring {
+	std::atomic<unsigned long long> head;
+	std::atomic<bool> alive;
+	int tid;
+	std::string thread_name;
+	pluto_trace_slot slots[pluto_trace_events];
+};
+
+// rings are never freed, the events of exited threads stay in the dumps
+// until trace_max_rings is reached, new threads then reuse their rings
+static const size_t trace_max_rings = 64;
+static std::mutex trace_rings_mutex;
+static std::vector<pluto_trace_ring *> trace_rings;
+static int trace_next_tid = 1;
+
+static const std::chrono::steady_clock::time_point trace_epoch = std::chrono::steady_clock::now();
+
+static pluto_trace_ring *trace_register()
+{
+	std::lock_guard<std::mutex> lock(trace_rings_mutex);
+
+	pluto_trace_ring *ring = nullptr;
+	if (trace_rings.size() >= trace_max_rings) {
+		for (auto r : trace_rings) {
+			if (!r->alive.load()) {
+				ring = r;
+				break;
+			}
+		}
+	}
+	if (!ring) {
+		ring = new pluto_trace_ring();
+		trace_rings.push_back(ring);
+	}
+
+	char name[16] = "";
+#if defined(__linux__) || defined(__APPLE__)
+	pthread_getname_np(pthread_self(), name, sizeof(name));
+#endif
+
+	ring->tid = trace_next_tid++;
+	ring->thread_name = name;
+	ring->head.store(0);
+	for (auto &slot : ring->slots)
+		slot.seq.store(0, std::memory_order_relaxed);
+	ring->alive.store(true);
+	return ring;
+}
+
+// marks the ring of the thread free when it exits
+struct pluto_trace_owner {
+	pluto_trace_ring *ring = nullptr;
+	~pluto_trace_owner() { if (ring) ring->alive.store(false); }
+};
+
+static thread_local pluto_trace_owner trace_owner;
+
+long long pluto_trace_now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - trace_epoch).count();
+}
+
+void pluto_trace_record(const char phase, const char *name, const long long arg, const long long dur_ns)
+{
+	pluto_trace_ring *ring = trace_owner.ring;
+	if (!ring)
+		ring = trace_owner.ring = trace_register();
+
+	const long long now = pluto_trace_now();
+	const unsigned long long head = ring->head.load(std::memory_order_relaxed);
+
+	pluto_trace_slot &slot = ring->slots[head % pluto_trace_events];
+	slot.seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	pluto_trace_event &e = slot.event;
+	// complete events are recorded at their end
+	e.ts_ns = now - dur_ns;
+	e.dur_ns = dur_ns;
+	e.name = name;
+	e.arg = arg;
+	e.phase = phase;
+
+	slot.seq.store(head + 1, std::memory_order_release);
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+static void write_event(std::ostream &json, const pluto_trace_event &e, const int pid, const int tid)
+{
+	json << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"" << e.phase << "\",\"pid\":" << pid << ",\"tid\":" << tid;
+	json << ",\"ts\":" << e.ts_ns / 1000 << "." << std::setw(3) << std::setfill('0') << e.ts_ns % 1000;
+	if (e.phase == 'X')
+		json << ",\"dur\":" << e.dur_ns / 1000 << "." << std::setw(3) << std::setfill('0') << e.dur_ns % 1000;
+	if (e.phase == 'i')
+		json << ",\"s\":\"t\"";
+	json << ",\"args\":{\"value\":" << e.arg << "}}";
+}
+
+bool pluto_trace_dump(const std::string &path)
+{
+	const int pid = int(getpid());
+
+	std::ostringstream json;
+	json.imbue(std::locale::classic());
+	json << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	json << "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"args\":{\"name\":\"SoapyPlutoSDR\"}}";
+
+	std::vector<pluto_trace_event> events;
+	size_t nb_events = 0;
+
+	std::lock_guard<std::mutex> lock(trace_rings_mutex);
+	for (auto ring : trace_rings) {
+		const unsigned long long head = ring->head.load(std::memory_order_acquire);
+		const unsigned long long first = (head > pluto_trace_events) ? head - pluto_trace_events : 0;
+
+		// the thread keeps recording while its slots are copied, a slot whose
+		// seq changed during the copy was overwritten and is dropped
+		events.clear();
+		for (unsigned long long k = first; k < head; k++) {
+			const pluto_trace_slot &slot = ring->slots[k % pluto_trace_events];
+			if (slot.seq.load(std::memory_order_acquire) != k + 1)
+				continue;
+			const pluto_trace_event e = slot.event;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.seq.load(std::memory_order_relaxed) == k + 1)
+				events.push_back(e);
+		}
+
+		json << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << ring->tid;
+		json << ",\"args\":{\"name\":\"" << (ring->thread_name.empty() ? "thread" : ring->thread_name) << "\"}}";
+
+		for (const auto &e : events)
+			write_event(json, e, pid, ring->tid);
+		nb_events += events.size();
+	}
+
+	json << "\n]}\n";
+
+	std::ofstream file(path);
+	file << json.str();
+	if (!file) {
+		SoapySDR_logf(SOAPY_SDR_ERROR, "Unable to write the trace to %s", path.c_str());
+		return false;
+	}
+
+	SoapySDR_logf(SOAPY_SDR_INFO, "Wrote %lu trace events of %lu threads to %s",
+		(unsigned long)nb_events, (unsigned long)trace_rings.size(), path.c_str());
+	return true;
+}
+
+std::string pluto_trace_status()
+{
+	std::lock_guard<std::mutex> lock(trace_rings_mutex);
+
+	std::ostringstream status;
+	status.imbue(std::locale::classic());
+	status << "capacity=" << pluto_trace_events;
+	for (auto ring : trace_rings) {
+		if (!ring->alive.load())
+			continue;
+		status << "," << (ring->thread_name.empty() ? "thread" : ring->thread_name) << ring->tid;
+		status << "_events=" << ring->head.load(std::memory_order_acquire);
+	}
+	return status.str();
+}
+
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+// Hot path event tracing, compiled in with the ENABLE_TRACE CMake option
+// (PLUTO_TRACE). Each thread records into its own ring of the last
+// pluto_trace_events events without locking; writeSetting("trace_dump", path)
+// writes all rings as Chrome trace JSON, to open in chrome://tracing or
+// ui.perfetto.dev. Event names must be string literals. Without
+// PLUTO_TRACE the macros expand to nothing and their arguments are not
+// evaluated.
+#ifdef PLUTO_TRACE
+
+static const size_t pluto_trace_events = 8192;
+
+// phase is the Chrome event type: 'B' begin, 'E' end, 'i' instant, 'X' complete
+void pluto_trace_record(const char phase, const char *name, const long long arg, const long long dur_ns = 0);
+long long pluto_trace_now();
+
+// write the events of all threads, oldest first
+bool pluto_trace_dump(const std::string &path);
+std::string pluto_trace_status();
+
+class pluto_trace_scope {
+
+	public:
+		pluto_trace_scope(const char *_name, const long long _arg) : name(_name), arg(_arg), start(pluto_trace_now()) {}
+		~pluto_trace_scope() { pluto_trace_record('X', name, arg, pluto_trace_now() - start); }
+
+	private:
+		const char *name;
+		long long arg;
+		long long start;
+};
+
+#define PLUTO_TRACE_CONCAT2(a, b) a##b
+#define PLUTO_TRACE_CONCAT(a, b) PLUTO_TRACE_CONCAT2(a, b)
+
+#define PLUTO_TRACE_BEGIN(name) pluto_trace_record('B', name, 0)
+#define PLUTO_TRACE_END(name, arg) pluto_trace_record('E', name, (long long)(arg))
+#define PLUTO_TRACE_INSTANT(name, arg) pluto_trace_record('i', name, (long long)(arg))
+#define PLUTO_TRACE_SCOPE(name, arg) pluto_trace_scope PLUTO_TRACE_CONCAT(pluto_trace_scope_, __LINE__)(name, (long long)(arg))
+
+#else
+
+#define PLUTO_TRACE_BEGIN(name) do {} while (0)
+#define PLUTO_TRACE_END(name, arg) do {} while (0)
+#define PLUTO_TRACE_INSTANT(name, arg) do {} while (0)
+#define PLUTO_TRACE_SCOPE(name, arg) do {} while (0)
+
+#endif
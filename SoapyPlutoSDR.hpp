@@ -4,10 +4,19 @@
 #include <thread>
 #include <chrono>
 #include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <map>
+#include <deque>
 #include <SoapySDR/Device.hpp>
+#include <SoapySDR/Version.hpp>
 #include <SoapySDR/Logger.hpp>
 #include <SoapySDR/Types.hpp>
 #include <SoapySDR/Formats.hpp>
+#include "PlutoSDR_Converters.hpp"
+#include "PlutoSDR_Taps.hpp"
+#include "PlutoSDR_Trace.hpp"
 
 typedef enum plutosdrStreamFormat {
 	PLUTO_SDR_CF32,
@@ -20,9 +29,60 @@ typedef enum plutosdrStreamFormat {
 	PLUTO_SDR_CS8_TEZUKA
 } plutosdrStreamFormat;
 
+class SoapyPlutoSDR;
+
+// CPU affinity and real-time priority applied to the threads the driver creates
+struct pluto_thread_policy {
+	std::vector<int> cpus;
+	int rt_priority = 0;
+	// the device whose thread report lists the threads
+	const SoapyPlutoSDR *device = nullptr;
+
+	static pluto_thread_policy from_args(const SoapySDR::Kwargs &args, const std::string &cpu_key);
+};
+
+std::vector<int> pluto_parse_cpu_list(const std::string &list);
+std::string pluto_format_cpu_list(const std::vector<int> &cpus);
+
+// name, pin and prioritize the calling driver thread, what was applied is kept
+// for the pluto_thread_report() of the device of the policy
+void pluto_thread_setup(const std::string &name, const pluto_thread_policy &policy);
+void pluto_thread_release(const std::string &name, const pluto_thread_policy &policy);
+std::string pluto_thread_report(const SoapyPlutoSDR *device);
+
+// A small persistent thread pool splitting one job in equal slices,
+// the calling thread always runs slice 0 itself.
+class pluto_worker_pool {
+
+	public:
+		pluto_worker_pool(const size_t nb_workers, const std::string &name, const pluto_thread_policy &policy, const std::vector<int> &cpus);
+		~pluto_worker_pool();
+
+		// number of slices a job is split into (workers + caller)
+		size_t slices() const;
+
+		void run(const std::function<void(size_t slice, size_t nb_slices)> &job);
+
+	private:
+		void worker(const size_t slice, const pluto_thread_policy policy);
+
+		const std::string name;
+		std::vector<std::thread> threads;
+		std::mutex mutex;
+		std::condition_variable start_cond;
+		std::condition_variable done_cond;
+		const std::function<void(size_t, size_t)> *job;
+		unsigned long long generation;
+		size_t pending;
+		bool quit;
+};
+
+class pluto_rx_broadcast;
+
 class rx_streamer {
 	public:
-		rx_streamer(const iio_device *dev, const plutosdrStreamFormat format, const std::vector<size_t> &channels, const SoapySDR::Kwargs &args);
+		rx_streamer(const iio_device *dev, const plutosdrStreamFormat format, const std::vector<size_t> &channels, const SoapySDR::Kwargs &args,
+			const SoapyPlutoSDR *device);
 		~rx_streamer();
 		size_t recv(void * const *buffs,
 				const size_t numElems,
@@ -40,10 +100,58 @@ class rx_streamer {
 
         size_t get_mtu_size();
 
+		long long get_activation_us() const;
+
+		void set_correction(const bool dc_offset, const bool iq_balance);
+
+		// (re)build the DSP chains, resampling from the hardware rate to the
+		// application rate first, app_rate = 0 disables the resampler stage
+		void set_resampling(const double hw_rate, const double app_rate);
+
+		// shift of the DDC ahead of the resampler in Hz, 0 removes it, applies
+		// to the chains built by the next set_resampling
+		void set_ddc(const double frequency);
+		double get_ddc() const;
+
+		std::string get_stats() const;
+
+		// taps see every refilled block, whichever thread refills
+		void add_tap(const std::shared_ptr<pluto_rx_tap> &tap);
+		void remove_tap(const pluto_rx_tap *tap);
+
+		pluto_raw_info get_raw_info() const;
+
+		// sharing the iio_buffer with other RX handles, see pluto_rx_broadcast
+		bool can_share() const;
+		bool is_active() const;
+		plutosdrStreamFormat get_format() const;
+		size_t get_num_channels() const;
+		ssize_t refill_shared(pluto_rx_broadcast &broadcast);
+
 	private:
 
 		void set_buffer_size(const size_t _buffer_size,const size_t num_kernel);
         void set_mtu_size(const size_t mtu_size);
+		void destroy_buffer();
+		void notify_taps(const size_t bytes);
+		bool flush_stale_blocks();
+		void convert_generic(void * const *buffs, const size_t offset, const size_t items);
+		void convert_items(void * const *buffs, const size_t offset, const size_t items);
+		void update_correction(const uint8_t *src, const size_t items);
+		void select_converters();
+
+		size_t dsp_pending() const;
+		void process_dsp_block();
+
+		size_t recv_spectrum(void * const *buffs, const size_t numElems, int &flags, const long timeoutUs);
+		void spectrum_worker();
+		void start_spectrum();
+		void stop_spectrum();
+
+		size_t recv_gated(void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs);
+
+		// raw items at byte_offset, from the iio_buffer or the gate staging
+		const uint8_t *block_data() const;
 
 		bool has_direct_copy();
 
@@ -56,22 +164,216 @@ class rx_streamer {
 		iio_buffer  *buf;
 		const plutosdrStreamFormat format;
 		bool direct_copy;
+		pluto_rx_convert_fn convert_fn;
         size_t mtu_size;
+		size_t kernel_buffer_count;
+
+		// paused streams keep their iio_buffer and kernel queue allocated,
+		// activation then only has to drop the stale blocks
+		bool active;
+		bool warm_restart;
+		long long activation_us;
+
+		// fill readStream requests completely instead of stopping at block ends
+		bool exact_length;
+
+		// blocks of at least parallel_min_items are converted in slices on the pool
+		std::unique_ptr<pluto_worker_pool> convert_pool;
+		size_t parallel_min_items;
+
+		// DC offset / IQ imbalance correction fused into the conversion
+		bool correcting;
+		std::vector<pluto_iq_corrector> correctors;
+		std::vector<pluto_iq_coeffs> coeffs;
+
+		// host DSP path: a block is converted to float in cache sized pieces, run
+		// through the stage chain of each channel and handed out from dsp_out
+		// in the stream format
+		std::vector<std::string> dsp_stage_names;
+		SoapySDR::Kwargs dsp_args;
+		std::vector<pluto_dsp_chain> dsp_chains;
+		pluto_rx_to_float_fn to_float_fn;
+		pluto_rx_from_float_fn from_float_fn;
+		std::vector<float> dsp_scratch;
+		std::vector<std::vector<float>> dsp_out;
+		size_t dsp_out_pos;
+		double ddc_frequency = 0.0;
+
+		// channelizer mode: the stream channels are sub-bands of hardware
+		// channel 0, split from the output of its chain
+		size_t channelizer_bands = 0;
+		std::vector<size_t> channelizer_selected;
+		std::unique_ptr<pluto_channelizer> channelizer;
+		std::vector<float> channelizer_in;
+
+		// energy gate: only the bursts it keeps are converted, one burst at a
+		// time, each readStream carrying the time of its first item
+		std::unique_ptr<pluto_energy_gate> gate;
+		size_t gate_burst = 0;
+		bool gate_time_valid = false;
+		long long gate_time_ns = 0;
+		bool gate_end = false;
+		double time_rate = 0.0;
+
+		// spectrum mode: a worker refills and turns the blocks into averaged power
+		// spectra, recv only hands out the queued frames (one vector per channel)
+		bool spectrum;
+		std::vector<std::unique_ptr<pluto_spectrum>> spectra;
+		pluto_thread_policy thread_policy;
+		std::thread spectrum_thread;
+		std::mutex spectrum_mutex;
+		std::condition_variable spectrum_cond;
+		bool spectrum_quit;
+		std::deque<std::vector<std::vector<float>>> spectrum_frames;
+		size_t spectrum_frame_pos;
+		bool spectrum_dropped;
+
+		std::mutex tap_mutex;
+		std::vector<std::shared_ptr<pluto_rx_tap>> taps;
+		unsigned long long refilled_items;
 		//bool UseExtendedTezukaFeatures=false;
 
 };
 
+class rx_consumer;
+
+// The last refilled blocks of the RX iio_buffer, kept for several RX stream
+// handles reading at their own pace. Each reader has its own cursor and gets
+// SOAPY_SDR_OVERFLOW when the ring moved past it. A reader finding no new
+// block refills through pump, the others wait for that block. Blocks are
+// converted once per stream format read by more than one handle, a format
+// with a single reader is converted straight into its buffers.
+class pluto_rx_broadcast {
+
+	public:
+		// refill the shared iio_buffer and publish() the block, < 0 on errors
+		typedef std::function<ssize_t(pluto_rx_broadcast &)> pump_fn;
+
+		pluto_rx_broadcast(const size_t depth, const size_t nb_channels, const pump_fn &pump);
+
+		// first_item counts the items refilled since the stream was set up,
+		// at rate, the reads are timestamped with it
+		void publish(const uint8_t *data, const size_t bytes, const size_t items,
+			const std::vector<pluto_iq_coeffs> &coeffs, const bool corrected,
+			const unsigned long long first_item, const double rate);
+
+		// the stream owning the iio_buffer was closed
+		void detach();
+
+		void attach(rx_consumer *consumer);
+		void release(rx_consumer *consumer);
+
+		void start(rx_consumer *consumer);
+		void stop(rx_consumer *consumer);
+		size_t active_count() const;
+
+		int read(rx_consumer *consumer, void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs);
+
+		std::string status() const;
+
+	private:
+		struct converted_block {
+			bool valid;
+			std::vector<std::vector<uint8_t>> channels;
+		};
+
+		struct block {
+			std::vector<uint8_t> raw;
+			size_t items;
+			std::vector<pluto_iq_coeffs> coeffs;
+			bool corrected;
+			unsigned long long first_item;
+			double rate;
+			std::map<plutosdrStreamFormat, converted_block> converted;
+		};
+
+		const uint8_t *converted(block &b, const plutosdrStreamFormat format, const size_t channel);
+
+		const size_t nb_channels;
+		pump_fn pump;
+		std::vector<block> blocks;
+		unsigned long long next_seq;
+		size_t raw_step;
+		bool pumping;
+		bool detached;
+		std::vector<rx_consumer *> consumers;
+		std::map<plutosdrStreamFormat, size_t> format_readers;
+
+		mutable std::mutex mutex;
+		std::condition_variable cond;
+};
+
+// An RX stream handle reading from a pluto_rx_broadcast
+class rx_consumer {
+
+	public:
+		rx_consumer(const std::shared_ptr<pluto_rx_broadcast> &broadcast, const plutosdrStreamFormat format);
+		~rx_consumer();
+
+		int recv(void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs);
+		void start();
+		void stop();
+
+	private:
+		friend class pluto_rx_broadcast;
+
+		std::shared_ptr<pluto_rx_broadcast> broadcast;
+		const plutosdrStreamFormat format;
+		bool active;
+		unsigned long long seq;
+		size_t offset;
+		unsigned long long delivered;
+		unsigned long long overflows;
+};
+
 class tx_streamer {
 
 	public:
-		tx_streamer(const iio_device *dev, const plutosdrStreamFormat format, const std::vector<size_t> &channels, const SoapySDR::Kwargs &args);
+		tx_streamer(const iio_device *dev, const plutosdrStreamFormat format, const std::vector<size_t> &channels, const SoapySDR::Kwargs &args,
+			const SoapyPlutoSDR *device);
 		~tx_streamer();
 		int send(const void * const *buffs,const size_t numElems,int &flags,const long long timeNs,const long timeoutUs );
 		int flush();
+		int stop();
 		void set_buffer_size_by_samplerate(const size_t _samplerate);
 		size_t get_mtu_size();
+
+		// (re)build the DSP chains, resampling from the application rate to the
+		// hardware rate last, app_rate = 0 disables the resampler stage
+		void set_resampling(const double hw_rate, const double app_rate);
+
+		std::string get_stats() const;
+
+		// every block pushed to the DAC is measured by the meter
+		void set_meter(const std::shared_ptr<pluto_tx_meter> &meter);
+
+		// applies to the stages built by the next set_resampling
+		void set_dsp_arg(const std::string &key, const std::string &value);
+
+		// items a multi-carrier stream writes at once, 1 otherwise
+		size_t get_carrier_frame() const;
+
+		// play a file in the stream format on every channel of the stream
+		void start_playback(const std::string &path, const bool loop, const double sample_rate);
+		void stop_playback();
+		std::string get_playback_status() const;
+
+		// stop_playback in two steps, so the caller can drop its lock while the
+		// worker exits: cancel_playback hands over the worker to join, then
+		// end_playback unmaps the file and sets up a fresh buffer
+		std::thread cancel_playback();
+		void end_playback();
+
 	private:
 		int send_buf();
+		int send_dsp(const void * const *buffs, const size_t numElems);
+		int send_carriers(const void * const *buffs, const size_t numElems);
+		int send_cyclic(const void * const *buffs, const size_t numElems, const int flags);
+		int load_cyclic();
+		void destroy_buffer();
+		void playback_worker();
+		void drain_dsp(const bool partial);
+		void measure(const uint8_t *data, const size_t items);
 		bool has_direct_copy();
 		void set_buffer_size(const size_t _buffer_size,const size_t num_kernel);
         void set_mtu_size(const size_t mtu_size);
@@ -84,8 +386,54 @@ class tx_streamer {
 		size_t buffer_size;
 		size_t items_in_buffer=0;
 		bool direct_copy;
+		pluto_tx_convert_fn convert_fn;
 		size_t mtu_size;
 
+		// host DSP path: each call is converted to float in cache sized pieces, run
+		// through the stage chain of each channel, queued in dsp_out and packed
+		// into the iio_buffer as it fills up
+		std::vector<std::string> dsp_stage_names;
+		SoapySDR::Kwargs dsp_args;
+		std::vector<pluto_dsp_chain> dsp_chains;
+		pluto_tx_to_float_fn to_float_fn;
+		pluto_tx_from_float_fn from_float_fn;
+		std::vector<float> dsp_scratch;
+		std::vector<std::vector<float>> dsp_out;
+
+		// multi-carrier mode: each buffer of a write is a carrier at its own
+		// rate, the combiner sums them into the DSP path of the single channel
+		std::vector<pluto_carrier> carriers;
+		size_t carrier_frame = 1;
+		std::unique_ptr<pluto_carrier_combiner> combiner;
+		std::vector<std::vector<float>> carrier_in;
+		std::vector<const float *> carrier_ptrs;
+		std::vector<float> carrier_mix;
+
+		// cyclic mode: writes are staged until END_BURST, the waveform is then
+		// loaded in a cyclic iio_buffer the DMA repeats without the host
+		bool cyclic = false;
+		std::vector<uint8_t> cyclic_staging;
+		size_t cyclic_items = 0;
+
+		// file playback: a thread converts a memory-mapped file straight into
+		// the iio_buffer, writeStream is refused meanwhile
+		pluto_thread_policy thread_policy;
+		std::thread playback_thread;
+		std::atomic<bool> playing{false};
+		std::atomic<bool> playback_quit{false};
+		std::string playback_path;
+		const uint8_t *playback_data = nullptr;
+		size_t playback_bytes = 0;
+		size_t playback_items = 0;
+		bool playback_loop = false;
+		double playback_rate = 0.0;
+		std::atomic<unsigned long long> playback_pos{0};
+		std::atomic<unsigned long long> playback_loops{0};
+		std::atomic<unsigned long long> playback_underflows{0};
+		std::atomic<unsigned long long> playback_underflow_pos{0};
+
+		std::shared_ptr<pluto_tx_meter> meter;
+
 };	
 
 // A local spin_mutex usable with std::lock_guard
@@ -110,6 +458,16 @@ private:
 };
 
 
+struct pluto_sensor {
+	std::string key;
+	std::string name;
+	std::string units;
+	iio_channel *chn;
+	bool has_input;
+	double offset;
+	double scale;
+};
+
 class SoapyPlutoSDR : public SoapySDR::Device{
 
 	public:
@@ -238,6 +596,24 @@ class SoapyPlutoSDR : public SoapySDR::Device{
 		bool hasDCOffsetMode( const int direction, const size_t channel ) const;
 
 
+		void setDCOffsetMode( const int direction, const size_t channel, const bool automatic );
+
+
+		bool getDCOffsetMode( const int direction, const size_t channel ) const;
+
+#ifdef SOAPY_SDR_API_HAS_IQ_BALANCE_MODE
+
+		bool hasIQBalanceMode( const int direction, const size_t channel ) const;
+
+
+		void setIQBalanceMode( const int direction, const size_t channel, const bool automatic );
+
+
+		bool getIQBalanceMode( const int direction, const size_t channel ) const;
+
+#endif
+
+
 		/*******************************************************************
 		 * Gain API
 		 ******************************************************************/
@@ -315,9 +691,15 @@ class SoapyPlutoSDR : public SoapySDR::Device{
        
 		bool is_sensor_channel(struct iio_channel *chn) const;
 		double double_from_buf(const char *buf) const;
-		double get_sensor_value(struct iio_channel *chn) const;
+		double read_sensor_value(const pluto_sensor &sensor) const;
 		std::string id_to_unit(const std::string &id) const;
 
+		void discover_sensors();
+
+		void start_sensor_sampler(const long interval_ms);
+		void stop_sensor_sampler();
+		void sensor_sampler(const pluto_thread_policy policy);
+
 		iio_device *dev;
 		iio_device *rx_dev;
 		iio_device *tx_dev;
@@ -326,8 +708,96 @@ class SoapyPlutoSDR : public SoapySDR::Device{
 		mutable pluto_spin_mutex rx_device_mutex;
         mutable pluto_spin_mutex tx_device_mutex;
 
+		// applied to the threads of streams set up afterwards, stream args take precedence
+		pluto_thread_policy rx_thread_policy;
+		pluto_thread_policy tx_thread_policy;
+
+		// sensors found in the context, resolved once at construction
+		std::vector<pluto_sensor> sensors;
+		std::map<std::string, size_t> sensor_index;
+
+		// background sensor sampler, readSensor serves its cache when running
+		std::thread sensor_thread;
+		mutable std::mutex sensor_mutex;
+		std::condition_variable sensor_cond;
+		bool sensor_quit;
+		// 0 when the sampler is stopped, also read without sensor_mutex
+		std::atomic<long> sensor_interval_ms;
+		std::vector<double> sensor_cache;
+
+		// statistics of the TX samples, kept across TX streams and read without the TX lock
+		std::shared_ptr<pluto_tx_meter> tx_meter;
+		std::chrono::steady_clock::time_point sensor_time;
+
+		bool rx_dc_offset_mode;
+		bool rx_iq_balance_mode;
+
+		// host side resampling to application rates the AD9361 chain can't reach,
+		// an app rate of 0 means the stream runs at the hardware rate
+		bool resampler_enabled;
+		double rx_hw_rate, rx_app_rate;
+		double tx_hw_rate, tx_app_rate;
+
+		// RX digital downconversion: the baseband frequency of the tuned center
+		// relative to the LO and the reference error, applied by the DDC stage
+		// of the RX stream, called with rx_device_mutex held
+		void update_rx_ddc();
+		double rx_bb_frequency, rx_ppm;
+
+		// sub-bands of the RX channelizer, exposed as RX channels, 0 when off
+		size_t rx_channelizer_bands;
+
+		// what the raw RX blocks are captured at, for the taps, called with rx_device_mutex held
+		void read_rx_capture(double &sample_rate, double &frequency, double &gain) const;
+
+		// SigMF recording of the raw RX blocks, started with writeSetting("record", path)
+		void start_recording(const std::string &base_path);
+		void stop_recording();
+		std::shared_ptr<pluto_recorder> recorder;
+
+		// shared memory ring of the raw RX blocks, started with writeSetting("shm_publish", name)
+		void start_publishing(const std::string &name);
+		void stop_publishing();
+		std::shared_ptr<pluto_shm_publisher> shm_publisher;
+		size_t shm_size_mb;
+
+		// pre-trigger ring of the raw RX blocks, started with writeSetting("snapshot", path)
+		void start_snapshots(const std::string &base_path);
+		void stop_snapshots();
+		std::shared_ptr<pluto_snapshot> snapshot;
+		double snapshot_pre_ms, snapshot_post_ms;
+		std::string snapshot_threshold;
+
+		// file playback on the TX stream, started with writeSetting("play", path)
+		bool play_loop;
+
+		// joins the playback worker with tx_device_mutex released, called with it
+		// held; tx_playback_mutex, taken ahead of tx_device_mutex by every path
+		// that stops a playback or replaces tx_stream, keeps tx_stream alive meanwhile
+		void stop_tx_playback(std::unique_lock<pluto_spin_mutex> &lock);
+		std::mutex tx_playback_mutex;
+
+		// predistorter coefficients, loaded into the dpd stage of the open TX
+		// stream and passed to the TX streams set up afterwards
+		void load_dpd(const std::string &coeffs);
+		void train_dpd(const std::string &args);
+		void selftest_dpd(const std::string &args);
+		void set_dpd_report(const std::string &report);
+		mutable std::mutex dpd_mutex;
+		std::string dpd_coeffs;
+		std::string dpd_report;
+
 		bool decimation, interpolation;
 		std::unique_ptr<rx_streamer> rx_stream;
+
+		// further RX handles share the iio_buffer of rx_stream, which then reads
+		// through a consumer as well, registered under its own handle
+		SoapySDR::Stream *share_rx_stream(const plutosdrStreamFormat format, const std::vector<size_t> &channels, const SoapySDR::Kwargs &args);
+		std::shared_ptr<rx_consumer> find_rx_consumer(SoapySDR::Stream *handle) const;
+		void update_rx_sharing();
+		std::shared_ptr<pluto_rx_broadcast> rx_broadcast;
+		std::map<SoapySDR::Stream *, std::shared_ptr<rx_consumer>> rx_consumers;
+		mutable std::mutex rx_consumers_mutex;
         std::unique_ptr<tx_streamer> tx_stream;
 		bool UseExtendedTezukaFeatures=false;
 };
@@ -0,0 +1,90 @@
+// Host DSP checks that run without a Pluto, see the ENABLE_TESTS CMake option
+#include "../PlutoSDR_DSP.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(const bool condition, const std::string &what)
+{
+	std::printf("%s: %s\n", condition ? "ok" : "FAILED", what.c_str());
+	if (!condition)
+		failures++;
+}
+
+static double report_value(const std::string &report, const std::string &key)
+{
+	const size_t pos = report.find(key + "=");
+	if (pos == std::string::npos)
+		return 0.0;
+	return std::atof(report.c_str() + pos + key.size() + 1);
+}
+
+// the indirect learning fit must cut the error of the PA model output
+static void test_dpd_selftest()
+{
+	const std::string report = pluto_dpd_selftest(5, 3);
+	const double without_db = report_value(report, "nmse_without_dpd_db");
+	const double with_db = report_value(report, "nmse_with_dpd_db");
+
+	std::printf("  %s\n", report.substr(0, report.find(",coeffs")).c_str());
+	check(without_db < -10.0, "the PA model distorts the test signal");
+	check(with_db < without_db - 20.0, "the predistorter improves the NMSE by 20 dB");
+}
+
+static double papr_db(const std::vector<float> &iq, const size_t skip)
+{
+	double peak = 0.0, power = 0.0;
+	size_t items = 0;
+	for (size_t i = 2 * skip; i + 1 < iq.size(); i += 2, items++) {
+		const double p = double(iq[i]) * iq[i] + double(iq[i + 1]) * iq[i + 1];
+		peak = std::max(peak, p);
+		power += p;
+	}
+	return items ? 10.0 * std::log10(peak * items / power) : 0.0;
+}
+
+static std::vector<float> run_tx_chain(const std::vector<std::string> &names, const std::vector<float> &in,
+	const double app_rate, const double hw_rate)
+{
+	SoapySDR::Kwargs args;
+	args["cfr_papr"] = "7";
+	pluto_dsp_chain chain;
+	pluto_build_tx_chain(chain, names, args, app_rate, hw_rate);
+
+	std::vector<float> out;
+	for (size_t pos = 0; pos < in.size(); pos += 2 * pluto_dsp_block_items)
+		chain.process(in.data() + pos, std::min(pluto_dsp_block_items, (in.size() - pos) / 2), out);
+	return out;
+}
+
+// CFR runs after the resampler, so the interpolated peaks are the ones it clips
+static void test_tx_chain_papr()
+{
+	const double app_rate = 1e6, hw_rate = 2.5e6;
+	std::mt19937 rng(7);
+	std::normal_distribution<float> noise(0.0f, 3000.0f);
+	std::vector<float> in(2 * 16 * pluto_dsp_block_items);
+	for (auto &v : in)
+		v = noise(rng);
+
+	const double resampled_db = papr_db(run_tx_chain({}, in, app_rate, hw_rate), 1024);
+	const double cfr_db = papr_db(run_tx_chain({ "cfr" }, in, app_rate, hw_rate), 1024);
+
+	std::printf("  papr_resampled_db=%g,papr_cfr_db=%g\n", resampled_db, cfr_db);
+	check(cfr_db < resampled_db - 2.0, "CFR lowers the PAPR measured after resampling");
+	check(cfr_db < 7.0 + 1.0, "the PAPR after resampling stays near the CFR target");
+}
+
+int main()
+{
+	test_dpd_selftest();
+	test_tx_chain_papr();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}